@@ -6,10 +6,26 @@
 CC_SRCS += \
 ../src/HashAlgs.cc \
 ../src/RollingWindow.cc \
+../src/block-matcher.cc \
+../src/bloom-filter.cc \
 ../src/city.cc \
 ../src/clsNewVairableChunk.cc \
+../src/dedup-estimator.cc \
+../src/dedup-table-merge.cc \
 ../src/dedup-table.cc \
-../src/dedup-util.cc 
+../src/dedup-util.cc \
+../src/direct-reader.cc \
+../src/file-restore.cc \
+../src/delta-patch.cc \
+../src/large-alloc.cc \
+../src/manifest.cc \
+../src/manifest-diff.cc \
+../src/manifest-cache.cc \
+../src/merkle-tree.cc \
+../src/pack-store.cc \
+../src/scrub.cc \
+../src/tiered-index.cc \
+../src/tree-scanner.cc 
 
 CPP_SRCS += \
 ../src/md5.cpp 
@@ -17,19 +33,51 @@ CPP_SRCS += \
 CC_DEPS += \
 ./src/HashAlgs.d \
 ./src/RollingWindow.d \
+./src/block-matcher.d \
+./src/bloom-filter.d \
 ./src/city.d \
 ./src/clsNewVairableChunk.d \
+./src/dedup-estimator.d \
+./src/dedup-table-merge.d \
 ./src/dedup-table.d \
-./src/dedup-util.d 
+./src/dedup-util.d \
+./src/direct-reader.d \
+./src/file-restore.d \
+./src/delta-patch.d \
+./src/large-alloc.d \
+./src/manifest.d \
+./src/manifest-diff.d \
+./src/manifest-cache.d \
+./src/merkle-tree.d \
+./src/pack-store.d \
+./src/scrub.d \
+./src/tiered-index.d \
+./src/tree-scanner.d 
 
 OBJS += \
 ./src/HashAlgs.o \
 ./src/RollingWindow.o \
+./src/block-matcher.o \
+./src/bloom-filter.o \
 ./src/city.o \
 ./src/clsNewVairableChunk.o \
+./src/dedup-estimator.o \
+./src/dedup-table-merge.o \
 ./src/dedup-table.o \
 ./src/dedup-util.o \
-./src/md5.o 
+./src/direct-reader.o \
+./src/file-restore.o \
+./src/delta-patch.o \
+./src/large-alloc.o \
+./src/manifest.o \
+./src/manifest-diff.o \
+./src/manifest-cache.o \
+./src/merkle-tree.o \
+./src/pack-store.o \
+./src/scrub.o \
+./src/md5.o \
+./src/tiered-index.o \
+./src/tree-scanner.o 
 
 CPP_DEPS += \
 ./src/md5.d 
@@ -23,6 +23,7 @@ const char *getHashFunctionName(int hashFnId) {
   case 3: return "Murmur64";
   case 4: return "Rolling32";
   case 5: return "Rolling64";
+  case 6: return "City128";
   default: return "unknown";
   }
 }
@@ -34,6 +35,8 @@ int getHashFunctionResultBits(int hashFnId) {
     return 32;
   case 2: case 3: case 5:
     return 64;
+  case 6:
+    return 128;
   default:
     return 0;
   }
@@ -15,6 +15,7 @@
 #define HASH_ALG_MURMUR64 3
 #define HASH_ALG_ROLLING32 4
 #define HASH_ALG_ROLLING64 5
+#define HASH_ALG_CITY128 6
 
 
 #define HASH_ALGORITHM HASH_ALG_ROLLING64
@@ -477,7 +478,7 @@ class MappedFileHashRolling : public MappedFileHash {
     prevOffset = I64_MIN;
   }
 
-  // results undefined if offset+blockSize >= length
+  // results undefined if offset+blockSize > length
   hash_t getHash(u64 offset) {
     // if (offset >= length) return 0;
 
@@ -1,6 +1,78 @@
+#include <cassert>
+#include <cmath>
 #include "HashAlgs.h"
 #include "RollingWindow.h"
 
+u64 getWholeFileThreshold(u64 modSize) {
+  return round((1500 * modSize *100)/85)+1;
+}
+
+u64 getPower2_range(u64 n)
+{
+	//u64  x = n;
+	u64  y = 2;
+	u64  upper = pow(2, ceil(log(n) / log(y)));
+	//u64  lower = pow(2, floor(log(n) / log(y)));
+	//return std::make_pair(lower, upper);
+	return upper;
+}
+
+const double pheta = 0.5*(std::sqrt(5) + 1);
+
+long double fib(long double n)
+{
+	return (std::pow(pheta, n) - std::pow(1 - pheta, n)) / std::sqrt(5);
+}
+
+long double fibo_lowerbound(long double  N, long double  min, long double  max)
+{
+	u64  newpivot = (min + max) / 2;
+	if (min == newpivot)
+		return newpivot;
+	if (fib(newpivot) <= N)
+		return fibo_lowerbound(N, newpivot, max);
+	else
+		return fibo_lowerbound(N, min, newpivot);
+}
+
+u64 getFibo_range(u64 n)
+{
+	int ldbcounter = 0;
+	long double tmpN = n;
+	while (tmpN>1)
+	{
+		tmpN = tmpN / 10;
+		ldbcounter++;
+	}
+	//ldbcounter++;
+	long double max = pow(10, ldbcounter);
+	long double lbound = fibo_lowerbound(n, 0, max);
+	//long double tmpReturn = round(fib(lbound + 1));
+	return round(fib(lbound + 1));
+}
+
+RollingWindow::RollingWindow() {
+  chunkSize = minChunkSize = maxChunkSize = modBase = modSize = 0;
+  modValue = ROLLING_WINDOW_MOD_VALUE;
+  slidingWindowSize = ROLLING_WINDOW_SIZE;
+}
+
+void RollingWindow::setAnchor(u64 anchorSize, int intMod) {
+  chunkSize = anchorSize;
+  if (intMod == 1) {
+    /*if anchor fix, the optimal minimum chunk size is 85% of the hash modulo,
+      and the optimal maximum chunk size is 200% of the hash modulo.*/
+    minChunkSize = chunkSize;
+    maxChunkSize = chunkSize;
+  } else {
+    /*According to Eshghi [5], the optimal minimum chunk size is 85% of the hash modulo,
+      and the optimal maximum chunk size is 200% of the hash modulo.*/
+    minChunkSize = (chunkSize * 85) / 100;
+    maxChunkSize = chunkSize * 2;
+  }
+  modBase = chunkSize;
+}
+
 unsigned RollingWindow::getChunkLength(const unsigned char *chunkStart, u64 bytesRemaining) {
 
   SlidingWindowHash hasher;
@@ -45,3 +117,72 @@ unsigned RollingWindow::getChunkLength(const unsigned char *chunkStart, u64 byte
 
   return (unsigned)(chunkEnd - chunkStart);
 }
+
+
+bool RollingWindow::endsChunk(const unsigned char *chunkStart, u64 chunkLen, u64 bytesRemaining) {
+  if (bytesRemaining <= minChunkSize)
+    return chunkLen == bytesRemaining;
+  if (chunkLen < minChunkSize || chunkLen > maxChunkSize
+      || chunkLen > bytesRemaining)
+    return false;
+  if (chunkLen == maxChunkSize || chunkLen == bytesRemaining)
+    return true;
+
+  // the same window getChunkLength() tests at this point
+  SlidingWindowHash hasher;
+  hasher.addChars(chunkStart + chunkLen - slidingWindowSize, slidingWindowSize);
+  return (hasher.getHash() % modBase) == modValue;
+}
+
+
+void chunkMultiple(const unsigned char *data, u64 len,
+		   const std::vector<RollingWindow> &windows,
+		   const std::function<void(size_t, u64, unsigned)> &emit) {
+  size_t count = windows.size();
+  if (count == 0 || len == 0) return;
+
+  u64 windowSize = windows[0].slidingWindowSize;
+  for (size_t s=0; s < count; s++)
+    assert(windows[s].slidingWindowSize == windowSize);
+
+  // start of each setting's current chunk, and the first end position
+  // where it could be cut; a setting is finished when start == len
+  std::vector<u64> start(count, 0), firstCut(count);
+  size_t active = count;
+
+  // A setting whose remaining data is no more than its minimum chunk
+  // size takes all of it, as getChunkLength() does.
+  auto beginChunk = [&](size_t s, u64 pos) {
+    const RollingWindow &w = windows[s];
+    if (pos < len && len - pos <= w.minChunkSize) {
+      emit(s, pos, (unsigned)(len - pos));
+      pos = len;
+    }
+    start[s] = pos;
+    firstCut[s] = pos + w.minChunkSize;
+    if (pos == len) active--;
+  };
+  for (size_t s=0; s < count; s++) beginChunk(s, 0);
+
+  SlidingWindowHash hasher;
+  for (u64 end = 1; end <= len && active; end++) {
+    // hash of the window ending at 'end'
+    if (end <= windowSize)
+      hasher.addChar(data[end-1]);
+    else
+      hasher.moveChar(data[end-1], data[end-1-windowSize]);
+    unsigned hash = hasher.getHash();
+
+    for (size_t s=0; s < count; s++) {
+      if (end < firstCut[s] || start[s] == len) continue;
+      const RollingWindow &w = windows[s];
+      u64 chunkLen = end - start[s];
+
+      if ((end >= windowSize && hash % w.modBase == w.modValue)
+	  || chunkLen >= w.maxChunkSize || end == len) {
+	emit(s, start[s], (unsigned) chunkLen);
+	beginChunk(s, end);
+      }
+    }
+  }
+}
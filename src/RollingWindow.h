@@ -1,7 +1,59 @@
+#ifndef __ROLLING_WINDOW_H__
+#define __ROLLING_WINDOW_H__
+
+#include <cstddef>
+#include <functional>
+#include <vector>
 #include "u64.h"
+
+// defaults for the cut condition; ProcessFileToVar() sets its own
+#define ROLLING_WINDOW_MOD_VALUE 23
+#define ROLLING_WINDOW_SIZE 48
+
+// Files no bigger than this are not split by ProcessFileToVar().
+// With a 1500 byte MTU that's ROUND(1500 * modSize * (100/85)) + 1.
+u64 getWholeFileThreshold(u64 modSize);
+
+// smallest power of 2 at least n; the anchor chunk size for a file of
+// n * modSize bytes
+u64 getPower2_range(u64 n);
+
+// Fibonacci number just above n; the alternative to getPower2_range()
+// when bolFIB is set
+u64 getFibo_range(u64 n);
+
 class RollingWindow
 {
 public:
+	RollingWindow();
 	unsigned getChunkLength(const unsigned char *chunkStart, u64 bytesRemaining);
+
+	// Whether getChunkLength() could end a chunk of chunkLen bytes where
+	// it ends: at the end of the data, at the maximum size, or where the
+	// window hash says to.  Only the end is checked, not that there's no
+	// earlier cut, so this is cheap.
+	bool endsChunk(const unsigned char *chunkStart, u64 chunkLen, u64 bytesRemaining);
+
+	// Set chunkSize and the limits derived from it.  intMod 1 gives
+	// fixed-size chunks, anything else variable-size ones.
+	void setAnchor(u64 anchorSize, int intMod);
+
 	u64 chunkSize, minChunkSize, maxChunkSize, modBase, modValue, slidingWindowSize, modSize;
 };
+
+/*
+  Chunk the same data with several settings in one pass.  The rolling
+  hash of the window ending at a given byte doesn't depend on where the
+  current chunk started, so it is computed once per byte and each
+  setting only tests its own cut condition against it.  Every setting
+  gets exactly the chunks its getChunkLength() would give.  All the
+  settings must have the same slidingWindowSize.
+
+  emit(settingNo, start, len) is called for each chunk, in order within
+  each setting.
+*/
+void chunkMultiple(const unsigned char *data, u64 len,
+		   const std::vector<RollingWindow> &windows,
+		   const std::function<void(size_t, u64, unsigned)> &emit);
+
+#endif // __ROLLING_WINDOW_H__
@@ -0,0 +1,221 @@
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include "block-matcher.h"
+#include "dedup-util.h"
+#include "HashAlgs.h"
+
+using namespace std;
+
+
+BlockMatcher::BlockMatcher(DedupTable *table_, u64 oldLength_)
+  : table(table_), oldLength(oldLength_) {
+  matchedBytes = literalBytes = weakHits = strongMisses = 0;
+}
+
+
+void appendDeltaInstruction(vector<DeltaInstruction> &out,
+			    const DeltaInstruction &inst) {
+  if (!out.empty()) {
+    DeltaInstruction &prev = out.back();
+    if (prev.type == inst.type && prev.start + prev.len == inst.start
+	&& (inst.type == DeltaInstruction::LITERAL
+	    || prev.src + prev.len == inst.src)) {
+      prev.len += inst.len;
+      return;
+    }
+  }
+  out.push_back(inst);
+}
+
+
+bool BlockMatcher::match(const unsigned char *data, u64 length,
+			 vector<DeltaInstruction> &out) {
+  if (!table->hasStrongHashes()) {
+    fprintf(stderr, "Block matching needs a table with strong hashes.\n");
+    return false;
+  }
+
+  unsigned blockSize = table->getBlockSize();
+  unsigned usableBlocks = (unsigned)(oldLength / blockSize);
+  vector<unsigned> candidates;
+
+#ifdef HASH_ALGORITHM_IS_ROLLING
+  MappedFileHashRolling roller(data, length, blockSize);
+#endif
+
+  out.clear();
+  u64 pos = 0, literalStart = 0;
+
+  // the block after the last one copied; checked first, since edits
+  // usually leave long runs of blocks in order
+  unsigned nextBlockNo = 0;
+
+  while (pos + blockSize <= length) {
+#ifdef HASH_ALGORITHM_IS_ROLLING
+    hash_t weak = DedupTable::filterHash(roller.getHash(pos));
+#else
+    hash_t weak = DedupTable::hash(data + pos, blockSize);
+#endif
+
+    if (table->hasMatch(weak)) {
+      weakHits++;
+      u128 strong = DedupTable::strongHash(data + pos, blockSize);
+
+      unsigned found = UINT_MAX;
+      if (nextBlockNo < usableBlocks
+	  && table->getBlockHash(nextBlockNo) == weak
+	  && table->getBlockStrongHash(nextBlockNo) == strong) {
+	found = nextBlockNo;
+      } else {
+	table->findHashedAllMatches(weak, candidates,
+				    BLOCK_MATCHER_MAX_CANDIDATES);
+	for (size_t i=0; i < candidates.size(); i++) {
+	  if (candidates[i] < usableBlocks
+	      && table->getBlockStrongHash(candidates[i]) == strong) {
+	    found = candidates[i];
+	    break;
+	  }
+	}
+      }
+
+      if (found != UINT_MAX) {
+	if (pos > literalStart) {
+	  appendDeltaInstruction(out, DeltaInstruction
+				 (DeltaInstruction::LITERAL, literalStart,
+				  pos - literalStart));
+	  literalBytes += pos - literalStart;
+	}
+	appendDeltaInstruction(out, DeltaInstruction
+			       (DeltaInstruction::COPY, pos, blockSize,
+				(u64)found * blockSize));
+	matchedBytes += blockSize;
+	nextBlockNo = found + 1;
+	pos += blockSize;
+	literalStart = pos;
+	continue;
+      }
+
+      strongMisses++;
+    }
+
+    pos++;
+  }
+
+  if (length > literalStart) {
+    appendDeltaInstruction(out, DeltaInstruction
+			   (DeltaInstruction::LITERAL, literalStart,
+			    length - literalStart));
+    literalBytes += length - literalStart;
+  }
+
+  return true;
+}
+
+
+DedupTable *loadOrBuildMatchTable(const char *oldPath, const char *tablePath,
+				  unsigned blockSize) {
+  DedupTable *table = NULL;
+  u64 oldSize = getFileSize(oldPath), oldModTime = getFileModTime(oldPath);
+
+  if (tablePath && *tablePath && fileExists(tablePath)) {
+    table = DedupTable::readFromFile(tablePath);
+    if (table && !table->hasStrongHashes()) {
+      fprintf(stderr, "\"%s\" has no strong hashes.\n", tablePath);
+      delete table;
+      return NULL;
+    }
+
+    // copies from a table of another old file, or of another version
+    // of this one, would point at the wrong bytes
+    if (table && (table->getBlockSize() != blockSize
+		  || table->getSourceSize() != oldSize
+		  || table->getSourceModTime() != oldModTime
+		  || !oldModTime)) {
+      fprintf(stderr, "\"%s\" doesn't match \"%s\"; rebuilding it.\n",
+	      tablePath, oldPath);
+      delete table;
+      table = NULL;
+    }
+    if (table) return table;
+  }
+
+  table = DedupTable::createFromFile(oldPath, blockSize, true);
+  if (!table) return NULL;
+
+  // not if it changed while it was read
+  if (getFileModTime(oldPath) == oldModTime
+      && getFileSize(oldPath) == oldSize)
+    table->setSource(oldSize, oldModTime);
+  if (tablePath && *tablePath)
+    table->writeToFile(tablePath);
+  return table;
+}
+
+
+string returnDeltaString;
+
+extern "C" {
+  /*
+    Compute copy/literal instructions that turn the file at chrOldPath
+    into the one at chrNewPath.
+
+    If chrTablePath names an existing serialized DedupTable built from
+    the old file as it is now, with blockSize, it is used as the index
+    of the old file, otherwise one is built from the old file and, if
+    chrTablePath is not empty, saved there for next time.
+
+    Output, one line per instruction:
+      copy	<start in new>	<len>	<start in old>
+      literal	<start in new>	<len>
+    or with boljson, [{"type":"copy","start":..,"len":..,"src":..},..]
+  */
+  const char *ProcessFileToDelta(const char *chrOldPath,
+				 const char *chrTablePath,
+				 const char *chrNewPath,
+				 unsigned blockSize, bool boljson) {
+    stringstream ssbuffer;
+    returnDeltaString.clear();
+
+    DedupTable *table = loadOrBuildMatchTable(chrOldPath, chrTablePath,
+					      blockSize);
+    if (!table) return returnDeltaString.c_str();
+
+    // a file that exists but can't be mapped has a length and no data
+    MemoryMappedFile newFile;
+    if (!newFile.mapFile(chrNewPath) && newFile.getLength()) {
+      delete table;
+      return returnDeltaString.c_str();
+    }
+
+    BlockMatcher matcher(table, getFileSize(chrOldPath));
+    vector<DeltaInstruction> insts;
+    matcher.match((const unsigned char *)newFile.getAddress(),
+		  newFile.getLength(), insts);
+    newFile.close();
+    delete table;
+
+    if (boljson) ssbuffer << "[";
+    for (size_t i=0; i < insts.size(); i++) {
+      const DeltaInstruction &inst = insts[i];
+      bool isCopy = inst.type == DeltaInstruction::COPY;
+      if (boljson) {
+	if (i) ssbuffer << ",";
+	ssbuffer << "{\"type\":\"" << (isCopy ? "copy" : "literal")
+		 << "\",\"start\":" << inst.start << ",\"len\":" << inst.len;
+	if (isCopy) ssbuffer << ",\"src\":" << inst.src;
+	ssbuffer << "}";
+      } else {
+	ssbuffer << (isCopy ? "copy" : "literal") << "\t" << inst.start
+		 << "\t" << inst.len;
+	if (isCopy) ssbuffer << "\t" << inst.src;
+	ssbuffer << "\n";
+      }
+    }
+    if (boljson) ssbuffer << "]";
+
+    returnDeltaString = ssbuffer.str();
+    return returnDeltaString.c_str();
+  }
+}
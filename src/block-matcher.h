@@ -0,0 +1,86 @@
+#ifndef __BLOCK_MATCHER_H__
+#define __BLOCK_MATCHER_H__
+
+#include <vector>
+#include "u64.h"
+#include "dedup-table.h"
+
+// maximum number of blocks sharing a weak hash that are checked with
+// the strong hash before giving up on an offset
+#define BLOCK_MATCHER_MAX_CANDIDATES 16
+
+
+// One step of rebuilding a new file: either copy a range of the old
+// file, or take a range of the new file verbatim.
+struct DeltaInstruction {
+  enum Type {COPY, LITERAL};
+
+  Type type;
+
+  // offset of this range in the new file
+  u64 start;
+
+  u64 len;
+
+  // COPY: offset of the range in the old file
+  u64 src;
+
+  DeltaInstruction() {}
+  DeltaInstruction(Type t, u64 s, u64 l, u64 o=0)
+    : type(t), start(s), len(l), src(o) {}
+};
+
+// Append inst to out, merging it into the last instruction if it
+// continues it.
+void appendDeltaInstruction(std::vector<DeltaInstruction> &out,
+			    const DeltaInstruction &inst);
+
+// If tablePath names a saved DedupTable with strong hashes that was
+// built from oldPath as it is now, with blockSize, read it.  Otherwise
+// build one with strong hashes from oldPath, and save it to tablePath
+// unless that is NULL or empty.  The old file's size and modification
+// time are saved with the table to tell.  Returns NULL on error.
+DedupTable *loadOrBuildMatchTable(const char *oldPath, const char *tablePath,
+				  unsigned blockSize);
+
+
+/*
+  rsync-style matching of a new file against a DedupTable built from an
+  old one.
+
+  The new file is scanned one byte at a time with MappedFileHashRolling,
+  so a block that moved by any number of bytes is still found.  Offsets
+  whose weak (rolling) hash is in the table are confirmed with the
+  table's strong hash before being turned into a copy, so the table must
+  have been built with strong hashes.  Runs of adjacent copied blocks
+  are merged into a single instruction.
+*/
+class BlockMatcher {
+  DedupTable *table;
+
+  // length of the old file; blocks that extend past it were zero-padded
+  // when the table was built and can't be copied
+  u64 oldLength;
+
+  u64 matchedBytes, literalBytes;
+
+  // offsets where the weak hash matched, and how many of those the
+  // strong hash rejected
+  u64 weakHits, strongMisses;
+
+ public:
+  BlockMatcher(DedupTable *table_, u64 oldLength_);
+
+  // Fill 'out' with instructions that rebuild data[0..length) from the
+  // old file.  Returns false if the table has no strong hashes.
+  bool match(const unsigned char *data, u64 length,
+	     std::vector<DeltaInstruction> &out);
+
+  u64 getMatchedBytes() {return matchedBytes;}
+  u64 getLiteralBytes() {return literalBytes;}
+  u64 getWeakHits() {return weakHits;}
+  u64 getStrongMisses() {return strongMisses;}
+};
+
+
+#endif // __BLOCK_MATCHER_H__
@@ -0,0 +1,79 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "bloom-filter.h"
+#include "large-alloc.h"
+
+
+BlockedBloomFilter::BlockedBloomFilter(unsigned blockCount_) {
+  blockCount = blockCount_;
+  allocateWords();
+}
+
+
+BlockedBloomFilter::BlockedBloomFilter(u64 expectedEntries,
+				       unsigned bitsPerEntry) {
+  u64 bits = expectedEntries * bitsPerEntry;
+  u64 blocks = (bits + BLOOM_FILTER_BLOCK_SIZE*8 - 1)
+    / (BLOOM_FILTER_BLOCK_SIZE*8);
+
+  // round up to a power of 2 so a block can be selected with a mask
+  blockCount = 1;
+  while (blockCount < blocks && blockCount < 0x80000000) blockCount <<= 1;
+
+  allocateWords();
+}
+
+
+BlockedBloomFilter::~BlockedBloomFilter() {
+  largeFree(words, byteSize());
+}
+
+
+// allocate zero-filled memory for blockCount blocks
+void BlockedBloomFilter::allocateWords() {
+  words = (u64*) largeAlloc(byteSize());
+  if (!words) {
+    fprintf(stderr, "Failed to allocate %llu bytes for Bloom filter\n",
+	    byteSize());
+    exit(1);
+  }
+  addCount = 0;
+}
+
+
+void BlockedBloomFilter::clear() {
+  memset(words, 0, byteSize());
+  addCount = 0;
+}
+
+
+u64 BlockedBloomFilter::writeToFile(FILE *outf) const {
+  u64 bytesWritten = 0;
+  bytesWritten += fwrite(&blockCount, 1, sizeof(unsigned), outf);
+  bytesWritten += fwrite(&addCount, 1, sizeof(u64), outf);
+  bytesWritten += fwrite(words, 1, byteSize(), outf);
+  return bytesWritten;
+}
+
+
+BlockedBloomFilter *BlockedBloomFilter::readFromFile(FILE *inf) {
+  unsigned blockCount;
+  u64 addCount;
+
+  if (sizeof(unsigned) != fread(&blockCount, 1, sizeof(unsigned), inf))
+    return NULL;
+  if (sizeof(u64) != fread(&addCount, 1, sizeof(u64), inf))
+    return NULL;
+
+  // must be a nonzero power of 2
+  if (blockCount == 0 || (blockCount & (blockCount-1))) return NULL;
+
+  BlockedBloomFilter *filter = new BlockedBloomFilter(blockCount);
+  if (filter->byteSize() != fread(filter->words, 1, filter->byteSize(), inf)) {
+    delete filter;
+    return NULL;
+  }
+  filter->addCount = addCount;
+  return filter;
+}
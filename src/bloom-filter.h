@@ -0,0 +1,106 @@
+#ifndef __BLOOM_FILTER_H__
+#define __BLOOM_FILTER_H__
+
+#include <cstdio>
+#include "u64.h"
+
+// default number of filter bits per expected entry; gives roughly a 1%
+// false positive rate with the blocked layout below
+#define BLOOM_FILTER_BITS_PER_ENTRY 12
+
+// bytes per block; one cache line
+#define BLOOM_FILTER_BLOCK_SIZE 64
+
+
+/*
+  Blocked Bloom filter, used as a front-end to a hash index so lookups of
+  keys that were never added can be rejected without walking the index.
+
+  All the bits for one key live in a single 64-byte block, one bit in each
+  of the block's eight 64-bit words, so a lookup costs one cache miss no
+  matter how many bits are tested.  There are no false negatives.
+
+  Keys are expected to be hash values already, but they are remixed
+  before use because the rolling hash used by DedupTable has weak
+  low-order bits.
+*/
+class BlockedBloomFilter {
+  // blockCount * 8 words
+  u64 *words;
+
+  // number of 64-byte blocks, a power of 2
+  unsigned blockCount;
+
+  // number of keys added
+  u64 addCount;
+
+  BlockedBloomFilter(unsigned blockCount_);
+
+  // allocate zero-filled memory for blockCount blocks
+  void allocateWords();
+
+  // Murmur3 finalizer
+  static u64 remix(u64 k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  }
+
+  const u64 *getBlock(u64 mixed) const {
+    return words + ((mixed >> 32) & (blockCount-1)) * 8;
+  }
+
+  // bit number (0..63) for word i of a block
+  static unsigned getBit(u64 mixed, int i) {
+    static const unsigned salt[8] = {
+      0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+      0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+    };
+    return ((unsigned)mixed * salt[i]) >> 26;
+  }
+
+ public:
+  // Sized for 'expectedEntries' keys at bitsPerEntry bits each.
+  BlockedBloomFilter(u64 expectedEntries,
+		     unsigned bitsPerEntry = BLOOM_FILTER_BITS_PER_ENTRY);
+  ~BlockedBloomFilter();
+
+  void add(u64 key) {
+    u64 mixed = remix(key);
+    u64 *block = (u64*) getBlock(mixed);
+    for (int i=0; i < 8; i++)
+      block[i] |= 1ULL << getBit(mixed, i);
+    addCount++;
+  }
+
+  // Returns false if key was definitely never added.
+  bool mayContain(u64 key) const {
+    u64 mixed = remix(key);
+    const u64 *block = getBlock(mixed);
+    for (int i=0; i < 8; i++)
+      if (!(block[i] & (1ULL << getBit(mixed, i)))) return false;
+    return true;
+  }
+
+  // address of the block that add() or mayContain() will touch for key
+  const void *blockAddress(u64 key) const {
+    return getBlock(remix(key));
+  }
+
+  void clear();
+
+  u64 getAddCount() const {return addCount;}
+  u64 byteSize() const {return (u64)blockCount * BLOOM_FILTER_BLOCK_SIZE;}
+
+  // Serialize the filter, return the number of bytes written.
+  u64 writeToFile(FILE *outf) const;
+
+  // Read a filter written by writeToFile(), or return NULL on error.
+  static BlockedBloomFilter *readFromFile(FILE *inf);
+};
+
+
+#endif // __BLOOM_FILTER_H__
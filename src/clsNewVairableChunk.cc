@@ -33,7 +33,10 @@ chunk	1592105	64618	926ea86ab729bfe3473a529d958097ab
 #include <cstdlib>
 #include <cstdio>
 #include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <map>
+#include <unordered_map>
 #include "dedup-util.h"
 #include "HashAlgs.h"
 #include "RollingWindow.h"
@@ -53,9 +56,22 @@ chunk	1592105	64618	926ea86ab729bfe3473a529d958097ab
 
 #include <string>
 #include <iostream>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "md5.h"
+#include "tiered-index.h"
+#include "large-alloc.h"
+#include "direct-reader.h"
+#include "tree-scanner.h"
+#include "manifest-cache.h"
+#include "manifest.h"
+#include "pack-store.h"
+#include "file-restore.h"
+#include "scrub.h"
+#include "merkle-tree.h"
+#include "manifest-diff.h"
 
 using namespace std;
 
@@ -111,6 +127,58 @@ bool bolVAR = DEFAULT_VAR;
 //default minmum null length, logically small is better but took longer time and slower.
 #define DEFAULT_MIN_NULL_LEN 64
 
+// bits for SetChunkOptions()
+
+// Runs of zero bytes at least a minimum chunk long, including holes in
+// sparse files, are cut out of the data and stored as canonical zero
+// chunks of up to the maximum chunk size.  The runs are found
+// DEFAULT_MIN_NULL_LEN bytes at a time, holes are never read, and the
+// digests of a zero chunk are only computed once per length.
+#define CHUNK_OPT_ZERO_RUNS 0x1
+
+// Page cache policy for files that are mapped: read sequentially with
+// readahead past the chunker, drop what the chunker is done with from
+// the page cache so a big backup doesn't push out other services' data,
+// and prefault smaller files.  See MAPPED_FILE_SEQUENTIAL,
+// MAPPED_FILE_DROP_BEHIND and MAPPED_FILE_POPULATE.
+#define CHUNK_OPT_SEQUENTIAL 0x2
+#define CHUNK_OPT_DROP_BEHIND 0x4
+#define CHUNK_OPT_POPULATE 0x8
+
+// Read files that are split into chunks with O_DIRECT instead of
+// mapping them; see DirectFileReader.  The page cache is bypassed, so
+// cold data costs neither page faults nor evictions.  Files whose
+// maximum chunk is over DIRECT_READ_MAX_CHUNK are still mapped, since
+// every chunk has to fit in one buffer, and zero runs aren't looked for.
+#define CHUNK_OPT_DIRECT_READ 0x10
+
+// largest maximum chunk size read with CHUNK_OPT_DIRECT_READ; the
+// reader's buffers take about six times this
+#define DIRECT_READ_MAX_CHUNK (64*1024*1024)
+
+// The file line's hash is the root of a MerkleTree over the chunks'
+// digests, as printed, instead of a digest of all the file's bytes.
+// The bytes are then only hashed once, per chunk, and two versions of
+// a file can be compared, or part of one checked, by ranges of chunks.
+#define CHUNK_OPT_MERKLE_ROOT 0x20
+
+unsigned chunkOptions = 0;
+
+// number of zero chunk lengths whose digests are kept
+#define ZERO_CHUNK_CACHE_SIZE 1024
+
+// fixed-size chunks hashed in parallel at a time; see writeFixedChunks()
+#define FIXED_CHUNK_BATCH 1024
+
+// don't start another hashing thread for less than this many bytes
+#define MIN_BYTES_PER_THREAD (1024*1024)
+
+// files ProcessFilesToVar() opens and reads ahead of the one it's on
+#define BATCH_READAHEAD_FILES 32
+
+// threads for hashing chunks, 0 for one per core; see SetChunkThreads()
+unsigned chunkThreads = 0;
+
 // hash function for the whole file
 typedef u128 file_hash_t;
 #define FILE_HASH_FN cityHash128
@@ -145,51 +213,19 @@ struct LengthAndCount {
 	}
 };
 
-u64 getPower2_range(u64 n)
-{
-	//u64  x = n;
-	u64  y = 2;
-	u64  upper = pow(2, ceil(log(n) / log(y)));
-	//u64  lower = pow(2, floor(log(n) / log(y)));
-	//return std::make_pair(lower, upper);
-	return upper;
-}
-
-const double pheta = 0.5*(std::sqrt(5) + 1);
-
-long double fib(long double n)
-{
-	return (std::pow(pheta, n) - std::pow(1 - pheta, n)) / std::sqrt(5);
-}
-
-long double fibo_lowerbound(long double  N, long double  min, long double  max)
-{
-	u64  newpivot = (min + max) / 2;
-	if (min == newpivot)
-		return newpivot;
-	if (fib(newpivot) <= N)
-		return fibo_lowerbound(N, newpivot, max);
-	else
-		return fibo_lowerbound(N, min, newpivot);
-}
-
-u64 getFibo_range(u64 n)
-{
-	int ldbcounter = 0;
-	long double tmpN = n;
-	while (tmpN>1)
-	{
-		tmpN = tmpN / 10;
-		ldbcounter++;
-	}
-	//ldbcounter++;
-	long double max = pow(10, ldbcounter);
-	long double lbound = fibo_lowerbound(n, 0, max);
-	//long double tmpReturn = round(fib(lbound + 1));
-	return round(fib(lbound + 1));
-}
+// If open, SLO segments are appended here instead of being written to
+// a file each.  See OpenPackStore().
+PackStore *packStore = NULL;
 
 void GenSLOFiles(const char *ofpath, const char *ofname, const char *pos, unsigned len){
+	if (packStore){
+		// ofname is the segment's MD5
+		u128 digest;
+		digest.lo = digest.hi = 0;
+		if (digest.fromHex(ofname) && packStore->add(digest, pos, len)) return;
+		fprintf(stderr, "Cannot pack segment %s\n", ofname);
+		return;
+	}
 	ofstream of;
 	string strpath = (string)ofpath + (string)ofname;
 	of.open(strpath.c_str(), ofstream::binary);
@@ -202,92 +238,355 @@ typedef map<chunk_hash_t, OffsetLen> chunkMapType;
 chunkMapType chunkMap;
 string returnBufferString, returnCityHash, returnGetString;
 
-/*
-* Class:     clsJavaVariableChunk
-* Method:    getVariableChunkProfile
-* Signature: (Ljava/lang/String;)Ljava/lang/String;
-*/
+// If open, the output for files that haven't changed since they were
+// last read comes from here.  See OpenManifestCache().
+ManifestCache *manifestCache = NULL;
+
+// If open, chunks are recorded here instead of in chunkMap, so the set
+// of known chunks isn't limited by memory.  See OpenChunkIndex().
+TieredIndex *chunkIndex = NULL;
+
+// If set, every chunk indexed is added here too, for the manifest cache.
+vector<ManifestCache::Chunk> *indexedChunks = NULL;
+
+// If set, the MerkleTree leaf of every chunk written is added here, for
+// CHUNK_OPT_MERKLE_ROOT.
+vector<u128> *merkleLeaves = NULL;
+
+// remember where a chunk was first seen
+static void indexChunk(const chunk_hash_t &hash, u64 offset, unsigned len) {
+	if (indexedChunks) {
+		ManifestCache::Chunk chunk;
+		chunk.hash = hash;
+		chunk.offset = offset;
+		chunk.len = len;
+		chunk.unused = 0;
+		indexedChunks->push_back(chunk);
+	}
+	if (chunkIndex) {
+		chunkIndex->insert(hash, ChunkLocation(offset, len));
+		return;
+	}
+	chunkMapType::iterator existing = chunkMap.find(hash);
+	if (existing == chunkMap.end()) {
+		chunkMap[hash] = OffsetLen(offset, len);
+	}
+}
 
-//JNIEXPORT jstring JNICALL
-//Java_clsCityHashCalc_clsJavaVariableChunk_getVariableChunkProfile(JNIEnv *env, jobject obj, jstring clsJavaVariableChunk, jint intMod)
-//const char *clsVairableChunk::ProcessFileToVar(const char *FilePath, int intMod)
-//
-//string returnBufferString, returnCityHash, returnGetString;
-extern "C" {
-	const char *ProcessFileToVar(const char *chrFilePath, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+// digests of a chunk of zero bytes
+struct ZeroChunk {
+	chunk_hash_t hash;
+	string md5;
+};
 
-	//intPower 0 is new # is anchor
-	//intMod 0 is whole file, 1 is fix and 2 is var
-	//intDivide , if 64 , then chunks # between 32 ~ 74, if 32 , then chunks # between 16 ~ 40 .. etc
-	//intRefactor, 0 is no refactor, 3 is currect anchor - original anchor > 3, then we refactor using new anchor.
+map<unsigned, ZeroChunk> zeroChunks;
 
-	//stringstream return buffer
-	stringstream ssbuffer;
+// zero bytes that are never written to, for hashing and writing zero
+// chunks; pages that are only read all map to the kernel's zero page
+char *zeroBuffer = NULL;
+u64 zeroBufferSize = 0;
 
-	string strFilename = (string)chrFilePath;
-	//string strFilename = strFilePath;
+// make zeroBuffer at least len bytes; false if it can't be allocated
+static bool reserveZeroBuffer(u64 len) {
+	if (len <= zeroBufferSize) return true;
+	if (zeroBuffer) largeFree(zeroBuffer, zeroBufferSize);
+	zeroBuffer = (char*) largeAlloc(len);
+	zeroBufferSize = zeroBuffer ? len : 0;
+	return zeroBuffer != NULL;
+}
 
-	// declare mappedFile object
-	MemoryMappedFile mappedFile;
-	// map file into memory
-	mappedFile.mapFile(chrFilePath);
-	//mappedFile.mapFile(strFilePath.c_str());
+// digests of len zero bytes; zeroBuffer must hold at least that many
+static const ZeroChunk &getZeroChunk(unsigned len) {
+	map<unsigned, ZeroChunk>::iterator it = zeroChunks.find(len);
+	if (it != zeroChunks.end()) return it->second;
 
-	//declare data as the pointer for file content
-	const char *data = (const char *)mappedFile.getAddress();
+	if (zeroChunks.size() >= ZERO_CHUNK_CACHE_SIZE) zeroChunks.clear();
+	ZeroChunk &zero = zeroChunks[len];
+	zero.hash = CHUNK_HASH_FN(zeroBuffer, len);
+	zero.md5 = MD5((const byte*)zeroBuffer, len).toStr();
+	return zero;
+}
 
-	//declare len as file size
+// add the output for one chunk to ssbuffer; with bolslo, write the
+// chunk out too
+static void writeChunk(stringstream &ssbuffer, u64 start, unsigned chunkLen, const char *chunkData, const chunk_hash_t &hash, const string &strChunkMD5, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	char hashBuf[80];
+	if (merkleLeaves){
+		u128 digest = hash;
+		if (bolhash) digest.fromHex(strChunkMD5.c_str());
+		merkleLeaves->push_back(MerkleTree::leafHash(digest, chunkLen));
+	}
+	if (bolhash){
+		if (boljson){
+			if (bolslo){
+				ssbuffer << "{\"path\":\"/chunks/" << strChunkMD5  << "\",\"size_bytes\":" << chunkLen << ",\"etag\":\"" << strChunkMD5 << "\"},";
+				GenSLOFiles(ofpath, strChunkMD5.c_str(), chunkData, chunkLen);
+			}
+			else{
+				ssbuffer << "{\"type\":\"chunk\",\"start\":" << start << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << strChunkMD5 << "\"},";}
+			}
+		else{ssbuffer << "chunk\t" << start << "\t" << chunkLen << "\t" << 0 << "\t" << strChunkMD5 << "\n";}
+
+	}else{
+		if (boljson){ssbuffer << "{\"type\":\"chunk\",\"start\":" << start << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << hash.toHex(hashBuf) << "\"},";}
+		else{ssbuffer << "chunk\t" << start << "\t" << chunkLen << "\t" << 0 << "\t" << hash.toHex(hashBuf) << "\n";}
+	}
+}
+
+// number of threads worth using to hash this many bytes
+static unsigned hashThreadCount(u64 bytes) {
+	u64 threads = chunkThreads ? chunkThreads : defaultThreadCount();
+	u64 useful = bytes / MIN_BYTES_PER_THREAD;
+	if (threads > useful) threads = useful;
+	return threads ? (unsigned)threads : 1;
+}
+
+// a chunk whose boundaries are known; zero chunks are from a zero run
+struct ChunkSpan {
+	u64 offset;
+	unsigned len;
+	bool zero;
+};
+
+// Hash a batch of chunks in parallel, along with adding them in order to
+// fileMD5, then index and write them out in order.  data holds the file
+// from offset dataOffset on.
+static void hashChunks(stringstream &ssbuffer, const vector<ChunkSpan> &batch, const char *data, u64 dataOffset, MD5 &fileMD5, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	vector<chunk_hash_t> hashes(batch.size());
+	vector<string> md5s(bolhash ? batch.size() : 0);
+	u64 batchBytes = 0;
+	for (size_t i=0; i < batch.size(); i++)
+		if (!batch[i].zero) batchBytes += batch[i].len;
+
+	// the last item is the whole batch for the file's MD5, unless the
+	// file's hash is a Merkle root
+	parallelFor((unsigned)batch.size() + (merkleLeaves ? 0 : 1), hashThreadCount(batchBytes), [&](unsigned i) {
+		if (i == batch.size()) {
+			for (size_t j=0; j < batch.size(); j++)
+				fileMD5.update((const byte*)(batch[j].zero ? zeroBuffer : data + (batch[j].offset - dataOffset)), batch[j].len);
+			return;
+		}
+		const ChunkSpan &chunk = batch[i];
+		if (chunk.zero) return;
+		const char *chunkData = data + (chunk.offset - dataOffset);
+		hashes[i] = CHUNK_HASH_FN(chunkData, chunk.len);
+		if (bolhash) md5s[i] = MD5((const byte*)chunkData, chunk.len).toStr();
+	});
+
+	for (size_t i=0; i < batch.size(); i++) {
+		const ChunkSpan &chunk = batch[i];
+		if (chunk.zero) {
+			const ZeroChunk &zero = getZeroChunk(chunk.len);
+			indexChunk(zero.hash, chunk.offset, chunk.len);
+			writeChunk(ssbuffer, chunk.offset, chunk.len, zeroBuffer, zero.hash, zero.md5, boljson, bolhash, ofpath, bolslo);
+		} else {
+			indexChunk(hashes[i], chunk.offset, chunk.len);
+			writeChunk(ssbuffer, chunk.offset, chunk.len, data + (chunk.offset - dataOffset), hashes[i], bolhash ? md5s[i] : string(), boljson, bolhash, ofpath, bolslo);
+		}
+	}
+}
+
+// With fixed-size chunks every boundary is known up front, so there's
+// no rolling hash, and FIXED_CHUNK_BATCH chunks at a time go to
+// hashChunks().  The chunks are the same as getChunkLength() gives when
+// the minimum and maximum are chunkSize, including around zero runs.
+static void writeFixedChunks(stringstream &ssbuffer, MemoryMappedFile &mappedFile, unsigned chunkSize, const vector<pair<u64, u64> > &zeroRanges, MD5 &fileMD5, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	const char *data = (const char *)mappedFile.getAddress();
 	u64 len = mappedFile.getLength();
+	vector<ChunkSpan> batch;
+	u64 offset = 0;
+	size_t nextZero = 0;
+
+	while (offset < len) {
+		batch.clear();
+		while (batch.size() < FIXED_CHUNK_BATCH && offset < len) {
+			ChunkSpan chunk;
+			chunk.offset = offset;
+			chunk.zero = nextZero < zeroRanges.size() && zeroRanges[nextZero].first <= offset;
+			u64 end = chunk.zero ? zeroRanges[nextZero].second
+				: nextZero < zeroRanges.size() ? zeroRanges[nextZero].first : len;
+			chunk.len = (unsigned)min(end - offset, (u64)chunkSize);
+			offset += chunk.len;
+			if (chunk.zero && offset == end) nextZero++;
+			batch.push_back(chunk);
+		}
 
-	//declare pos as pointer for file content "start", and dataEnd for file content end
-	const char *pos = data;
+		hashChunks(ssbuffer, batch, data, 0, fileMD5, boljson, bolhash, ofpath, bolslo);
+		mappedFile.consumed(offset);
+	}
+}
+
+// Chunk a file from a DirectFileReader.  In each window the boundaries
+// are found first, leaving a chunk that might run past the window for
+// the next one, and then the window's chunks go to hashChunks().
+// Returns false if the file couldn't all be read.
+static bool writeDirectChunks(stringstream &ssbuffer, DirectFileReader &reader, RollingWindow &rollingWindow, int intMod, MD5 &fileMD5, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	vector<ChunkSpan> batch;
+	const char *window;
+	u64 windowLen, unconsumed = 0, done = 0;
+
+	while (reader.next(unconsumed, &window, &windowLen)) {
+		u64 windowOffset = reader.getWindowOffset();
+		bool lastWindow = windowOffset + windowLen >= reader.getLength();
+
+		batch.clear();
+		u64 pos = 0;
+		while (pos < windowLen) {
+			u64 avail = windowLen - pos;
+			// with a whole maximum chunk here, the rest of the file
+			// can't change where this chunk ends
+			if (!lastWindow && avail < rollingWindow.maxChunkSize) break;
+
+			ChunkSpan chunk;
+			chunk.offset = windowOffset + pos;
+			chunk.len = intMod == 1 ? (unsigned)min(avail, rollingWindow.chunkSize)
+				: rollingWindow.getChunkLength((const unsigned char*)window + pos, avail);
+			chunk.zero = false;
+			batch.push_back(chunk);
+			pos += chunk.len;
+		}
+
+		hashChunks(ssbuffer, batch, window, windowOffset, fileMD5, boljson, bolhash, ofpath, bolslo);
+		unconsumed = windowLen - pos;
+		done = windowOffset + pos;
+	}
+	return done == reader.getLength();
+}
 
+// the root of the MerkleTree over leaves, as 32 hex digits
+static string merkleRootHex(const vector<u128> &leaves) {
+	MerkleTree tree;
+	char buf[33];
+	tree.build(leaves);
+	return tree.root().toHex(buf);
+}
+
+// Output a file kept as a single chunk.  Only the digest that's
+// printed is computed.
+static void writeWholeFile(stringstream &ssbuffer, const char *data, u64 len, int intPower, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	const char *pos = data;
 	char buf[80];
 
-	// hash the whole region
-	file_hash_t fileHash = FILE_HASH_FN(pos, (unsigned int)len);
+	if (bolhash){
+		// hash the whole region
+		string strFileMD5 = MD5((const byte*)pos, (unsigned int)len).toStr();
+		string strFileHash = strFileMD5;
+		if (chunkOptions & CHUNK_OPT_MERKLE_ROOT){
+			u128 digest;
+			digest.fromHex(strFileMD5.c_str());
+			strFileHash = merkleRootHex(vector<u128>(1, MerkleTree::leafHash(digest, len)));
+		}
 
-	MD5 FileHashMD5 = MD5((const byte*)pos, (unsigned int)len);
-	//const char *chrFileHash = fileHash.toHex(buf);
+		//const char *chrFileIndex= strFileIndex.c_str();
+		if (boljson){
+			if (bolslo){
+				ssbuffer << "{\"path\":\"/chunks/" << strFileMD5  << "\",\"size_bytes\":" << len << ",\"etag\":\"" << strFileMD5 << "\"},";
+				GenSLOFiles(ofpath, strFileMD5.c_str(), pos, len);
+			}else
+			{
+				ssbuffer << "{\"type\":\"file\",\"start\":" << (u64)(pos - data) << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << strFileHash << "\"},";
+				ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - data) << ", \"len\":" << len << ",\"pow\":" << 0 << ", \"hash\":\"" << strFileMD5 << "\"},";
+			}
+		}else{
+			ssbuffer << "file\t" << (u64)(pos - data) << "\t" << len << "\t" << intPower << "\t" << strFileHash << "\n";
+			ssbuffer << "chunk\t" << (u64)(pos - data) << "\t" << len << "\t" << 0 << "\t" << strFileMD5 << "\n";
+		}
+	}else{
+		file_hash_t fileHash = FILE_HASH_FN(pos, (unsigned int)len);
+		string strFileHash = fileHash.toHex(buf);
+		if (chunkOptions & CHUNK_OPT_MERKLE_ROOT)
+			strFileHash = merkleRootHex(vector<u128>(1, MerkleTree::leafHash(fileHash, len)));
+
+		//const char *chrFileIndex= strFileIndex.c_str();
+		if (boljson){
+			ssbuffer << "{\"type\":\"file\",\"start\":" << (u64)(pos - data) << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << strFileHash << "\"},";
+			ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - data) << ", \"len\":" << len << ",\"pow\":" << 0 << ", \"hash\":\"" << fileHash.toHex(buf) << "\"},";
+		}else{
+			ssbuffer << "file\t" << (u64)(pos - data) << "\t" << len << "\t" << intPower << "\t" << strFileHash << "\n";
+			ssbuffer << "chunk\t" << (u64)(pos - data) << "\t" << len << "\t" << 0 << "\t" << fileHash.toHex(buf) << "\n";
+		}
+	}
+}
+
+// Output the file line of a file that was split into chunks, which
+// come after it.  SLO output has none.
+static void writeFileLine(stringstream &ssbuffer, u64 len, int intPower, const string &strFileMD5, bool boljson, bool bolslo) {
+	if (boljson){
+		if (!bolslo){
+			ssbuffer << "{\"type\":\"file\",\"start\":" << 0 << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << strFileMD5 << "\"},";
+		}
+	}else{
+		ssbuffer << "file\t" << 0 << "\t" << len << "\t" << intPower << "\t" << strFileMD5 << "\n";
+	}
+}
+
+// files no bigger than the whole file threshold are read into this
+vector<char> smallFileBuffer;
+
+// Output an error record in place of a file that couldn't be read, so
+// it can't be taken for an empty one.
+static void writeFileError(stringstream &ssbuffer, const char *chrFilePath, bool boljson) {
+	if (boljson)
+		ssbuffer << "{\"type\":\"error\",\"path\":" << jsonString(chrFilePath) << "},";
+	else
+		ssbuffer << "error\t" << chrFilePath << "\n";
+}
+
+// Add the output for one file to ssbuffer, without the JSON brackets.
+// fd is the file from openFileForRead(), or -1 if it couldn't be
+// opened; the caller closes it.  Returns false, with an error record
+// as the output, if the file can't be read.
+static bool processFileData(stringstream &ssbuffer, const char *chrFilePath, int fd, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+
+	//intPower 0 is new # is anchor
+	//intMod 0 is whole file, 1 is fix and 2 is var
+	//intDivide , if 64 , then chunks # between 32 ~ 74, if 32 , then chunks # between 16 ~ 40 .. etc
+	//intRefactor, 0 is no refactor, 3 is currect anchor - original anchor > 3, then we refactor using new anchor.
 
 	modSize = intDivide;
 	//When MTU = 1500 Bytes, and if file size is less than 112942 bytes (111KB) = ROUND(1500 * (64) * (100/85), 0) + 1
 	//doesn't required split into chunks, so set intPower=1
-	u64 dblmin = round((1500 * modSize *100)/85)+1;
-	if (len <= dblmin){
-			intMod=0;
+	u64 dblmin = getWholeFileThreshold(modSize);
+
+	// a file that won't be split is read with one pread into a reused
+	// buffer instead of being mapped
+	u64 smallLen = 0;
+	int smallRead = fd < 0 ? -1 : readSmallFile(fd, dblmin, smallFileBuffer, &smallLen);
+	if (smallRead < 0){
+		// openFileForRead() has said why if fd is -1
+		if (fd >= 0) fprintf(stderr, "Error reading \"%s\": %s\n", chrFilePath, strerror(errno));
+		writeFileError(ssbuffer, chrFilePath, boljson);
+		return false;
 	}
-
-	if (boljson){
-		ssbuffer << "[";
+	if (smallRead > 0){
+		writeWholeFile(ssbuffer, smallLen ? &smallFileBuffer[0] : NULL, smallLen, intPower, boljson, bolhash, ofpath, bolslo);
+		return true;
 	}
 
+	//declare len as file size
+	u64 len = smallLen;
+
+	// declare mappedFile object; the file is mapped unless it's read
+	// with O_DIRECT
+	MemoryMappedFile mappedFile;
+	mappedFile.setReadPolicy(((chunkOptions & CHUNK_OPT_SEQUENTIAL) ? MAPPED_FILE_SEQUENTIAL : 0)
+				 | ((chunkOptions & CHUNK_OPT_DROP_BEHIND) ? MAPPED_FILE_DROP_BEHIND : 0)
+				 | ((chunkOptions & CHUNK_OPT_POPULATE) ? MAPPED_FILE_POPULATE : 0));
+
+	//declare data as the pointer for file content
+	const char *data = NULL;
+
+	//declare pos as pointer for file content "start", and dataEnd for file content end
+	const char *pos = data;
+
 	if (intMod == 0){
-		if (bolhash){
-			//const char *chrFileIndex= strFileIndex.c_str();
-			if (boljson){
-				if (bolslo){
-					ssbuffer << "{\"path\":\"/chunks/" << FileHashMD5.toStr()  << "\",\"size_bytes\":" << len << ",\"etag\":\"" << FileHashMD5.toStr() << "\"},";
-					GenSLOFiles(ofpath, FileHashMD5.toStr().c_str(), pos, len);
-				}else
-				{
-					ssbuffer << "{\"type\":\"file\",\"start\":" << (u64)(pos - data) << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << FileHashMD5.toStr() << "\"},";
-					ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - data) << ", \"len\":" << len << ",\"pow\":" << 0 << ", \"hash\":\"" << FileHashMD5.toStr() << "\"},";
-				}
-			}else{
-				ssbuffer << "file\t" << (u64)(pos - data) << "\t" << len << "\t" << intPower << "\t" << FileHashMD5.toStr() << "\n";
-				ssbuffer << "chunk\t" << (u64)(pos - data) << "\t" << len << "\t" << 0 << "\t" << FileHashMD5.toStr() << "\n";
-			}
-		}else{
-			//const char *chrFileIndex= strFileIndex.c_str();
-			if (boljson){
-				ssbuffer << "{\"type\":\"file\",\"start\":" << (u64)(pos - data) << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << fileHash.toHex(buf) << "\"},";
-				ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - data) << ", \"len\":" << len << ",\"pow\":" << 0 << ", \"hash\":\"" << fileHash.toHex(buf) << "\"},";
-			}else{
-				ssbuffer << "file\t" << (u64)(pos - data) << "\t" << len << "\t" << intPower << "\t" << fileHash.toHex(buf) << "\n";
-				ssbuffer << "chunk\t" << (u64)(pos - data) << "\t" << len << "\t" << 0 << "\t" << fileHash.toHex(buf) << "\n";
-			}
+		// map file into memory
+		data = (const char *)mappedFile.mapFile(chrFilePath);
+		if (!data && mappedFile.getLength()){
+			writeFileError(ssbuffer, chrFilePath, boljson);
+			return false;
 		}
+		writeWholeFile(ssbuffer, data, mappedFile.getLength(), intPower, boljson, bolhash, ofpath, bolslo);
 	}
 	else //if file size is larger than 256K * 0.85, doesn't required split into chunks, PS: 256K/64 = 4K the min is 4K file
 	{
@@ -324,33 +623,29 @@ extern "C" {
 			}
 		}
 
-		// const char *chrFileIndex= strFileIndex.c_str();
-	// print out File level Info
-		if (boljson){
-			if (bolslo){
-				//ssbuffer << "{\"path\":\"\/chunks\/" << FileHashMD5.toStr()  << "\",\"size_bytes\":" << len << ",\"etag\":\"" << FileHashMD5.toStr() << "\"},";
-			}else
-			{
-				ssbuffer << "{\"type\":\"file\",\"start\":" << (u64)(pos - data) << ",\"len\":" << len << ",\"pow\":" << intPower << ",\"hash\":\"" << FileHashMD5.toStr() << "\"},";
+		// min/max chunk size and modulo from the anchor
+		rollingWindow.setAnchor(rollingWindow.chunkSize, intMod);
+
+		// see CHUNK_OPT_DIRECT_READ
+		DirectFileReader directReader;
+		bool directRead = (chunkOptions & CHUNK_OPT_DIRECT_READ) && rollingWindow.maxChunkSize <= DIRECT_READ_MAX_CHUNK
+			&& directReader.open(chrFilePath, rollingWindow.maxChunkSize);
+
+		if (!directRead){
+			// map file into memory
+			data = (const char *)mappedFile.mapFile(chrFilePath);
+			len = mappedFile.getLength();
+			pos = data;
+			if (!data && len){
+				writeFileError(ssbuffer, chrFilePath, boljson);
+				return false;
 			}
-		}else{
-			ssbuffer << "file\t" << (u64)(pos - data) << "\t" << len << "\t" << intPower << "\t" << FileHashMD5.toStr()<< "\n";
-	}
-
-		if (intMod == 1){
-			/*if anchor fix, the optimal minimum chunk size is 85% of the hash modulo,
-			and the optimal maximum chunk size is 200% of the hash modulo.*/
-			rollingWindow.minChunkSize = rollingWindow.chunkSize;
-			rollingWindow.maxChunkSize = rollingWindow.chunkSize;
-			rollingWindow.modBase = rollingWindow.chunkSize;
 		}
-		else
-		{
-			/*According to Eshghi [5], the optimal minimum chunk size is 85% of the hash modulo,
-			and the optimal maximum chunk size is 200% of the hash modulo.*/
-			rollingWindow.minChunkSize = ((rollingWindow.chunkSize) * 85) / 100;
-			rollingWindow.maxChunkSize = (rollingWindow.chunkSize) * 2;
-			rollingWindow.modBase = rollingWindow.chunkSize;
+
+		// zero runs to store as zero chunks, see CHUNK_OPT_ZERO_RUNS
+		vector<pair<u64, u64> > zeroRanges;
+		if (!directRead && (chunkOptions & CHUNK_OPT_ZERO_RUNS) && reserveZeroBuffer(rollingWindow.maxChunkSize)){
+			mappedFile.findZeroRanges(max(rollingWindow.minChunkSize, (u64)DEFAULT_MIN_NULL_LEN), DEFAULT_MIN_NULL_LEN, zeroRanges);
 		}
 
 		/*
@@ -363,87 +658,325 @@ extern "C" {
 		rollingWindow.modValue = modValue;
 		rollingWindow.slidingWindowSize = slidingWindowSize;
 
-		//rollingWindow.dataFile
-		const char *startPos = pos;
-		const char *endPos = pos + len;
-		u64 fileOffset = pos - data;
-
-		// process the first chunk to get chunk len
-		unsigned chunkLen = rollingWindow.getChunkLength((const unsigned char*)pos, endPos - pos);
-
-		//compute a hash of the whole chunk len
-		chunk_hash_t leastHash = CHUNK_HASH_FN(pos, chunkLen);
-		MD5 LeastChunkHashMD5 = MD5((const byte*)pos, chunkLen);
-
-		// always process the 1st data chunk, check if an identical chunk has been seen already shows up in index
-		chunkMapType::iterator existing = chunkMap.find(leastHash);
-		if (existing == chunkMap.end()) {
-			// if not, add this as a new chunk
-			chunkMap[leastHash] = OffsetLen((u64)(pos - startPos) + fileOffset, chunkLen);
-		}
-		char hashBuf[80];
-		//const char *chrFileIndex= strFileIndex.c_str();
-		if (bolhash){
-			if (boljson){
-				if (bolslo){
-					string strLeastChunkMD5=LeastChunkHashMD5.toStr();
-					ssbuffer << "{\"path\":\"/chunks/" << strLeastChunkMD5  << "\",\"size_bytes\":" << chunkLen << ",\"etag\":\"" << strLeastChunkMD5 << "\"},";
-					GenSLOFiles(ofpath, strLeastChunkMD5.c_str(), pos, chunkLen);
-				}else{
-					ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - startPos) + fileOffset << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << LeastChunkHashMD5.toStr() << "\"},";
-				}
-			}else{
-				ssbuffer << "chunk\t" << (u64)(pos - startPos) + fileOffset << "\t" << chunkLen << "\t" <<  0 << "\t" << LeastChunkHashMD5.toStr() << "\n";
-			}
-		}
-		else{
-			if (boljson){
-				ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - startPos) + fileOffset << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << leastHash.toHex(hashBuf) << "\"},";
-			}else{
-				ssbuffer << "chunk\t" << (u64)(pos - startPos) + fileOffset << "\t" << chunkLen << "\t" <<  0 << "\t" << leastHash.toHex(hashBuf) << "\n";
+		// The file's MD5 is built up chunk by chunk, so each byte is
+		// read in one pass and is done with once the chunk is, and the
+		// chunks are written out after the file line.  Or the file's
+		// hash is made from the chunk digests, see CHUNK_OPT_MERKLE_ROOT.
+		MD5 fileMD5;
+		stringstream chunkLines;
+		vector<u128> leaves;
+		if (chunkOptions & CHUNK_OPT_MERKLE_ROOT) merkleLeaves = &leaves;
+
+		//rollingWindow.dataFile; nothing is mapped with directRead
+		const char *endPos = directRead ? pos : pos + len;
+		size_t nextZero = 0;
+
+		if (directRead){
+			// the chunks so far are dropped; they don't cover the file
+			if (!writeDirectChunks(chunkLines, directReader, rollingWindow, intMod, fileMD5, boljson, bolhash, ofpath, bolslo)){
+				fprintf(stderr, "Error reading \"%s\"\n", chrFilePath);
+				merkleLeaves = NULL;
+				writeFileError(ssbuffer, chrFilePath, boljson);
+				return false;
 			}
-			fileHash.toHex(buf);
+		}else if (intMod == 1){
+			writeFixedChunks(chunkLines, mappedFile, (unsigned)rollingWindow.chunkSize, zeroRanges, fileMD5, boljson, bolhash, ofpath, bolslo);
+			pos = endPos;
 		}
 
-		pos += chunkLen;
-
 		while (pos < endPos) {
-			//get chunk length
-			chunkLen = rollingWindow.getChunkLength((const unsigned char*)pos, endPos - pos);
+			u64 offset = pos - data;
+
+			if (nextZero < zeroRanges.size() && zeroRanges[nextZero].first == offset){
+				// the zero run as zero chunks, without touching its data
+				u64 zeroEnd = zeroRanges[nextZero++].second;
+				while (offset < zeroEnd){
+					unsigned chunkLen = (unsigned)min(zeroEnd - offset, rollingWindow.maxChunkSize);
+					const ZeroChunk &zero = getZeroChunk(chunkLen);
+					if (!merkleLeaves) fileMD5.update((const byte*)zeroBuffer, chunkLen);
+					indexChunk(zero.hash, offset, chunkLen);
+					writeChunk(chunkLines, offset, chunkLen, zeroBuffer, zero.hash, zero.md5, boljson, bolhash, ofpath, bolslo);
+					offset += chunkLen;
+				}
+				pos = data + zeroEnd;
+				mappedFile.consumed(zeroEnd);
+				continue;
+			}
+
+			//get chunk length, ending at the next zero run if there is one
+			u64 segmentEnd = nextZero < zeroRanges.size() ? zeroRanges[nextZero].first : len;
+			unsigned chunkLen = rollingWindow.getChunkLength((const unsigned char*)pos, segmentEnd - offset);
 
 			//compute a hash by chunk len
 			chunk_hash_t hash = CHUNK_HASH_FN(pos, chunkLen);
-			MD5 ChunkHashMD5 = MD5((const byte*)pos, chunkLen);
+			string strChunkMD5;
+			if (bolhash) strChunkMD5 = MD5((const byte*)pos, chunkLen).toStr();
+			if (!merkleLeaves) fileMD5.update((const byte*)pos, chunkLen);
 
 			// check if an identical chunk has been seen already shows up in index
-			chunkMapType::iterator existing = chunkMap.find(hash);
-			if (existing == chunkMap.end()) {
-				chunkMap[hash] = OffsetLen((u64)(pos - startPos) + fileOffset, chunkLen);
-			}
-			char hashBuf[80];
-			if (bolhash){
-				if (boljson){
-					if (bolslo){
-						string strChunkMD5=ChunkHashMD5.toStr();
-						ssbuffer << "{\"path\":\"/chunks/" << strChunkMD5  << "\",\"size_bytes\":" << chunkLen << ",\"etag\":\"" << strChunkMD5 << "\"},";
-						GenSLOFiles(ofpath, strChunkMD5.c_str(), pos, chunkLen);
-					}
-					else{
-						ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - startPos) + fileOffset << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << ChunkHashMD5.toStr() << "\"},";}
-					}
-				else{ssbuffer << "chunk\t" << (u64)(pos - startPos) + fileOffset << "\t" << chunkLen << "\t" << 0 << "\t" << ChunkHashMD5.toStr() << "\n";}
+			indexChunk(hash, offset, chunkLen);
+			writeChunk(chunkLines, offset, chunkLen, pos, hash, strChunkMD5, boljson, bolhash, ofpath, bolslo);
+			pos += chunkLen;
+			mappedFile.consumed(offset + chunkLen);
+		}
+
+		// print out File level Info
+		merkleLeaves = NULL;
+		writeFileLine(ssbuffer, len, intPower, (chunkOptions & CHUNK_OPT_MERKLE_ROOT) ? merkleRootHex(leaves) : fileMD5.toStr(), boljson, bolslo);
+		ssbuffer << chunkLines.str();
+	}
+
+	// close mappedFile object
+	mappedFile.close();
+	return true;
+}
+
+// Add the output for one file to ssbuffer, without the JSON brackets.
+// fd is the file from openFileForRead(), or -1 if it couldn't be
+// opened; it's closed here.  With a manifest cache open, a file that
+// hasn't changed isn't read; its output and chunks come from the cache.
+static void processFile(stringstream &ssbuffer, const char *chrFilePath, int fd, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+	// with bolslo the chunk files have to be written, so the file is read
+	FileIdentity id;
+	if (!manifestCache || bolslo || fd < 0 || !id.fromFile(fd)){
+		processFileData(ssbuffer, chrFilePath, fd, intPower, intMod, intDivide, intRefactor, boljson, bolhash, ofpath, bolslo);
+		if (fd >= 0) close(fd);
+		return;
+	}
 
+	// everything the output depends on besides the file
+	ManifestParams params;
+	params.power = intPower;
+	params.mod = intMod;
+	params.divide = intDivide;
+	params.refactor = intRefactor;
+	params.flags = (boljson ? 1 : 0) | (bolhash ? 2 : 0) | (bolFIB ? 4 : 0)
+		| (chunkOptions & (CHUNK_OPT_ZERO_RUNS | CHUNK_OPT_DIRECT_READ | CHUNK_OPT_MERKLE_ROOT)) << 8;
+
+	const ManifestCache::Entry *cached = manifestCache->lookup(id, params, fd);
+	if (cached){
+		close(fd);
+		for (size_t i=0; i < cached->chunks.size(); i++)
+			indexChunk(cached->chunks[i].hash, cached->chunks[i].offset, cached->chunks[i].len);
+		ssbuffer << cached->manifest;
+		return;
+	}
+
+	stringstream fileBuffer;
+	vector<ManifestCache::Chunk> chunks;
+	indexedChunks = &chunks;
+	bool ok = processFileData(fileBuffer, chrFilePath, fd, intPower, intMod, intDivide, intRefactor, boljson, bolhash, ofpath, bolslo);
+	indexedChunks = NULL;
+
+	// not if it couldn't be read, or changed while it was
+	FileIdentity after;
+	string strFile = fileBuffer.str();
+	if (ok && after.fromFile(fd) && after == id)
+		manifestCache->store(id, params, fd, strFile, chunks);
+	close(fd);
+	ssbuffer << strFile;
+}
+
+// the digest an old manifest has for a chunk: MD5 with bolhash, else
+// the chunk hash
+static bool sameChunkDigest(const ChunkRecord &rec, const char *data, unsigned len, const chunk_hash_t &hash, bool bolhash) {
+	if (!bolhash) return rec.hash == hash;
+	char hexBuf[33];
+	return MD5((const byte*)data, len).toStr() == rec.hash.toHex(hexBuf);
+}
+
+/*
+Chunk a file that has changed since old was made from it, reusing old's
+chunks where the file hasn't changed.  The output is the same as
+ProcessFileToVar() with old's anchor power and no refactoring gives.
+
+Content-defined boundaries depend only on the bytes of the chunk, so
+from a boundary both versions share, an old chunk is reused if its bytes
+are unchanged (and its end still passes endsChunk(), which catches a
+manifest made with other settings).  At the first changed chunk, the
+file is chunked with the rolling hash until a cut lands on an old
+boundary again.  Changed bytes are found either from dirtyRanges,
+sorted [start, end) ranges changed in place, which lets unchanged
+chunks skip hashing unless bolhash needs the chunk hash for the index;
+or, if it's NULL, by comparing each old chunk's digest, which also
+finds old chunks again after bytes were inserted or removed.
+
+The file's MD5 is computed on another thread while this goes on, unless
+it's a Merkle root (CHUNK_OPT_MERKLE_ROOT).  An MD5 can't be updated for
+changes in place, so without CHUNK_OPT_MERKLE_ROOT every byte of the
+file is still read for it, dirtyRanges or not; only the chunking work is
+saved.  Files that wouldn't be split, and zero run detection, fall back
+to processFile().
+*/
+static void rechunkFile(stringstream &ssbuffer, const char *chrFilePath, const Manifest &old, const vector<pair<u64, u64> > *dirtyRanges, int intMod, int intDivide, bool boljson, bool bolhash) {
+	int intPower = old.hasFileRecord ? old.file.pow : 0;
+
+	// old's chunks must cover its file
+	bool usable = intPower > 0 && intMod != 0 && !(chunkOptions & CHUNK_OPT_ZERO_RUNS);
+	u64 oldLen = 0;
+	for (size_t i=0; usable && i < old.chunks.size(); i++) {
+		usable = old.chunks[i].start == oldLen && old.chunks[i].len > 0;
+		oldLen += old.chunks[i].len;
+	}
+	modSize = intDivide;
+
+	MemoryMappedFile mappedFile;
+	const char *data = usable ? (const char *)mappedFile.mapFile(chrFilePath) : NULL;
+	u64 len = mappedFile.getLength();
+	if (!data || len <= getWholeFileThreshold(modSize)){
+		mappedFile.close();
+		processFile(ssbuffer, chrFilePath, openFileForRead(chrFilePath), intPower, intMod, intDivide, 0, boljson, bolhash, "", false);
+		return;
+	}
+
+	RollingWindow rollingWindow;
+	rollingWindow.setAnchor(pow(2, intPower), intMod);
+	rollingWindow.modValue = modValue;
+	rollingWindow.slidingWindowSize = slidingWindowSize;
+
+	// the file's MD5 is only needed without CHUNK_OPT_MERKLE_ROOT
+	MD5 fileMD5;
+	vector<u128> leaves;
+	thread md5Thread;
+	if (chunkOptions & CHUNK_OPT_MERKLE_ROOT) merkleLeaves = &leaves;
+	else md5Thread = thread([&]() {fileMD5.update((const byte*)data, len);});
+
+	// with digests, old chunks by digest, to find them at a new offset
+	unordered_map<u128, size_t, ChunkHashHasher> oldByDigest;
+	if (!dirtyRanges){
+		for (size_t i=0; i < old.chunks.size(); i++)
+			oldByDigest.insert(make_pair(old.chunks[i].hash, i));
+	}
+
+	// true if [start, end) has changed according to dirtyRanges
+	auto isDirty = [&](u64 start, u64 end) {
+		auto it = lower_bound(dirtyRanges->begin(), dirtyRanges->end(), make_pair(start, (u64)0));
+		if (it != dirtyRanges->begin() && prev(it)->second > start) return true;
+		return it != dirtyRanges->end() && it->first < end;
+	};
+
+	// offset in the file minus offset in old; only changes with digests
+	int64_t shift = 0;
+	stringstream chunkLines;
+	char hexBuf[33];
+	u64 offset = 0;
+
+	while (offset < len) {
+		const char *pos = data + offset;
+		u64 remaining = len - offset;
+
+		// the old chunk that starts here, if there is one
+		const ChunkRecord *rec = NULL;
+		int64_t oldOffset = (int64_t)offset - shift;
+		if (oldOffset >= 0 && (u64)oldOffset < oldLen) {
+			auto it = lower_bound(old.chunks.begin(), old.chunks.end(), (u64)oldOffset,
+				[](const ChunkRecord &c, u64 o) {return c.start < o;});
+			if (it != old.chunks.end() && it->start == (u64)oldOffset) rec = &*it;
+		}
+
+		// a chunk that ended the old file is only the same if it ends
+		// this one too
+		if (rec && (rec->len > remaining
+			    || (rec->start + rec->len == oldLen && rec->len != remaining)
+			    || !rollingWindow.endsChunk((const unsigned char*)pos, rec->len, remaining)))
+			rec = NULL;
+
+		unsigned chunkLen;
+		chunk_hash_t hash;
+		bool haveHash = false;
+		if (rec && dirtyRanges){
+			if (shift != 0 || offset + rec->len > oldLen || isDirty(offset, offset + rec->len)) rec = NULL;
+		}else if (rec){
+			hash = CHUNK_HASH_FN(pos, (unsigned)rec->len);
+			haveHash = true;
+			if (!sameChunkDigest(*rec, pos, (unsigned)rec->len, hash, bolhash)) rec = NULL;
+		}
+
+		string strChunkMD5;
+		if (rec){
+			chunkLen = (unsigned)rec->len;
+			if (bolhash){
+				strChunkMD5 = rec->hash.toHex(hexBuf);
+				if (!haveHash) hash = CHUNK_HASH_FN(pos, chunkLen);
 			}else{
-				if (boljson){ssbuffer << "{\"type\":\"chunk\",\"start\":" << (u64)(pos - startPos) + fileOffset << ",\"len\":" << chunkLen << ",\"pow\":" << 0 << ",\"hash\":\"" << hash.toHex(hashBuf) << "\"},";}
-				else{ssbuffer << "chunk\t" << (u64)(pos - startPos) + fileOffset << "\t" << chunkLen << "\t" << 0 << "\t" << hash.toHex(hashBuf) << "\n";}
-				//GenSLOFiles(ofpath, hash.toHex(hashBuf), pos, chunkLen);
+				hash = rec->hash;
+			}
+		}else{
+			chunkLen = rollingWindow.getChunkLength((const unsigned char*)pos, remaining);
+			hash = CHUNK_HASH_FN(pos, chunkLen);
+			if (bolhash) strChunkMD5 = MD5((const byte*)pos, chunkLen).toStr();
+
+			// a new chunk that's in old somewhere puts us back in step
+			if (!dirtyRanges){
+				u128 digest;
+				if (bolhash) {digest.lo = digest.hi = 0; digest.fromHex(strChunkMD5.c_str());}
+				else digest = hash;
+				auto found = oldByDigest.find(digest);
+				if (found != oldByDigest.end())
+					shift = (int64_t)offset - (int64_t)old.chunks[found->second].start;
 			}
-			pos += chunkLen;
 		}
+
+		indexChunk(hash, offset, chunkLen);
+		writeChunk(chunkLines, offset, chunkLen, pos, hash, strChunkMD5, boljson, bolhash, "", false);
+		offset += chunkLen;
 	}
 
-	// close mappedFile object
+	merkleLeaves = NULL;
+	if (md5Thread.joinable()) md5Thread.join();
+	writeFileLine(ssbuffer, len, intPower, (chunkOptions & CHUNK_OPT_MERKLE_ROOT) ? merkleRootHex(leaves) : fileMD5.toStr(), boljson, false);
+	ssbuffer << chunkLines.str();
 	mappedFile.close();
+}
+
+// Call fn(i, fd) for each of the count paths in order, with fd from
+// openFileForRead() (fn must close it).  The next BATCH_READAHEAD_FILES
+// files are kept open and read ahead, readahead bytes each, so no more
+// than that many reads are ever in flight.
+static void forEachFileReadAhead(const char **paths, unsigned count, u64 readahead, const function<void(unsigned, int)> &fn) {
+	int fds[BATCH_READAHEAD_FILES];
+	for (unsigned i=0; i < count && i < BATCH_READAHEAD_FILES; i++)
+		fds[i] = openFileForRead(paths[i], readahead);
+
+	for (unsigned i=0; i < count; i++) {
+		fn(i, fds[i % BATCH_READAHEAD_FILES]);
+		if (i + BATCH_READAHEAD_FILES < count)
+			fds[i % BATCH_READAHEAD_FILES] = openFileForRead(paths[i + BATCH_READAHEAD_FILES], readahead);
+	}
+}
+
+// processFile() with JSON output, as one array appended to ssbuffer;
+// fileBuffer is scratch space
+static void processFileArray(stringstream &ssbuffer, stringstream &fileBuffer, const char *chrFilePath, int fd, int intPower, int intMod, int intDivide, int intRefactor, bool bolhash, const char *ofpath, bool bolslo) {
+	fileBuffer.str("");
+	fileBuffer << "[";
+	processFile(fileBuffer, chrFilePath, fd, intPower, intMod, intDivide, intRefactor, true, bolhash, ofpath, bolslo);
+	string strFile = fileBuffer.str();
+	ssbuffer << strFile.substr(0, strFile.size()-1) << "]";
+}
+
+/*
+* Class:     clsJavaVariableChunk
+* Method:    getVariableChunkProfile
+* Signature: (Ljava/lang/String;)Ljava/lang/String;
+*/
+
+//JNIEXPORT jstring JNICALL
+//Java_clsCityHashCalc_clsJavaVariableChunk_getVariableChunkProfile(JNIEnv *env, jobject obj, jstring clsJavaVariableChunk, jint intMod)
+//const char *clsVairableChunk::ProcessFileToVar(const char *FilePath, int intMod)
+//
+//string returnBufferString, returnCityHash, returnGetString;
+extern "C" {
+	const char *ProcessFileToVar(const char *chrFilePath, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+
+	//stringstream return buffer
+	stringstream ssbuffer;
+
+	if (boljson){
+		ssbuffer << "[";
+	}
+
+	processFile(ssbuffer, chrFilePath, openFileForRead(chrFilePath), intPower, intMod, intDivide, intRefactor, boljson, bolhash, ofpath, bolslo);
 
 	returnBufferString = ssbuffer.str();
 
@@ -456,4 +989,485 @@ extern "C" {
 	//return env->NewStringUTF(returnBufferString.c_str());
 	return returnBufferString.c_str();
 	}
+
+
+	/*
+	Rechunk a file that changed since chrOldManifest, ProcessFileToVar()
+	output for an earlier version of it, was made; see rechunkFile().
+	If dirtyRanges isn't NULL it holds dirtyCount [start, end) pairs of
+	byte offsets changed in place since then, and nothing else may have
+	changed but the length; otherwise unchanged chunks are found by
+	their digests.  intMod, intDivide and bolhash must be what the old
+	manifest was made with.  Returns NULL if the manifest can't be
+	parsed.
+
+	Only chunks that might have changed are hashed, but unless
+	CHUNK_OPT_MERKLE_ROOT is set the file line's MD5 still takes a read
+	of the whole file, since an MD5 can't be patched.  With a Merkle
+	root and dirtyRanges, and without bolhash, only the bytes at the end
+	of each unchanged chunk are read, to check its boundary, so the time
+	depends on the size of the changes more than of the file.
+	*/
+	const char *RechunkFileToVar(const char *chrFilePath, const char *chrOldManifest, const unsigned long long *dirtyRanges, unsigned dirtyCount, int intMod, int intDivide, bool boljson, bool bolhash) {
+		Manifest old;
+		if (!old.parse(chrOldManifest)) return NULL;
+
+		vector<pair<u64, u64> > dirty;
+		for (unsigned i=0; i < dirtyCount; i++)
+			if (dirtyRanges[2*i] < dirtyRanges[2*i+1])
+				dirty.push_back(make_pair((u64)dirtyRanges[2*i], (u64)dirtyRanges[2*i+1]));
+		sort(dirty.begin(), dirty.end());
+
+		// merge overlapping ranges, so each starts after the last ends
+		size_t merged = 0;
+		for (size_t i=0; i < dirty.size(); i++) {
+			if (merged && dirty[i].first <= dirty[merged-1].second)
+				dirty[merged-1].second = max(dirty[merged-1].second, dirty[i].second);
+			else
+				dirty[merged++] = dirty[i];
+		}
+		dirty.resize(merged);
+
+		stringstream ssbuffer;
+		if (boljson) ssbuffer << "[";
+		rechunkFile(ssbuffer, chrFilePath, old, dirtyRanges ? &dirty : NULL, intMod, intDivide, boljson, bolhash);
+		returnBufferString = ssbuffer.str();
+		if (boljson) returnBufferString = returnBufferString.substr(0, returnBufferString.size()-1) + "]";
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	ProcessFileToVar() for each of the fileCount paths in chrFilePaths,
+	with the outputs one after another, or with boljson a JSON array of
+	each file's array.  The next BATCH_READAHEAD_FILES files are opened
+	and read ahead while earlier ones are hashed, so with small files
+	the reads mostly overlap the hashing.  A file that can't be read is
+	reported on stderr, and its output is an "error" record with its
+	path.
+	*/
+	const char *ProcessFilesToVar(const char **chrFilePaths, unsigned fileCount, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+		stringstream ssbuffer, fileBuffer;
+
+		if (boljson) ssbuffer << "[";
+		forEachFileReadAhead(chrFilePaths, fileCount, getWholeFileThreshold(intDivide), [&](unsigned i, int fd) {
+			if (boljson){
+				if (i) ssbuffer << ",";
+				processFileArray(ssbuffer, fileBuffer, chrFilePaths[i], fd, intPower, intMod, intDivide, intRefactor, bolhash, ofpath, bolslo);
+			}else{
+				processFile(ssbuffer, chrFilePaths[i], fd, intPower, intMod, intDivide, intRefactor, boljson, bolhash, ofpath, bolslo);
+			}
+		});
+		if (boljson) ssbuffer << "]";
+
+		returnBufferString = ssbuffer.str();
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	ProcessFileToVar() for every regular file under chrRootPath, found
+	with scanTree() and read in intOrder (SCAN_ORDER_...), with the same
+	read ahead as ProcessFilesToVar().  Hard links to one inode are read
+	once.  Without boljson each file's output is preceded by a
+	"path\t<path>" line and a "link\t<path>" line for each other link
+	to it; with boljson the result is a JSON array of
+	{"path":...,"links":[...],"chunks":[...]}.  Returns NULL if
+	chrRootPath can't be read.
+	*/
+	const char *ProcessTreeToVar(const char *chrRootPath, int intOrder, int intPower, int intMod, int intDivide, int intRefactor, bool boljson, bool bolhash, const char *ofpath, bool bolslo) {
+		vector<ScannedFile> files;
+		if (!scanTree(chrRootPath, intOrder, files)) return NULL;
+
+		vector<const char *> paths(files.size());
+		for (size_t i=0; i < files.size(); i++) paths[i] = files[i].path.c_str();
+
+		stringstream ssbuffer, fileBuffer;
+		if (boljson) ssbuffer << "[";
+		forEachFileReadAhead(paths.data(), (unsigned)paths.size(), getWholeFileThreshold(intDivide), [&](unsigned i, int fd) {
+			const ScannedFile &file = files[i];
+			if (boljson){
+				if (i) ssbuffer << ",";
+				ssbuffer << "{\"path\":" << jsonString(file.path) << ",\"links\":[";
+				for (size_t j=0; j < file.links.size(); j++)
+					ssbuffer << (j ? "," : "") << jsonString(file.links[j]);
+				ssbuffer << "],\"chunks\":";
+				processFileArray(ssbuffer, fileBuffer, paths[i], fd, intPower, intMod, intDivide, intRefactor, bolhash, ofpath, bolslo);
+				ssbuffer << "}";
+			}else{
+				ssbuffer << "path\t" << file.path << "\n";
+				for (size_t j=0; j < file.links.size(); j++)
+					ssbuffer << "link\t" << file.links[j] << "\n";
+				processFile(ssbuffer, paths[i], fd, intPower, intMod, intDivide, intRefactor, boljson, bolhash, ofpath, bolslo);
+			}
+		});
+		if (boljson) ssbuffer << "]";
+
+		returnBufferString = ssbuffer.str();
+		return returnBufferString.c_str();
+	}
+}
+
+
+// Call fn with the segments in path: a pack store directory if it has
+// an index, else a directory of segment files, or the store opened with
+// OpenPackStore() if path is NULL.  Returns fn's result, or false if
+// the segments can't be opened.
+static bool withSegmentSource(const char *path, const function<bool(SegmentSource &)> &fn) {
+	if (!path){
+		if (!packStore){
+			fprintf(stderr, "No pack store is open\n");
+			return false;
+		}
+		PackSegmentSource source(packStore);
+		return fn(source);
+	}
+
+	string indexPath = string(path) + "/index";
+	if (fileExists(indexPath.c_str())){
+		PackStore *store = PackStore::open(path, false);
+		if (!store) return false;
+		PackSegmentSource source(store);
+		bool ok = fn(source);
+		delete store;
+		return ok;
+	}
+
+	DirectorySegmentSource source(path);
+	return fn(source);
+}
+
+
+// the bad chunks from a scrub, for VerifyFileToVar()
+static string scrubReport(const ScrubResult &result, bool boljson) {
+	stringstream ssbuffer;
+	char hexBuf[33];
+	if (boljson) ssbuffer << "[";
+	for (size_t i=0; i < result.bad.size(); i++){
+		const ChunkRecord &chunk = result.bad[i];
+		if (boljson)
+			ssbuffer << (i ? "," : "") << "{\"type\":\"mismatch\",\"start\":" << chunk.start << ",\"len\":" << chunk.len << ",\"hash\":\"" << chunk.hash.toHex(hexBuf) << "\"}";
+		else
+			ssbuffer << "mismatch\t" << chunk.start << "\t" << chunk.len << "\t" << chunk.hash.toHex(hexBuf) << "\n";
+	}
+	if (boljson) ssbuffer << "]";
+	return ssbuffer.str();
+}
+
+
+// a manifest diff for DiffManifestsToVar(): the byte counts, then the
+// chunks to upload in manifest form
+static string diffReport(const ManifestDiff &diff, bool boljson) {
+	Manifest added;
+	added.chunks = diff.added;
+	stringstream ssbuffer;
+	if (boljson)
+		ssbuffer << "{\"shared\":" << diff.sharedBytes << ",\"new\":" << diff.newBytes << ",\"removed\":" << diff.removedBytes << ",\"upload\":" << diff.addedBytes << ",\"chunks\":" << added.toString(true) << "}";
+	else
+		ssbuffer << "shared\t" << diff.sharedBytes << "\nnew\t" << diff.newBytes << "\nremoved\t" << diff.removedBytes << "\nupload\t" << diff.addedBytes << "\n" << added.toString(false);
+	return ssbuffer.str();
+}
+
+
+extern "C" {
+	// Set CHUNK_OPT_... bits for later ProcessFileToVar() calls.
+	void SetChunkOptions(unsigned options) {
+		chunkOptions = options;
+	}
+
+
+	// Number of threads ProcessFileToVar() may use to hash fixed-size
+	// chunks; 0, the default, means one per core.
+	void SetChunkThreads(unsigned threadCount) {
+		chunkThreads = threadCount;
+	}
+
+
+	/*
+	Reuse the manifests of unchanged files from the cache at chrCachePath,
+	created if it doesn't exist.  A file is unchanged if its device,
+	inode, size, mtime and ctime are the same, and so are the chunking
+	parameters; with bolCheckContent, a sample of its blocks must match
+	too.  Not used with bolslo.  Returns false on error.
+	*/
+	bool OpenManifestCache(const char *chrCachePath, bool bolCheckContent) {
+		delete manifestCache;
+		manifestCache = ManifestCache::open(chrCachePath, bolCheckContent);
+		return manifestCache != NULL;
+	}
+
+
+	// Write out and close the cache from OpenManifestCache().  With
+	// bolDropUnused, files that weren't seen since it was opened are
+	// dropped from it.  Returns false if it couldn't be written.
+	bool CloseManifestCache(bool bolDropUnused) {
+		if (!manifestCache) return true;
+		bool ok = manifestCache->save(bolDropUnused);
+		delete manifestCache;
+		manifestCache = NULL;
+		return ok;
+	}
+
+
+	/*
+	Store SLO segments in the pack store in chrDirPath (see PackStore),
+	created if needed, instead of one file each under ofpath.  New packs
+	are started at maxPackBytes, or 1GB if 0.  Without bolWritable the
+	store is only opened for ReadPackedSegment().  Returns false on
+	error.
+	*/
+	bool OpenPackStore(const char *chrDirPath, unsigned long long maxPackBytes, bool bolWritable) {
+		delete packStore;
+		packStore = PackStore::open(chrDirPath, bolWritable, maxPackBytes);
+		return packStore != NULL;
+	}
+
+
+	// Write out the index and close the store from OpenPackStore().
+	// Returns false if the index couldn't be written.
+	bool ClosePackStore() {
+		bool ok = !packStore || packStore->flush();
+		delete packStore;
+		packStore = NULL;
+		return ok;
+	}
+
+
+	/*
+	Copy the segment whose MD5 is chrMD5 (32 hex digits) from the open
+	pack store into buffer, if it's at least bufferLen bytes long.
+	Returns the segment's length, so it can be called with a NULL
+	buffer to size one, or -1 if it isn't stored or can't be read.
+	*/
+	long long ReadPackedSegment(const char *chrMD5, char *buffer, unsigned long long bufferLen) {
+		u128 digest;
+		PackStore::Location loc;
+		digest.lo = digest.hi = 0;
+		if (!packStore || !digest.fromHex(chrMD5) || !packStore->find(digest, &loc)) return -1;
+		if (buffer && bufferLen >= loc.len && !packStore->read(loc, buffer)) return -1;
+		return loc.len;
+	}
+
+
+	/*
+	Rebuild the file chrManifest (ProcessFileToVar() output, text or
+	JSON) describes at chrOutPath; see restoreFile().  Segments are read
+	from chrSegmentPath, a pack store directory if it has an index, or
+	else a directory of segment files; or if it's NULL, from the store
+	opened with OpenPackStore().  intOptions are RESTORE_... flags, and
+	threadCount 0 means one thread per core.  Returns false on error.
+	*/
+	bool RestoreFile(const char *chrManifest, const char *chrSegmentPath, const char *chrOutPath, unsigned threadCount, unsigned intOptions) {
+		Manifest manifest;
+		if (!manifest.parse(chrManifest)) return false;
+		return withSegmentSource(chrSegmentPath, [&](SegmentSource &source) {
+			return restoreFile(manifest, source, chrOutPath, threadCount, intOptions);
+		});
+	}
+
+
+	/*
+	Check that the file at chrFilePath still matches chrManifest
+	(ProcessFileToVar() output, text or JSON); see scrubFile().
+	intOptions are SCRUB_... flags, and threadCount 0 means one thread
+	per core.  Returns the chunks that don't match, as lines of
+	"mismatch\t<start>\t<len>\t<hash>", or with boljson an array of
+	objects, so nothing means the file is intact; or NULL if the
+	manifest can't be parsed or the file can't be read.
+	*/
+	const char *VerifyFileToVar(const char *chrFilePath, const char *chrManifest, unsigned threadCount, unsigned intOptions, bool boljson) {
+		Manifest manifest;
+		ScrubResult result;
+		if (!manifest.parse(chrManifest) || !scrubFile(manifest, chrFilePath, threadCount, intOptions, result)) return NULL;
+		returnBufferString = scrubReport(result, boljson);
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	Check that the segments chrManifest refers to are all stored and
+	match their hashes, reading them as RestoreFile() does from
+	chrSegmentPath.  Returns the chunks whose segments are missing or
+	bad, as VerifyFileToVar() does, or NULL on error.
+	*/
+	const char *VerifySegmentsToVar(const char *chrManifest, const char *chrSegmentPath, unsigned threadCount, unsigned intOptions, bool boljson) {
+		Manifest manifest;
+		ScrubResult result;
+		if (!manifest.parse(chrManifest)) return NULL;
+		bool ok = withSegmentSource(chrSegmentPath, [&](SegmentSource &source) {
+			scrubSegments(manifest, source, threadCount, intOptions, result);
+			return true;
+		});
+		if (!ok) return NULL;
+		returnBufferString = scrubReport(result, boljson);
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	The root of the MerkleTree over chrManifest's chunks, as 32 hex
+	digits; with CHUNK_OPT_MERKLE_ROOT it's the file line's hash.
+	Returns NULL if the manifest can't be parsed.
+	*/
+	const char *MerkleRootToVar(const char *chrManifest) {
+		Manifest manifest;
+		MerkleTree tree;
+		char buf[33];
+		if (!manifest.parse(chrManifest)) return NULL;
+		tree.build(manifest.chunks);
+		returnBufferString = tree.root().toHex(buf);
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	Compare two manifests' Merkle trees, descending only where they
+	differ.  Returns the ranges of chunks by position that differ, as
+	lines of "range\t<first chunk>\t<chunk count>\t<start>\t<len>",
+	where start and len are the bytes they cover in chrNewManifest, or
+	with boljson an array of objects.  Nothing means the chunks are the
+	same.  Returns NULL if either can't be parsed.
+	*/
+	const char *DiffManifestTreesToVar(const char *chrOldManifest, const char *chrNewManifest, bool boljson) {
+		Manifest oldManifest, newManifest;
+		if (!oldManifest.parse(chrOldManifest) || !newManifest.parse(chrNewManifest)) return NULL;
+		MerkleTree oldTree, newTree;
+		oldTree.build(oldManifest.chunks);
+		newTree.build(newManifest.chunks);
+		vector<pair<unsigned, unsigned> > ranges;
+		newTree.diff(oldTree, ranges);
+
+		const vector<ChunkRecord> &chunks = newManifest.chunks;
+		u64 newLen = newManifest.getFileLength();
+		stringstream ssbuffer;
+		if (boljson) ssbuffer << "[";
+		for (size_t i=0; i < ranges.size(); i++){
+			unsigned first = ranges[i].first, last = ranges[i].second;
+			// chunks only the old manifest has cover nothing in the new file
+			u64 start = first < chunks.size() ? chunks[first].start : newLen;
+			u64 end = last <= chunks.size() ? (last ? chunks[last-1].start + chunks[last-1].len : 0) : newLen;
+			if (end < start) end = start;
+			if (boljson)
+				ssbuffer << (i ? "," : "") << "{\"type\":\"range\",\"first\":" << first << ",\"count\":" << last - first << ",\"start\":" << start << ",\"len\":" << end - start << "}";
+			else
+				ssbuffer << "range\t" << first << "\t" << last - first << "\t" << start << "\t" << end - start << "\n";
+		}
+		if (boljson) ssbuffer << "]";
+		returnBufferString = ssbuffer.str();
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	The Merkle tree nodes, one per line as 32 hex digits, that along
+	with chunks [first, first + count) of chrManifest give its root; see
+	VerifyChunkRange().  Returns NULL if the manifest can't be parsed or
+	doesn't have those chunks.
+	*/
+	const char *ProveChunkRangeToVar(const char *chrManifest, unsigned first, unsigned count) {
+		Manifest manifest;
+		if (!manifest.parse(chrManifest)) return NULL;
+		if (!count || first >= manifest.chunks.size() || count > manifest.chunks.size() - first) return NULL;
+		MerkleTree tree;
+		vector<u128> proof;
+		char buf[33];
+		tree.build(manifest.chunks);
+		tree.proveRange(first, count, proof);
+
+		stringstream ssbuffer;
+		for (size_t i=0; i < proof.size(); i++)
+			ssbuffer << proof[i].toHex(buf) << "\n";
+		returnBufferString = ssbuffer.str();
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	Check that the chunks in chrChunks (manifest text, any format),
+	taken as chunks first on of a manifest with chunkCount chunks, are
+	the ones in the manifest whose Merkle root is chrRoot, using
+	chrProof from ProveChunkRangeToVar().  Only the chunks' digests and
+	lengths are checked; scrubFile() or VerifyFileToVar() with just
+	those chunks checks the bytes.
+	*/
+	bool VerifyChunkRange(const char *chrRoot, unsigned chunkCount, unsigned first, const char *chrChunks, const char *chrProof) {
+		u128 root;
+		Manifest manifest;
+		if (!root.fromHex(chrRoot) || !manifest.parse(chrChunks)) return false;
+
+		vector<u128> leaves, proof;
+		for (size_t i=0; i < manifest.chunks.size(); i++)
+			leaves.push_back(MerkleTree::leafHash(manifest.chunks[i].hash, manifest.chunks[i].len));
+		istringstream lines(chrProof ? chrProof : "");
+		string line;
+		while (getline(lines, line)){
+			u128 node;
+			if (line.empty()) continue;
+			if (!node.fromHex(line.c_str())) return false;
+			proof.push_back(node);
+		}
+		return MerkleTree::verifyRange(root, chunkCount, first, leaves, proof);
+	}
+
+
+	/*
+	Compare two manifests (ProcessFileToVar() output, text or JSON) by
+	chunk digest; see diffManifests().  Returns lines of
+	"shared\t<bytes>", "new\t<bytes>", "removed\t<bytes>" and
+	"upload\t<bytes>", then the chunks of chrNewManifest that
+	chrOldManifest doesn't have as chunk lines, each digest once; or with
+	boljson an object with those fields and a "chunks" array.  Returns
+	NULL if either can't be parsed.
+	*/
+	const char *DiffManifestsToVar(const char *chrOldManifest, const char *chrNewManifest, bool boljson) {
+		Manifest oldManifest, newManifest;
+		ManifestDiff diff;
+		if (!oldManifest.parse(chrOldManifest) || !newManifest.parse(chrNewManifest)) return NULL;
+		diffManifests(oldManifest, newManifest, diff);
+		returnBufferString = diffReport(diff, boljson);
+		return returnBufferString.c_str();
+	}
+
+
+	/*
+	Compare a manifest with the chunks recorded so far, in the index from
+	OpenChunkIndex() if one is open; output as DiffManifestsToVar().  The
+	index holds CityHash128s, so the manifest must be made without
+	bolhash, and chunks are recorded as files are processed, so this is
+	for a manifest from elsewhere, or one made before the index was
+	opened.  Returns NULL if the manifest can't be parsed.
+	*/
+	const char *DiffManifestIndexToVar(const char *chrManifest, bool boljson) {
+		Manifest manifest;
+		ManifestDiff diff;
+		if (!manifest.parse(chrManifest)) return NULL;
+		diffManifestWithStore(manifest, [](const u128 &digest) {
+			ChunkLocation loc;
+			return chunkIndex ? chunkIndex->lookup(digest, &loc) : chunkMap.count(digest) != 0;
+		}, diff);
+		returnBufferString = diffReport(diff, boljson);
+		return returnBufferString.c_str();
+	}
+
+
+	// write out and close the index from OpenChunkIndex()
+	void CloseChunkIndex() {
+		delete chunkIndex;
+		chunkIndex = NULL;
+	}
+
+
+	/*
+	Record chunks in a tiered index at chrIndexPath (created if it doesn't
+	exist, sized for expectedChunks) instead of in memory.  At most
+	cacheEntries fingerprints are kept in RAM.  Returns false on error.
+	*/
+	bool OpenChunkIndex(const char *chrIndexPath, unsigned long long expectedChunks, unsigned long long cacheEntries) {
+		CloseChunkIndex();
+		if (fileExists(chrIndexPath))
+			chunkIndex = TieredIndex::open(chrIndexPath, (size_t)cacheEntries);
+		else
+			chunkIndex = TieredIndex::create(chrIndexPath, expectedChunks, (size_t)cacheEntries);
+		return chunkIndex != NULL;
+	}
 }
@@ -0,0 +1,399 @@
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include "dedup-estimator.h"
+#include "dedup-util.h"
+#include "HashAlgs.h"
+#include "RollingWindow.h"
+
+using namespace std;
+
+
+bool ChunkProfile::parseList(const char *spec, vector<ChunkProfile> &out) {
+  out.clear();
+  stringstream in(spec);
+  string item;
+
+  while (getline(in, item, ',')) {
+    ChunkProfile profile;
+    unsigned long long minChunk, modBase, maxChunk;
+    int divide;
+    char extra;
+
+    if (sscanf(item.c_str(), " %llu:%llu:%llu %c",
+	       &minChunk, &modBase, &maxChunk, &extra) == 3) {
+      if (modBase == 0 || minChunk > maxChunk || maxChunk > UINT_MAX)
+	goto fail;
+      profile.minChunk = minChunk;
+      profile.modBase = modBase;
+      profile.maxChunk = maxChunk;
+    } else if (sscanf(item.c_str(), " f%d %c", &divide, &extra) == 1) {
+      profile.divide = divide;
+      profile.fibonacci = true;
+    } else if (sscanf(item.c_str(), " d%d %c", &divide, &extra) == 1
+	       || sscanf(item.c_str(), " %d %c", &divide, &extra) == 1) {
+      profile.divide = divide;
+    } else {
+      goto fail;
+    }
+    if (profile.modBase == 0 && profile.divide <= 0) goto fail;
+    out.push_back(profile);
+    continue;
+
+  fail:
+    fprintf(stderr, "Chunk profile not recognized: %s\n", item.c_str());
+    return false;
+  }
+
+  return !out.empty();
+}
+
+
+string ChunkProfile::toString() const {
+  stringstream ss;
+  if (divide)
+    ss << (fibonacci ? "f" : "d") << divide;
+  else
+    ss << minChunk << ":" << modBase << ":" << maxChunk;
+  return ss.str();
+}
+
+
+DedupEstimator::DedupEstimator(const vector<ChunkProfile> &profiles,
+			       unsigned sampleRate_, int intMod_)
+  : sampleRate(sampleRate_ ? sampleRate_ : 1), intMod(intMod_) {
+  settings.resize(profiles.size());
+  for (size_t i=0; i < profiles.size(); i++) {
+    settings[i].profile = profiles[i];
+    settings[i].totalChunks = 0;
+    memset(settings[i].histogram, 0, sizeof settings[i].histogram);
+  }
+  totalBytes = fileCount = 0;
+}
+
+
+bool DedupEstimator::addFile(const char *path) {
+  // empty files have nothing to dedup
+  if (getFileSize(path) == 0) {
+    lock_guard<mutex> guard(lock);
+    fileCount++;
+    return true;
+  }
+
+  MemoryMappedFile mappedFile;
+  const unsigned char *data =
+    (const unsigned char *) mappedFile.mapFile(path);
+  if (!data) return false;
+
+  addData(data, mappedFile.getLength());
+  return true;
+}
+
+
+// histogram bucket for a chunk length
+static unsigned sizeBucket(u64 len) {
+  unsigned b = 0;
+  while (len > 1) {
+    len >>= 1;
+    b++;
+  }
+  return b;
+}
+
+
+void DedupEstimator::addData(const unsigned char *data, u64 len) {
+  size_t settingCount = settings.size();
+
+  // sampled chunks of this file, merged in under the lock at the end
+  vector<vector<pair<u128, unsigned> > > fileSamples(settingCount);
+  vector<u64> fileChunks(settingCount, 0);
+  vector<vector<u64> > fileHistogram
+    (settingCount, vector<u64>(ESTIMATOR_HISTOGRAM_BUCKETS, 0));
+
+  auto addChunk = [&](size_t s, u64 start, unsigned chunkLen) {
+    u128 hash = cityHash128(data + start, chunkLen);
+    if (hash.hi % sampleRate == 0)
+      fileSamples[s].push_back(make_pair(hash, chunkLen));
+    fileChunks[s]++;
+    fileHistogram[s][sizeBucket(chunkLen)]++;
+  };
+
+  // the same choices ProcessFileToVar() makes for this file, for every
+  // setting that splits it
+  vector<RollingWindow> windows;
+  vector<size_t> windowSetting;
+  for (size_t s=0; s < settingCount; s++) {
+    const ChunkProfile &profile = settings[s].profile;
+    RollingWindow rollingWindow;
+
+    if (profile.divide) {
+      u64 modSize = profile.divide;
+      if (len <= getWholeFileThreshold(modSize) || intMod == 0) {
+	addChunk(s, 0, (unsigned) len);
+	continue;
+      }
+      u64 n = round(len / modSize);
+      rollingWindow.setAnchor(profile.fibonacci ? getFibo_range(n)
+			      : getPower2_range(n), intMod);
+    } else {
+      rollingWindow.chunkSize = profile.modBase;
+      rollingWindow.minChunkSize = profile.minChunk;
+      rollingWindow.maxChunkSize = profile.maxChunk;
+      rollingWindow.modBase = profile.modBase;
+    }
+
+    windows.push_back(rollingWindow);
+    windowSetting.push_back(s);
+  }
+
+  // one scan for all of them
+  chunkMultiple(data, len, windows,
+		[&](size_t w, u64 start, unsigned chunkLen) {
+		  addChunk(windowSetting[w], start, chunkLen);
+		});
+
+  lock_guard<mutex> guard(lock);
+  totalBytes += len;
+  fileCount++;
+  for (size_t s=0; s < settingCount; s++) {
+    settings[s].totalChunks += fileChunks[s];
+    for (unsigned b=0; b < ESTIMATOR_HISTOGRAM_BUCKETS; b++)
+      settings[s].histogram[b] += fileHistogram[s][b];
+    for (size_t i=0; i < fileSamples[s].size(); i++) {
+      Sample &sample = settings[s].samples[fileSamples[s][i].first];
+      sample.len = fileSamples[s][i].second;
+      sample.refs++;
+    }
+  }
+}
+
+
+void DedupEstimator::getEstimates(vector<DedupEstimate> &estimates) const {
+  estimates.resize(settings.size());
+
+  for (size_t s=0; s < settings.size(); s++) {
+    const Setting &setting = settings[s];
+    DedupEstimate &e = estimates[s];
+
+    e.profile = setting.profile;
+    e.totalBytes = totalBytes;
+    memcpy(e.histogram, setting.histogram, sizeof e.histogram);
+    e.totalChunks = setting.totalChunks;
+    e.sampledChunks = setting.samples.size();
+
+    // Each distinct chunk is in the sample with probability p =
+    // 1/sampleRate, so sum(len)/p is an unbiased estimate of the unique
+    // bytes, with a variance that is estimated by
+    // sum(len^2) * (1-p)/p^2.
+    double sumLen = 0, sumLenSquared = 0;
+    for (SampleMap::const_iterator it = setting.samples.begin();
+	 it != setting.samples.end(); ++it) {
+      double len = it->second.len;
+      sumLen += len;
+      sumLenSquared += len * len;
+    }
+    e.sampledBytes = (u64) sumLen;
+
+    double n = sampleRate;
+    e.uniqueBytes = sumLen * n;
+    e.uniqueChunks = (double) e.sampledChunks * n;
+    double sigma = sqrt(sumLenSquared * n * (n - 1));
+    e.uniqueLow = e.uniqueBytes - ESTIMATOR_Z * sigma;
+    e.uniqueHigh = e.uniqueBytes + ESTIMATOR_Z * sigma;
+
+    // the unique bytes can't be more than all the bytes, or less than
+    // the distinct bytes actually seen
+    if (e.uniqueHigh > totalBytes) e.uniqueHigh = (double) totalBytes;
+    if (e.uniqueLow < sumLen) e.uniqueLow = sumLen;
+    if (e.uniqueBytes > totalBytes) e.uniqueBytes = (double) totalBytes;
+
+    if (e.uniqueBytes > 0) {
+      e.ratio = totalBytes / e.uniqueBytes;
+      e.ratioLow = totalBytes / e.uniqueHigh;
+      e.ratioHigh = e.uniqueLow > 0 ? totalBytes / e.uniqueLow : e.ratio;
+    } else {
+      // too few chunks made it into the sample to say anything
+      e.ratio = e.ratioLow = e.ratioHigh = totalBytes ? 0 : 1;
+    }
+  }
+}
+
+
+size_t DedupEstimator::bestEstimate(const vector<DedupEstimate> &estimates) {
+  size_t best = 0;
+  double bestCost = 0;
+  for (size_t i=0; i < estimates.size(); i++) {
+    double cost = estimates[i].uniqueBytes
+      + estimates[i].uniqueChunks * ESTIMATOR_CHUNK_OVERHEAD;
+    if (i == 0 || cost < bestCost) {
+      best = i;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+
+string returnEstimateString;
+
+extern "C" {
+  /*
+    Estimate the dedup ratio of the file or directory tree at chrPath,
+    for each of the divideCount intDivide values in intDivides, keeping
+    one chunk fingerprint in sampleRate (0 for the default).  Files are
+    read by threadCount threads (0 for one per core).
+
+    Output, one line per setting, then the best one:
+      estimate	<divide>	<total bytes>	<chunks>	<sampled chunks>
+        <unique bytes>	<low>	<high>	<ratio>	<ratio low>	<ratio high>
+      best	<divide>
+    or with boljson, [{"type":"estimate","divide":..,..},..,
+      {"type":"best","divide":..}]
+  */
+  const char *EstimateDedupRatio(const char *chrPath, const int *intDivides,
+				 unsigned divideCount, int intMod,
+				 unsigned sampleRate, unsigned threadCount,
+				 bool boljson) {
+    stringstream ssbuffer;
+    returnEstimateString.clear();
+
+    vector<string> files;
+    if (!listRegularFiles(chrPath, files) || divideCount == 0)
+      return returnEstimateString.c_str();
+
+    if (sampleRate == 0) sampleRate = ESTIMATOR_DEFAULT_SAMPLE_RATE;
+    vector<ChunkProfile> profiles;
+    for (unsigned i=0; i < divideCount; i++)
+      profiles.push_back(ChunkProfile(intDivides[i]));
+    DedupEstimator estimator(profiles, sampleRate, intMod);
+
+    parallelFor((unsigned) files.size(), threadCount, [&](unsigned i) {
+	if (!estimator.addFile(files[i].c_str()))
+	  fprintf(stderr, "Skipping \"%s\"\n", files[i].c_str());
+      });
+
+    vector<DedupEstimate> estimates;
+    estimator.getEstimates(estimates);
+    size_t best = DedupEstimator::bestEstimate(estimates);
+
+    if (boljson) ssbuffer << "[";
+    for (size_t i=0; i < estimates.size(); i++) {
+      const DedupEstimate &e = estimates[i];
+      if (boljson) {
+	ssbuffer << "{\"type\":\"estimate\",\"divide\":" << e.profile.divide
+		 << ",\"total_bytes\":" << e.totalBytes
+		 << ",\"chunks\":" << e.totalChunks
+		 << ",\"sampled_chunks\":" << e.sampledChunks
+		 << ",\"unique_bytes\":" << (u64) e.uniqueBytes
+		 << ",\"unique_low\":" << (u64) e.uniqueLow
+		 << ",\"unique_high\":" << (u64) e.uniqueHigh
+		 << ",\"ratio\":" << e.ratio
+		 << ",\"ratio_low\":" << e.ratioLow
+		 << ",\"ratio_high\":" << e.ratioHigh << "},";
+      } else {
+	ssbuffer << "estimate\t" << e.profile.divide << "\t" << e.totalBytes
+		 << "\t" << e.totalChunks << "\t" << e.sampledChunks
+		 << "\t" << (u64) e.uniqueBytes << "\t" << (u64) e.uniqueLow
+		 << "\t" << (u64) e.uniqueHigh << "\t" << e.ratio
+		 << "\t" << e.ratioLow << "\t" << e.ratioHigh << "\n";
+      }
+    }
+    if (boljson) {
+      ssbuffer << "{\"type\":\"best\",\"divide\":" << estimates[best].profile.divide
+	       << "}]";
+    } else {
+      ssbuffer << "best\t" << estimates[best].profile.divide << "\n";
+    }
+
+    returnEstimateString = ssbuffer.str();
+    return returnEstimateString.c_str();
+  }
+
+
+  /*
+    Chunk the file or directory tree at chrPath with every profile in
+    chrProfiles (see ChunkProfile::parseList(), e.g. "d16,d32,f32,
+    2048:8192:65536") in a single pass over the data, and report each
+    profile's chunk count, chunk size histogram and dedup ratio.  With
+    a sampleRate above 1 the ratios are estimates, as in
+    EstimateDedupRatio().
+
+    Output, for each profile:
+      profile	<profile>	<total bytes>	<chunks>	<unique bytes>
+        <low>	<high>	<ratio>	<ratio low>	<ratio high>
+      hist	<profile>	<smallest size in bucket>	<chunks>
+    then
+      best	<profile>
+    or with boljson, [{"type":"profile","profile":..,..,
+      "histogram":{"<size>":<chunks>,..}},..,{"type":"best",..}]
+  */
+  const char *SweepChunkProfiles(const char *chrPath, const char *chrProfiles,
+				 int intMod, unsigned sampleRate,
+				 unsigned threadCount, bool boljson) {
+    stringstream ssbuffer;
+    returnEstimateString.clear();
+
+    vector<ChunkProfile> profiles;
+    vector<string> files;
+    if (!ChunkProfile::parseList(chrProfiles, profiles)
+	|| !listRegularFiles(chrPath, files))
+      return returnEstimateString.c_str();
+
+    DedupEstimator estimator(profiles, sampleRate ? sampleRate : 1, intMod);
+    parallelFor((unsigned) files.size(), threadCount, [&](unsigned i) {
+	if (!estimator.addFile(files[i].c_str()))
+	  fprintf(stderr, "Skipping \"%s\"\n", files[i].c_str());
+      });
+
+    vector<DedupEstimate> estimates;
+    estimator.getEstimates(estimates);
+    size_t best = DedupEstimator::bestEstimate(estimates);
+
+    if (boljson) ssbuffer << "[";
+    for (size_t i=0; i < estimates.size(); i++) {
+      const DedupEstimate &e = estimates[i];
+      string name = e.profile.toString();
+      if (boljson) {
+	ssbuffer << "{\"type\":\"profile\",\"profile\":\"" << name
+		 << "\",\"total_bytes\":" << e.totalBytes
+		 << ",\"chunks\":" << e.totalChunks
+		 << ",\"unique_bytes\":" << (u64) e.uniqueBytes
+		 << ",\"unique_low\":" << (u64) e.uniqueLow
+		 << ",\"unique_high\":" << (u64) e.uniqueHigh
+		 << ",\"ratio\":" << e.ratio
+		 << ",\"ratio_low\":" << e.ratioLow
+		 << ",\"ratio_high\":" << e.ratioHigh << ",\"histogram\":{";
+	bool first = true;
+	for (unsigned b=0; b < ESTIMATOR_HISTOGRAM_BUCKETS; b++) {
+	  if (!e.histogram[b]) continue;
+	  ssbuffer << (first ? "" : ",") << "\"" << (1ULL << b) << "\":"
+		   << e.histogram[b];
+	  first = false;
+	}
+	ssbuffer << "}},";
+      } else {
+	ssbuffer << "profile\t" << name << "\t" << e.totalBytes
+		 << "\t" << e.totalChunks << "\t" << (u64) e.uniqueBytes
+		 << "\t" << (u64) e.uniqueLow << "\t" << (u64) e.uniqueHigh
+		 << "\t" << e.ratio << "\t" << e.ratioLow
+		 << "\t" << e.ratioHigh << "\n";
+	for (unsigned b=0; b < ESTIMATOR_HISTOGRAM_BUCKETS; b++) {
+	  if (e.histogram[b])
+	    ssbuffer << "hist\t" << name << "\t" << (1ULL << b) << "\t"
+		     << e.histogram[b] << "\n";
+	}
+      }
+    }
+    string bestName = estimates[best].profile.toString();
+    if (boljson) {
+      ssbuffer << "{\"type\":\"best\",\"profile\":\"" << bestName << "\"}]";
+    } else {
+      ssbuffer << "best\t" << bestName << "\n";
+    }
+
+    returnEstimateString = ssbuffer.str();
+    return returnEstimateString.c_str();
+  }
+}
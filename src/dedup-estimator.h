@@ -0,0 +1,134 @@
+#ifndef __DEDUP_ESTIMATOR_H__
+#define __DEDUP_ESTIMATOR_H__
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "u64.h"
+#include "u128.h"
+#include "manifest.h"
+
+// default: keep one fingerprint in this many
+#define ESTIMATOR_DEFAULT_SAMPLE_RATE 64
+
+// bytes of index and manifest each unique chunk is assumed to cost when
+// choosing the best setting
+#define ESTIMATOR_CHUNK_OVERHEAD 64
+
+// z for the two-sided 95% confidence bounds
+#define ESTIMATOR_Z 1.96
+
+
+// number of chunk size histogram buckets; bucket b counts chunks of
+// [2^b, 2^(b+1)) bytes
+#define ESTIMATOR_HISTOGRAM_BUCKETS 64
+
+
+/*
+  One chunking setting.  Either the anchor is picked per file from
+  divide like ProcessFileToVar() does (by power of 2, or by Fibonacci
+  number if fibonacci is set), or divide is 0 and the chunk limits are
+  fixed.
+*/
+struct ChunkProfile {
+  int divide;
+  bool fibonacci;
+  u64 minChunk, modBase, maxChunk;
+
+  ChunkProfile(int divide_ = 0, bool fibonacci_ = false)
+    : divide(divide_), fibonacci(fibonacci_),
+      minChunk(0), modBase(0), maxChunk(0) {}
+
+  // Parse a comma-separated list of profiles:
+  //   <n> or d<n>          intDivide n, power of 2 anchor
+  //   f<n>                 intDivide n, Fibonacci anchor
+  //   <min>:<mod>:<max>    fixed limits, e.g. LBFS is 2048:8192:65536
+  static bool parseList(const char *spec, std::vector<ChunkProfile> &out);
+
+  // the same form parseList() reads
+  std::string toString() const;
+};
+
+
+// estimate for one chunking setting
+struct DedupEstimate {
+  ChunkProfile profile;
+
+  // every byte and chunk seen, sampled or not
+  u64 totalBytes, totalChunks;
+
+  // distinct fingerprints in the sample, and their bytes
+  u64 sampledChunks, sampledBytes;
+
+  // estimated bytes and chunks left after dedup, with bounds on bytes
+  double uniqueBytes, uniqueLow, uniqueHigh, uniqueChunks;
+
+  // totalBytes / uniqueBytes, with the matching bounds
+  double ratio, ratioLow, ratioHigh;
+
+  // chunk counts by size, see ESTIMATOR_HISTOGRAM_BUCKETS
+  u64 histogram[ESTIMATOR_HISTOGRAM_BUCKETS];
+};
+
+
+/*
+  Estimates how well a dataset would dedup without indexing all of it.
+
+  Files are chunked exactly as ProcessFileToVar() would, for one or more
+  profiles at once (see chunkMultiple()), but a chunk's fingerprint is
+  only kept if it falls in a 1/sampleRate slice of the hash space.  The
+  slice is chosen by hash value, so every copy of a sampled chunk is
+  sampled too, and the distinct sampled chunks are a uniform random
+  sample of the distinct chunks.  Their bytes times sampleRate estimate
+  the unique bytes, and the spread of their sizes gives the confidence
+  bounds.  With a sampleRate of 1 the results are exact.
+
+  Memory use is about 1/sampleRate of a full index.  addFile() may be
+  called from several threads at once.
+*/
+class DedupEstimator {
+  struct Sample {
+    unsigned len;
+    u64 refs;
+  };
+  typedef std::unordered_map<u128, Sample, ChunkHashHasher> SampleMap;
+
+  struct Setting {
+    ChunkProfile profile;
+    u64 totalChunks;
+    u64 histogram[ESTIMATOR_HISTOGRAM_BUCKETS];
+    SampleMap samples;
+  };
+
+  unsigned sampleRate;
+  int intMod;
+  std::vector<Setting> settings;
+  u64 totalBytes, fileCount;
+
+  std::mutex lock;
+
+ public:
+  // intMod is 1 for fixed-size chunks, 2 for variable-size, as in
+  // ProcessFileToVar().
+  DedupEstimator(const std::vector<ChunkProfile> &profiles,
+		 unsigned sampleRate_, int intMod_ = 2);
+
+  // Chunk a file for every setting.  Returns false if it can't be read.
+  bool addFile(const char *path);
+
+  // Chunk one file's contents for every setting.
+  void addData(const unsigned char *data, u64 len);
+
+  u64 getFileCount() const {return fileCount;}
+
+  // one estimate per setting, in the order given to the constructor
+  void getEstimates(std::vector<DedupEstimate> &estimates) const;
+
+  // index of the setting with the smallest estimated unique bytes plus
+  // ESTIMATOR_CHUNK_OVERHEAD per unique chunk
+  static size_t bestEstimate(const std::vector<DedupEstimate> &estimates);
+};
+
+
+#endif // __DEDUP_ESTIMATOR_H__
@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "dedup-table.h"
+#include "dedup-util.h"
+#include "HashAlgs.h"
+
+using namespace std;
+
+// Each thread of a merge owns at least this many slots of the entries
+// array.  Partitions are sized so there are a few per thread, which
+// evens out the load when hash values are unevenly spread.
+#define MERGE_MIN_PARTITION_SLOTS 4096
+#define MERGE_PARTITIONS_PER_THREAD 4
+
+
+// what a merge needs to know about one input table
+struct MergeInput {
+  const char *filename;
+  unsigned blockSize, allocatedSize, baseBlocks;
+  unsigned segmentCount, segmentBlocks, filterBits;
+  bool hasStrongHashes;
+
+  // number of the input's first block in the merged table
+  unsigned firstBlock;
+
+  unsigned blockCount() const {return baseBlocks + segmentBlocks;}
+};
+
+
+// read and check the header of a serialized table
+static bool readMergeHeader(const char *filename, MergeInput &input) {
+  FILE *inf = fopen(filename, "rb");
+  if (!inf) {
+    fprintf(stderr, "Cannot read \"%s\"\n", filename);
+    return false;
+  }
+
+  char header[DEDUP_TABLE_HEADER_SIZE];
+  size_t readLen = fread(header, 1, DEDUP_TABLE_HEADER_SIZE, inf);
+  fclose(inf);
+  if (readLen != DEDUP_TABLE_HEADER_SIZE || strncmp(header, "ddup", 4)
+      || *(unsigned*)(header+4) > 1) {
+    fprintf(stderr, "Format error reading \"%s\".\n", filename);
+    return false;
+  }
+
+  unsigned hashAlg1No = *(unsigned char*)(header+24);
+  if (hashAlg1No != HASH_ALGORITHM) {
+    fprintf(stderr, "Error: \"%s\" built with %s algorithm, \n"
+	    "  but this code was compiled with %s algorithm.\n", filename,
+	    getHashFunctionName(hashAlg1No),
+	    getHashFunctionName(getDefaultHashFunctionId()));
+    return false;
+  }
+
+  input.filename = filename;
+  input.blockSize = *(unsigned*)(header+8);
+  input.allocatedSize = *(unsigned*)(header+12);
+  input.baseBlocks = *(unsigned*)(header+20);
+  input.hasStrongHashes = *(unsigned char*)(header+25) == HASH_ALG_CITY128;
+  input.filterBits = *(unsigned char*)(header+26);
+  if (*(unsigned*)(header+4) == 1) {
+    input.segmentCount = *(unsigned*)(header+28);
+    input.segmentBlocks = *(unsigned*)(header+32);
+  } else {
+    input.segmentCount = input.segmentBlocks = 0;
+  }
+  return true;
+}
+
+
+/*
+  Copy the block hashes of one input, base table and delta segments, to
+  hashes[0..blockCount), and its strong hashes to strongs[] unless that
+  is NULL.  Everything else in the file is skipped over.
+*/
+static bool readMergeInput(const MergeInput &input, hash_t *hashes,
+			   u128 *strongs) {
+  FILE *inf = fopen(input.filename, "rb");
+  if (!inf) return false;
+
+  unsigned count, dupBlockCount, filterBlockCount;
+  unsigned blockNo = input.baseBlocks;
+  char magic[4];
+
+  // block hashes follow the entries array
+  u64 pos = DEDUP_TABLE_HEADER_SIZE
+    + (u64)input.allocatedSize * sizeof(DedupTable::Entry);
+  if (seekFile(inf, pos)) goto fail;
+  if (fread(hashes, sizeof(hash_t), input.baseBlocks, inf)
+      != input.baseBlocks)
+    goto fail;
+  pos += (u64)input.baseBlocks * sizeof(hash_t);
+
+  // skip the duplicate block chains
+  if (fread(&dupBlockCount, sizeof(unsigned), 1, inf) != 1) goto fail;
+  pos += sizeof(unsigned);
+  for (unsigned dupNo=0; dupNo < dupBlockCount; dupNo++) {
+    pos += sizeof(hash_t);
+    if (seekFile(inf, pos)
+	|| fread(&count, sizeof(unsigned), 1, inf) != 1)
+      goto fail;
+    pos += sizeof(unsigned) + (u64)count * sizeof(unsigned);
+  }
+
+  // skip the filter: block count, add count, blocks
+  if (input.filterBits) {
+    if (seekFile(inf, pos)
+	|| fread(&filterBlockCount, sizeof(unsigned), 1, inf) != 1)
+      goto fail;
+    pos += sizeof(unsigned) + sizeof(u64)
+      + (u64)filterBlockCount * BLOOM_FILTER_BLOCK_SIZE;
+  }
+
+  if (input.hasStrongHashes) {
+    if (strongs) {
+      if (seekFile(inf, pos)
+	  || fread(strongs, sizeof(u128), input.baseBlocks, inf)
+	     != input.baseBlocks)
+	goto fail;
+    }
+    pos += (u64)input.baseBlocks * sizeof(u128);
+  }
+
+  if (seekFile(inf, pos)) goto fail;
+  for (unsigned segNo=0; segNo < input.segmentCount; segNo++) {
+    if (fread(magic, 1, 4, inf) != 4
+	|| memcmp(magic, DEDUP_TABLE_SEGMENT_MAGIC, 4)
+	|| fread(&count, sizeof(unsigned), 1, inf) != 1
+	|| count > input.blockCount() - blockNo
+	|| fread(hashes + blockNo, sizeof(hash_t), count, inf) != count)
+      goto fail;
+    pos += 4 + sizeof(unsigned) + (u64)count * sizeof(hash_t);
+
+    if (input.hasStrongHashes) {
+      if (strongs) {
+	if (fread(strongs + blockNo, sizeof(u128), count, inf) != count)
+	  goto fail;
+      } else if (seekFile(inf, pos + (u64)count * sizeof(u128))) {
+	goto fail;
+      }
+      pos += (u64)count * sizeof(u128);
+    }
+    blockNo += count;
+  }
+  if (blockNo != input.blockCount()) goto fail;
+
+  fclose(inf);
+  return true;
+
+ fail:
+  fclose(inf);
+  fprintf(stderr, "Format error reading \"%s\".\n", input.filename);
+  return false;
+}
+
+
+DedupTable *DedupTable::mergeFiles(const vector<string> &filenames,
+				   unsigned threadCount, bool verbose) {
+  if (filenames.empty()) return NULL;
+  if (threadCount == 0) threadCount = defaultThreadCount();
+
+  vector<MergeInput> inputs(filenames.size());
+  u64 totalBlocks = 0;
+  bool withStrongHashes = true;
+  unsigned filterBits = 0;
+
+  for (size_t i=0; i < filenames.size(); i++) {
+    MergeInput &input = inputs[i];
+    if (!readMergeHeader(filenames[i].c_str(), input)) return NULL;
+    if (input.blockSize != inputs[0].blockSize) {
+      fprintf(stderr, "\"%s\" has %u byte blocks, \"%s\" has %u.\n",
+	      input.filename, input.blockSize,
+	      inputs[0].filename, inputs[0].blockSize);
+      return NULL;
+    }
+    input.firstBlock = (unsigned) totalBlocks;
+    totalBlocks += input.blockCount();
+    if (!input.hasStrongHashes) withStrongHashes = false;
+    if (input.filterBits > filterBits) filterBits = input.filterBits;
+  }
+
+  if (totalBlocks >= 0x80000000u) {
+    fprintf(stderr, "FAIL: %llu blocks is too many for one table.\n",
+	    totalBlocks);
+    return NULL;
+  }
+  unsigned blockCount = (unsigned) totalBlocks;
+
+  // sized for every block having a distinct hash, so it never grows
+  DedupTable *table = new DedupTable(inputs[0].blockSize, false, blockCount);
+  table->blockHashes.resize(blockCount);
+  if (withStrongHashes) {
+    table->strongHashing = true;
+    table->strongHashes.resize(blockCount);
+  }
+
+  char buf[28];
+  double startTime = timeInSeconds();
+  if (verbose) {
+    printf("Reading %s hash values from %u tables...\n",
+	   commafy(buf, blockCount), (unsigned) inputs.size());
+    fflush(stdout);
+  }
+
+  // each input fills its own range of blockHashes
+  vector<char> readOk(inputs.size(), 0);
+  parallelFor((unsigned) inputs.size(), threadCount, [&](unsigned i) {
+      const MergeInput &input = inputs[i];
+      if (input.blockCount() == 0) {
+	readOk[i] = 1;
+	return;
+      }
+      readOk[i] = readMergeInput
+	(input, &table->blockHashes[input.firstBlock],
+	 withStrongHashes ? &table->strongHashes[input.firstBlock] : NULL);
+    });
+  for (size_t i=0; i < inputs.size(); i++) {
+    if (!readOk[i]) {
+      delete table;
+      return NULL;
+    }
+  }
+
+  /*
+    Split the entries array into equal ranges of slots.  Each range is
+    filled by one thread.  The blocks are first bucketed by the range
+    their hash starts probing in, keeping them in order, so each thread
+    only walks its own bucket and chains of duplicates come out sorted
+    just as if the blocks had been added one at a time.  A probe that
+    would run off the end of its range can't be placed without touching
+    another thread's slots; those blocks are set aside and added
+    afterwards, in order, by one thread.  Every block with that hash
+    value follows the same probe path and is set aside too, so no hash
+    ends up in two entries.
+  */
+  unsigned partitionCount = 1;
+  while (partitionCount < threadCount * MERGE_PARTITIONS_PER_THREAD
+	 && table->allocatedSize / (partitionCount*2)
+	    >= MERGE_MIN_PARTITION_SLOTS)
+    partitionCount *= 2;
+  unsigned partitionSize = table->allocatedSize / partitionCount;
+
+  struct Partition {
+    vector<DuplicateBlocks*> dups;
+    vector<unsigned> spilled;
+    unsigned entryCount;
+  };
+  vector<Partition> partitions(partitionCount);
+
+  if (verbose) {
+    printf("Indexing in %u partitions...\n", partitionCount);
+    fflush(stdout);
+  }
+
+  /*
+    Bucket the block numbers by partition with a counting sort.  Each
+    thread counts the partitions of one slice of the blocks; the counts
+    then give where each slice's blocks start in each bucket, so the
+    slices can be scattered at the same time and every bucket is still
+    in block order.
+  */
+  unsigned sizeMask = table->allocatedSize - 1;
+  unsigned sliceCount = threadCount;
+  u64 sliceSize = ((u64)blockCount + sliceCount - 1) / sliceCount;
+
+  // slice s's count for, then its next position in, partition p is at
+  // s * partitionCount + p
+  vector<unsigned> sliceNext((size_t)sliceCount * partitionCount, 0);
+  parallelFor(sliceCount, threadCount, [&](unsigned s) {
+      unsigned *counts = &sliceNext[(size_t)s * partitionCount];
+      unsigned start = (unsigned) min(s * sliceSize, (u64)blockCount);
+      unsigned end = (unsigned) min((s+1) * sliceSize, (u64)blockCount);
+      for (unsigned blockNo = start; blockNo < end; blockNo++)
+	counts[(table->blockHashes[blockNo] & sizeMask) / partitionSize]++;
+    });
+
+  vector<unsigned> bucketStart(partitionCount + 1);
+  unsigned bucketEnd = 0;
+  for (unsigned p=0; p < partitionCount; p++) {
+    bucketStart[p] = bucketEnd;
+    for (unsigned s=0; s < sliceCount; s++) {
+      unsigned count = sliceNext[(size_t)s * partitionCount + p];
+      sliceNext[(size_t)s * partitionCount + p] = bucketEnd;
+      bucketEnd += count;
+    }
+  }
+  bucketStart[partitionCount] = bucketEnd;
+
+  vector<unsigned> buckets(blockCount);
+  parallelFor(sliceCount, threadCount, [&](unsigned s) {
+      unsigned *next = &sliceNext[(size_t)s * partitionCount];
+      unsigned start = (unsigned) min(s * sliceSize, (u64)blockCount);
+      unsigned end = (unsigned) min((s+1) * sliceSize, (u64)blockCount);
+      for (unsigned blockNo = start; blockNo < end; blockNo++)
+	buckets[next[(table->blockHashes[blockNo] & sizeMask)
+		     / partitionSize]++] = blockNo;
+    });
+
+  parallelFor(partitionCount, threadCount, [&](unsigned p) {
+      Partition &part = partitions[p];
+      unsigned hi = (p+1) * partitionSize;
+      Entry *entries = table->entries;
+      part.entryCount = 0;
+
+      for (unsigned i = bucketStart[p]; i < bucketStart[p+1]; i++) {
+	unsigned blockNo = buckets[i];
+	hash_t hashValue = table->blockHashes[blockNo];
+	unsigned entryNo = hashValue & sizeMask;
+
+	while (entries[entryNo].hashValue != 0
+	       && entries[entryNo].hashValue != hashValue) {
+	  entryNo++;
+	  if (entryNo == hi) break;
+	}
+
+	if (entryNo == hi) {
+	  part.spilled.push_back(blockNo);
+	} else if (entries[entryNo].hashValue == 0) {
+	  entries[entryNo].hashValue = hashValue;
+	  entries[entryNo].blockNo = blockNo;
+	  entries[entryNo].count = 1;
+	  part.entryCount++;
+	} else {
+	  // duplicate chains are numbered within the partition for now
+	  Entry *entry = &entries[entryNo];
+	  if (entry->count == 1) {
+	    DuplicateBlocks *db = new DuplicateBlocks;
+	    db->hashValue = hashValue;
+	    db->blocks.push_back(entry->blockNo);
+	    db->blocks.push_back(blockNo);
+	    entry->blockNo = part.dups.size();
+	    part.dups.push_back(db);
+	  } else {
+	    part.dups[entry->blockNo]->blocks.push_back(blockNo);
+	  }
+	  entry->count++;
+	}
+      }
+    });
+
+  // renumber each partition's duplicate chains into one list
+  vector<unsigned> dupOffsets(partitionCount);
+  for (unsigned p=0; p < partitionCount; p++) {
+    dupOffsets[p] = table->duplicateBlocks.size();
+    table->duplicateBlocks.insert(table->duplicateBlocks.end(),
+				  partitions[p].dups.begin(),
+				  partitions[p].dups.end());
+    table->entryCount += partitions[p].entryCount;
+  }
+  parallelFor(partitionCount, threadCount, [&](unsigned p) {
+      if (dupOffsets[p] == 0) return;
+      Entry *entries = table->entries;
+      for (unsigned i = p * partitionSize; i < (p+1) * partitionSize; i++)
+	if (entries[i].count > 1) entries[i].blockNo += dupOffsets[p];
+    });
+
+  // add the blocks whose probes crossed a partition boundary
+  unsigned spillCount = 0;
+  for (unsigned p=0; p < partitionCount; p++) {
+    const vector<unsigned> &spilled = partitions[p].spilled;
+    for (size_t i=0; i < spilled.size(); i++)
+      table->insertEntry(table->blockHashes[spilled[i]], spilled[i]);
+    spillCount += spilled.size();
+  }
+
+  if (filterBits) table->enableFilter(filterBits);
+
+  if (verbose) {
+    printf("Merged %s blocks, %s unique, %u added serially, in %.3f sec\n",
+	   commafy(buf, blockCount), commafy(buf+14, table->entryCount),
+	   spillCount, timeInSeconds() - startTime);
+    fflush(stdout);
+  }
+
+  return table;
+}
+
+
+extern "C" {
+  /*
+    Merge chrCount serialized DedupTables into one and write it to
+    chrOutPath.  Block numbers in the result count through the inputs in
+    the order given.  threadCount of 0 uses one thread per core.
+    Returns the size of the merged table file, or -1 on error.
+  */
+  long long MergeDedupTables(const char **chrPaths, unsigned chrCount,
+			     const char *chrOutPath, unsigned threadCount) {
+    vector<string> filenames(chrPaths, chrPaths + chrCount);
+    DedupTable *table = DedupTable::mergeFiles(filenames, threadCount);
+    if (!table) return -1;
+
+    u64 size = table->writeToFile(chrOutPath);
+    delete table;
+    return size ? (long long) size : -1;
+  }
+}
@@ -9,23 +9,31 @@
 #include "dedup-table.h"
 #include "dedup-util.h"
 #include "HashAlgs.h"
+#include "large-alloc.h"
 
 // number of bytes in the header for a serialized DedupFile
-#define HEADER_SIZE 64
+#define HEADER_SIZE DEDUP_TABLE_HEADER_SIZE
+#define SEGMENT_MAGIC DEDUP_TABLE_SEGMENT_MAGIC
 
 #define CREATE_BUF_SIZE (1024*1024)
 #define CREATE_STATUS_INTERVAL 100000000
 #define EMPTY_INDEX_SIZE 128
 
 // allocate memory for 'size' entries, complaining if the malloc fails
-void DedupTable::allocateEntries(int size) {
-  entries = new Entry[size];
+void DedupTable::allocateEntries(unsigned size) {
+  // comes back zero-filled, and for big tables the zeroing is done
+  // lazily by the kernel as pages are touched
+  entries = (Entry*) largeAlloc((size_t)size * sizeof(Entry));
   if (!entries) {
     fprintf(stderr, "Failed to allocate %llu bytes for hash table\n",
-	    (u64)(size * sizeof(Entry)));
+	    (u64)size * sizeof(Entry));
     exit(1);
   }
-  memset(entries, 0, size * sizeof(Entry));
+}
+
+
+void DedupTable::freeEntries(Entry *array, unsigned size) {
+  largeFree(array, (size_t)size * sizeof(Entry));
 }
 
 
@@ -41,16 +49,29 @@ void DedupTable::grow(unsigned minimumNewSize) {
 
   if (minimumNewSize <= allocatedSize) return;
 
+  // only one incremental grow can be in progress at a time
+  finishGrow();
+
   unsigned oldSize = allocatedSize;
 
   // save pointers to the beginning and end of the old data array
-  Entry *oldEntries = entries;
+  Entry *prevEntries = entries;
 
   // double the size and allocate a new array
   allocatedSize = roundUpSize(minimumNewSize);
   maxCount = (int)(maxLoadFactor * allocatedSize);
   allocateEntries(allocatedSize);
 
+  if (incrementalGrow) {
+    // leave the entries where they are; inserts will move them
+    oldEntries = prevEntries;
+    oldAllocatedSize = oldSize;
+    migratePos = 0;
+    if (filter)
+      nextFilter = new BlockedBloomFilter(maxCount, filterBitsPerEntry);
+    return;
+  }
+
   /*
   double startTime = timeInSeconds();
   printf("Growing from %u to %u...", oldSize, allocatedSize);
@@ -59,67 +80,161 @@ void DedupTable::grow(unsigned minimumNewSize) {
 
   // move all the old entries to the new array
   unsigned entriesFound = 0;
-  int sizeMask = allocatedSize-1;
   for (unsigned i=0; i < oldSize; i++) {
-    if (oldEntries[i].hashValue != 0) {
+    if (prevEntries[i].hashValue != 0) {
       entriesFound++;
-
-      // find an empty slot
-      int newPos = oldEntries[i].hashValue & sizeMask;
-      while (entries[newPos].hashValue != 0)
-	newPos = (newPos+1) & sizeMask;
-
-      entries[newPos] = oldEntries[i];
+      placeEntry(prevEntries[i]);
     }
   }
   assert(entryCount == entriesFound);
   // fprintf(stderr, "%d of %d entries rehashed\n", entriesFound, size());
 
+  // resize the filter to match the new capacity
+  if (filter) rebuildFilter();
+
   /*
   printf("done. (%.3f sec)\n", timeInSeconds() - startTime);
   fflush(stdout);
   */
 
-  delete[] oldEntries;
+  freeEntries(prevEntries, oldSize);
+}
+
+
+// store an entry in the first empty slot of 'entries' for its hash
+void DedupTable::placeEntry(const Entry &entry) {
+  int sizeMask = allocatedSize-1;
+  int newPos = entry.hashValue & sizeMask;
+  while (entries[newPos].hashValue != 0)
+    newPos = (newPos+1) & sizeMask;
+
+  entries[newPos] = entry;
+}
+
+
+// move up to bucketCount buckets from oldEntries to entries
+void DedupTable::migrateBuckets(unsigned bucketCount) {
+  unsigned end = migratePos + bucketCount;
+  if (end > oldAllocatedSize) end = oldAllocatedSize;
+
+  for (; migratePos < end; migratePos++) {
+    if (oldEntries[migratePos].hashValue != 0) {
+      placeEntry(oldEntries[migratePos]);
+      if (nextFilter) nextFilter->add(oldEntries[migratePos].hashValue);
+    }
+  }
+
+  if (migratePos == oldAllocatedSize) {
+    freeEntries(oldEntries, oldAllocatedSize);
+    oldEntries = NULL;
+    oldAllocatedSize = 0;
+    migratePos = 0;
+
+    // every entry is in the new filter now
+    if (nextFilter) {
+      delete filter;
+      filter = nextFilter;
+      nextFilter = NULL;
+    }
+  }
 }
 
+
+// Complete any incremental grow that is in progress.
+void DedupTable::finishGrow() {
+  if (oldEntries) migrateBuckets(oldAllocatedSize);
+}
+
+
+// add blockNo to an entry already holding hashValue
+void DedupTable::addDuplicate(Entry *entry, hash_t hashValue,
+			      unsigned blockNo) {
+  if (entry->count == 1) {
+    DuplicateBlocks *db = new DuplicateBlocks;
+    db->hashValue = hashValue;
+    db->blocks.push_back(entry->blockNo);
+    db->blocks.push_back(blockNo);
+    entry->blockNo = duplicateBlocks.size();
+    duplicateBlocks.push_back(db);
+  } else {
+    duplicateBlocks[entry->blockNo]->blocks.push_back(blockNo);
+  }
+  entry->count++;
+}
+
+
 // Add an entry that has already been hashed.
 // This method doesn't check if the table has exceeded maxLoadFactor.
 void DedupTable::addHashedEntry(hash_t hashValue, unsigned blockNo) {
+  blockHashes.push_back(hashValue);
+  insertEntry(hashValue, blockNo);
+}
+
+
+// index blockNo under hashValue, without touching blockHashes
+void DedupTable::insertEntry(hash_t hashValue, unsigned blockNo) {
+
+  if (oldEntries) migrateBuckets(DEDUP_TABLE_MIGRATE_BUCKETS);
 
   // assuming allocatedSize is a power of 2, this is equivalent to:
   //   entryNo = hashValue % allocatedSize
   int sizeMask = allocatedSize-1;
   int entryNo = hashValue & sizeMask;
 
-  blockHashes.push_back(hashValue);
-
   // linear probing
   while (entries[entryNo].hashValue != 0) {
 
     if (entries[entryNo].hashValue == hashValue) {
       // add another block for this hash value
-      if (entries[entryNo].count == 1) {
-	DuplicateBlocks *db = new DuplicateBlocks;
-	db->hashValue = hashValue;
-	db->blocks.push_back(entries[entryNo].blockNo);
-	db->blocks.push_back(blockNo);
-	entries[entryNo].blockNo = duplicateBlocks.size();
-	duplicateBlocks.push_back(db);
-      } else {
-	duplicateBlocks[entries[entryNo].blockNo]->blocks.push_back(blockNo);
-      }
-      entries[entryNo].count++;
+      addDuplicate(&entries[entryNo], hashValue, blockNo);
       return;
     }
 
     entryNo = (entryNo+1) & sizeMask;
   }
 
+  // An entry still waiting to be moved is updated in place, and the
+  // move will carry the new count along.
+  if (oldEntries) {
+    Entry *oldEntry = probeOldTable(hashValue);
+    if (oldEntry) {
+      addDuplicate(oldEntry, hashValue, blockNo);
+      return;
+    }
+  }
+
   entries[entryNo].hashValue = hashValue;
   entries[entryNo].blockNo = blockNo;
   entries[entryNo].count = 1;
   entryCount++;
+
+  if (filter) filter->add(hashValue);
+  if (nextFilter) nextFilter->add(hashValue);
+}
+
+
+void DedupTable::rebuildFilter() {
+  delete filter;
+  filter = new BlockedBloomFilter(maxCount, filterBitsPerEntry);
+  for (unsigned i=0; i < allocatedSize; i++) {
+    if (entries[i].hashValue != 0)
+      filter->add(entries[i].hashValue);
+  }
+}
+
+
+void DedupTable::enableFilter(unsigned bitsPerEntry) {
+  finishGrow();
+  filterBitsPerEntry = bitsPerEntry;
+  rebuildFilter();
+}
+
+
+void DedupTable::disableFilter() {
+  delete filter;
+  delete nextFilter;
+  filter = nextFilter = NULL;
+  filterBitsPerEntry = 0;
 }
 
 
@@ -147,6 +262,7 @@ DedupTable::DedupTable(unsigned blockSize_,
 		       unsigned initialCapacity,
 		       float maxLoadFactor_) {
   blockSize = blockSize_;
+  sourceSize = sourceModTime = 0;
   maxLoadFactor = maxLoadFactor_;
 
   if (capacityIsAllocationSize) {
@@ -167,6 +283,18 @@ DedupTable::DedupTable(unsigned blockSize_,
 
   probeCalls = probeIters = 0;
 
+  filter = NULL;
+  filterBitsPerEntry = 0;
+
+  strongHashing = false;
+
+  persistedBlockCount = 0;
+
+  incrementalGrow = false;
+  oldEntries = NULL;
+  oldAllocatedSize = migratePos = 0;
+  nextFilter = NULL;
+
   // simple sanity checks
   assert(maxLoadFactor > 0);
   assert(maxLoadFactor < 1);
@@ -182,16 +310,31 @@ DedupTable::~DedupTable() {
     printf("%llu calls to probeTable(), average iters = %.3f\n",
 	   probeCalls, (double)probeIters/probeCalls);
 #endif
-  delete[] entries;
+  freeEntries(entries, allocatedSize);
+  freeEntries(oldEntries, oldAllocatedSize);
+  delete filter;
+  delete nextFilter;
   for (unsigned i=0; i<duplicateBlocks.size(); i++)
     delete duplicateBlocks[i];
 }
 
 
 void DedupTable::addBlock(const char *data) {
+  hash_t hashValue = hash(data, blockSize);
+
+  if (strongHashing) {
+    u128 strong = strongHash(data, blockSize);
+    addHashedBlock(hashValue, &strong);
+  } else {
+    addHashedBlock(hashValue);
+  }
+}
+
+
+void DedupTable::addHashedBlock(hash_t hashValue, const u128 *strong) {
   if (entryCount >= maxCount) grow(allocatedSize*2);
 
-  hash_t hashValue = hash(data, blockSize);
+  if (strongHashing) strongHashes.push_back(*strong);
 
   addHashedEntry(hashValue, size());
 }
@@ -221,6 +364,56 @@ bool DedupTable::findHashedFirstMatch(hash_t hashValue,
 }
 
 
+unsigned DedupTable::hasMatches(const hash_t *hashValues, unsigned count,
+				bool *found) const {
+  unsigned matchCount = 0;
+
+  // prime the pipeline
+  unsigned ahead = count < DEDUP_TABLE_PREFETCH_DISTANCE
+    ? count : DEDUP_TABLE_PREFETCH_DISTANCE;
+  for (unsigned i=0; i < ahead; i++)
+    prefetchSlot(hashValues[i]);
+
+  for (unsigned i=0; i < count; i++) {
+    if (i + DEDUP_TABLE_PREFETCH_DISTANCE < count)
+      prefetchSlot(hashValues[i + DEDUP_TABLE_PREFETCH_DISTANCE]);
+
+    found[i] = probeTable(hashValues[i]) != NULL;
+    if (found[i]) matchCount++;
+  }
+
+  return matchCount;
+}
+
+
+unsigned DedupTable::findHashedFirstMatches(const hash_t *hashValues,
+					    unsigned count,
+					    unsigned *blockNos) {
+  unsigned matchCount = 0;
+
+  unsigned ahead = count < DEDUP_TABLE_PREFETCH_DISTANCE
+    ? count : DEDUP_TABLE_PREFETCH_DISTANCE;
+  for (unsigned i=0; i < ahead; i++)
+    prefetchSlot(hashValues[i]);
+
+  for (unsigned i=0; i < count; i++) {
+    if (i + DEDUP_TABLE_PREFETCH_DISTANCE < count)
+      prefetchSlot(hashValues[i + DEDUP_TABLE_PREFETCH_DISTANCE]);
+
+    Entry *entry = probeTable(hashValues[i]);
+    if (!entry) {
+      blockNos[i] = DEDUP_TABLE_NO_MATCH;
+    } else {
+      blockNos[i] = entry->count == 1 ? entry->blockNo
+	: duplicateBlocks[entry->blockNo]->blocks[0];
+      matchCount++;
+    }
+  }
+
+  return matchCount;
+}
+
+
 // If any matching blocks are found, store them in blockNos and return
 // true.  Otherwise return false.
 bool DedupTable::findAllMatches(const char *data,
@@ -284,6 +477,9 @@ bool DedupTable::findHashedMatch(hash_t hashValue, unsigned blockNo) {
 u64 DedupTable::writeToFile(const char *filename, bool verbose) {
   char header[HEADER_SIZE] = {0};
 
+  // the entries array is written as is, so it must be complete
+  finishGrow();
+
   FILE *outf = fopen(filename, "wb");
   if (!outf) {
     fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
@@ -299,9 +495,15 @@ u64 DedupTable::writeToFile(const char *filename, bool verbose) {
   *(unsigned*)(header+16) = entryCount;
   *(unsigned*)(header+20) = blockHashes.size();
   *(unsigned char*)(header+24) = HASH_ALGORITHM;  // primary hash algorithm
-  *(unsigned char*)(header+25) = 0;  // secondary hash algorithm
-
-  // write the header
+  // secondary hash algorithm
+  *(unsigned char*)(header+25) = strongHashing ? HASH_ALG_CITY128 : 0;
+  *(unsigned char*)(header+26) = filterBitsPerEntry;  // 0 if no filter
+  *(unsigned*)(header+28) = 0;  // number of delta segments
+  *(unsigned*)(header+32) = 0;  // blocks in delta segments
+  *(u64*)(header+48) = sourceSize;  // 0 if unknown
+  *(u64*)(header+56) = sourceModTime;
+
+  // write the header; the end of data (header+40) is filled in below
   fwrite(header, HEADER_SIZE, 1, outf);
 
   char buf[27];
@@ -338,11 +540,189 @@ u64 DedupTable::writeToFile(const char *filename, bool verbose) {
     dupBlockSize += dup->blocks.writeEntries(outf);
   }
 
-  fclose(outf);
-  return HEADER_SIZE +
+  // write the filter, if any
+  u64 filterSize = 0;
+  if (filter) {
+    if (verbose) {
+      printf("Writing %s byte filter...\n", commafy(buf, filter->byteSize()));
+      fflush(stdout);
+    }
+    filterSize = filter->writeToFile(outf);
+  }
+
+  // write the strong hashes, if any
+  u64 strongHashSize = 0;
+  if (strongHashing) {
+    if (verbose) {
+      printf("Writing %s strong hash values...\n",
+	     commafy(buf, (unsigned)strongHashes.size()));
+      fflush(stdout);
+    }
+    strongHashSize = strongHashes.writeEntries(outf);
+  }
+
+  u64 totalSize = HEADER_SIZE +
     (u64)allocatedSize * sizeof(Entry) +
     (u64)size() * sizeof(hash_t) +
-    dupBlockSize;
+    dupBlockSize + filterSize + strongHashSize;
+
+  // record where the next delta segment goes
+  fseek(outf, 40, SEEK_SET);
+  fwrite(&totalSize, sizeof(u64), 1, outf);
+
+  if (fclose(outf)) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", filename, strerror(errno));
+    return 0;
+  }
+
+  persistedFile = filename;
+  persistedBlockCount = size();
+  return totalSize;
+}
+
+
+u64 DedupTable::writeWholeFile(const char *filename, bool verbose) {
+  u64 bytesWritten = writeToFile(filename, verbose);
+  return bytesWritten ? bytesWritten : DEDUP_TABLE_WRITE_ERROR;
+}
+
+
+u64 DedupTable::appendToFile(const char *filename, bool verbose) {
+  if (persistedFile != filename || !fileExists(filename))
+    return writeWholeFile(filename, verbose);
+
+  unsigned newBlocks = size() - persistedBlockCount;
+  if (newBlocks == 0) return 0;
+
+  FILE *f = fopen(filename, "r+b");
+  if (!f) {
+    fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
+	    filename, strerror(errno));
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+
+  char header[HEADER_SIZE];
+  if (fread(header, 1, HEADER_SIZE, f) != HEADER_SIZE
+      || strncmp(header, "ddup", 4)
+      || *(unsigned*)(header+4) > 1
+      || *(unsigned*)(header+8) != blockSize) {
+    fclose(f);
+    fprintf(stderr, "\"%s\" doesn't match this table; rewriting it.\n",
+	    filename);
+    return writeWholeFile(filename, verbose);
+  }
+
+  unsigned baseBlocks = *(unsigned*)(header+20);
+  unsigned segmentCount = *(unsigned*)(header+28);
+  unsigned segmentBlocks = *(unsigned*)(header+32);
+  u64 dataEnd = *(u64*)(header+40);
+
+  // too much in the log; fold it into a new base table
+  if (segmentCount + 1 > DEDUP_TABLE_MAX_SEGMENTS
+      || (u64)(segmentBlocks + newBlocks) * DEDUP_TABLE_COMPACT_FRACTION
+         > baseBlocks) {
+    fclose(f);
+    return compactFile(filename, verbose);
+  }
+
+  // Write the segment at the recorded end of data, overwriting anything
+  // a failed append may have left there, and only then update the
+  // header.  The segment is synced before the header is written, so
+  // even after a power loss the header never describes a segment that
+  // isn't on disk; a crash in between leaves the file as it was.
+  if (dataEnd == 0) {
+    fseek(f, 0, SEEK_END);
+    dataEnd = ftell(f);
+  }
+  if (seekFile(f, dataEnd)) {
+    fclose(f);
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+
+  if (verbose) {
+    char buf[27];
+    printf("Appending %s hash values...\n", commafy(buf, newBlocks));
+    fflush(stdout);
+  }
+
+  u64 bytesWritten = 0;
+  bytesWritten += fwrite(SEGMENT_MAGIC, 1, 4, f);
+  bytesWritten += fwrite(&newBlocks, 1, sizeof(unsigned), f);
+  bytesWritten += sizeof(hash_t) *
+    fwrite(&blockHashes[persistedBlockCount], sizeof(hash_t), newBlocks, f);
+  if (strongHashing)
+    bytesWritten += sizeof(u128) *
+      fwrite(&strongHashes[persistedBlockCount], sizeof(u128), newBlocks, f);
+  if (!syncFile(f)) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", filename, strerror(errno));
+    fclose(f);
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+
+  *(unsigned*)(header+4) = 1;  // version 1: has delta segments
+  *(unsigned*)(header+28) = segmentCount + 1;
+  *(unsigned*)(header+32) = segmentBlocks + newBlocks;
+  *(u64*)(header+40) = dataEnd + bytesWritten;
+  fseek(f, 0, SEEK_SET);
+  bool ok = fwrite(header, 1, HEADER_SIZE, f) == HEADER_SIZE && syncFile(f);
+  if (fclose(f)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", filename, strerror(errno));
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+
+  persistedBlockCount = size();
+  return bytesWritten;
+}
+
+
+u64 DedupTable::compactFile(const char *filename, bool verbose) {
+  std::string tempName = std::string(filename) + ".tmp";
+  u64 bytesWritten = writeWholeFile(tempName.c_str(), verbose);
+  if (bytesWritten == DEDUP_TABLE_WRITE_ERROR) return bytesWritten;
+
+  // on disk before it replaces the old file, or a power loss could
+  // leave the new name pointing at a file that was never written
+  if (!syncFile(tempName.c_str())) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", tempName.c_str(),
+	    strerror(errno));
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+  if (rename(tempName.c_str(), filename)) {
+    fprintf(stderr, "Failed to rename \"%s\" to \"%s\": %s\n",
+	    tempName.c_str(), filename, strerror(errno));
+    return DEDUP_TABLE_WRITE_ERROR;
+  }
+  persistedFile = filename;
+  return bytesWritten;
+}
+
+
+bool DedupTable::readSegments(FILE *inf, unsigned segmentCount) {
+  std::vector<hash_t> hashes;
+  std::vector<u128> strongs;
+
+  for (unsigned segNo=0; segNo < segmentCount; segNo++) {
+    char magic[4];
+    unsigned count;
+    if (fread(magic, 1, 4, inf) != 4 || memcmp(magic, SEGMENT_MAGIC, 4))
+      return false;
+    if (fread(&count, 1, sizeof(unsigned), inf) != sizeof(unsigned))
+      return false;
+
+    hashes.resize(count);
+    if (count && fread(&hashes[0], sizeof(hash_t), count, inf) != count)
+      return false;
+    if (strongHashing) {
+      strongs.resize(count);
+      if (count && fread(&strongs[0], sizeof(u128), count, inf) != count)
+	return false;
+    }
+
+    for (unsigned i=0; i < count; i++)
+      addHashedBlock(hashes[i], strongHashing ? &strongs[i] : NULL);
+  }
+  return true;
 }
 
 
@@ -353,7 +733,8 @@ DedupTable *DedupTable::createEmpty(unsigned blockSize) {
 
 // read a regular file and create a DedupTable index of it
 DedupTable *DedupTable::createFromFile(const char *filename,
-				       unsigned blockSize) {
+				       unsigned blockSize,
+				       bool withStrongHashes) {
   FILE *inf = fopen(filename, "rb");
   if (!inf) {
     fprintf(stderr, "Failed to open \"%s\" for reading: %s\n",
@@ -361,14 +742,15 @@ DedupTable *DedupTable::createFromFile(const char *filename,
     return NULL;
   }
 
-  DedupTable *table = createFromFile(inf, blockSize);
+  DedupTable *table = createFromFile(inf, blockSize, withStrongHashes);
   fclose(inf);
   return table;
 }
 
 
 DedupTable *DedupTable::createFromFile(FILE *inf,
-				       unsigned blockSize) {
+				       unsigned blockSize,
+				       bool withStrongHashes) {
   u64 fileSize = getFileSize(inf);
   if ((fileSize >> 32) > blockSize) {
     fprintf(stderr, "File too large (%llu bytes) for given block size (%u)\n",
@@ -385,6 +767,7 @@ DedupTable *DedupTable::createFromFile(FILE *inf,
     table = new DedupTable(blockSize, true, 128);
   }
   if (!table) return NULL;
+  if (withStrongHashes) table->enableStrongHashes();
 
   size_t bufSize;
   int bufReps;
@@ -447,7 +830,7 @@ DedupTable *DedupTable::readFromFile(const char *filename, bool verbose) {
   if (strncmp(header, "ddup", 4)) goto fail;
 
   unsigned versionNo, blockSize, allocatedSize, entryCount, 
-    hashAlg1No, hashAlg2No, blockCount;
+    hashAlg1No, hashAlg2No, blockCount, filterBits, segmentCount;
   
   versionNo =     *(unsigned*)(header+4);
   blockSize =     *(unsigned*)(header+8);
@@ -456,6 +839,8 @@ DedupTable *DedupTable::readFromFile(const char *filename, bool verbose) {
   blockCount =    *(unsigned*)(header+20);
   hashAlg1No =    *(unsigned char*)(header+24);
   hashAlg2No =    *(unsigned char*)(header+25);
+  filterBits =    *(unsigned char*)(header+26);
+  segmentCount =  *(unsigned*)(header+28);
 
   if (hashAlg1No != HASH_ALGORITHM) {
     fprintf(stderr, "Error: \"%s\" built with %s algorithm, \n"
@@ -474,11 +859,14 @@ DedupTable *DedupTable::readFromFile(const char *filename, bool verbose) {
   // sanity check
   if (entryCount > allocatedSize) goto fail;
 
-  // multiple versions not supported yet
-  if (versionNo != 0 || hashAlg2No != 0) goto fail;
+  // version 1 adds delta segments after the base table
+  if (versionNo > 1) goto fail;
+  if (hashAlg2No != 0 && hashAlg2No != HASH_ALG_CITY128) goto fail;
 
   table = new DedupTable(blockSize, true, allocatedSize);
   table->entryCount = entryCount;
+  table->sourceSize = *(u64*)(header+48);
+  table->sourceModTime = *(u64*)(header+56);
   readLen = fread(table->entries, sizeof(Entry), allocatedSize, inf);
   if (readLen != allocatedSize) goto fail;
 
@@ -509,6 +897,32 @@ DedupTable *DedupTable::readFromFile(const char *filename, bool verbose) {
     table->duplicateBlocks.push_back(dup);
   }
 
+  // read the filter, if any
+  if (filterBits) {
+    table->filter = BlockedBloomFilter::readFromFile(inf);
+    if (!table->filter) goto fail;
+    table->filterBitsPerEntry = filterBits;
+  }
+
+  // read the strong hashes, if any
+  if (hashAlg2No == HASH_ALG_CITY128) {
+    table->strongHashing = true;
+    if (table->strongHashes.readEntries(inf, blockCount) != blockCount)
+      goto fail;
+  }
+
+  // replay the delta segments
+  if (versionNo == 1) {
+    if (verbose) {
+      printf("Reading %u delta segments\n", segmentCount);
+      fflush(stdout);
+    }
+    if (!table->readSegments(inf, segmentCount)) goto fail;
+  }
+
+  table->persistedFile = filename;
+  table->persistedBlockCount = table->size();
+
   fclose(inf);
   return table;
 
@@ -522,11 +936,15 @@ DedupTable *DedupTable::readFromFile(const char *filename, bool verbose) {
 
 void DedupTable::printStats() {
   char buf1[27], buf2[27];
+  finishGrow();
   printf("Table: %s %u-byte blocks\n", commafy(buf1, size()), blockSize);
   printf("  %s of %s entries filled (%.2f %%)\n",
 	 commafy(buf2, entryCount), commafy(buf1, allocatedSize),
 	 100.0f*entryCount/allocatedSize);
   printf("  %s duplicate blocks\n", commafy(buf1, (u64)duplicateBlocks.size()));
+  if (filter)
+    printf("  %s byte filter, %u bits per entry\n",
+	   commafy(buf1, filter->byteSize()), filterBitsPerEntry);
 
   hash_t mostCommonHashValue = 0;
   unsigned mostCommonCount = 0;
@@ -2,16 +2,60 @@
 #define __DEDUP_TABLE__
 
 #include <vector>
+#include <string>
 #include <climits>
+#include <cassert>
 #include "u64.h"
 #include "HashAlgs.h"
 #include "serializable_vector.h"
+#include "bloom-filter.h"
 
 
 // must be a power of 2
 #define DEDUP_TABLE_INITIAL_SIZE 4
 #define DEDUP_TABLE_MAX_LOAD_FACTOR .5f
 
+// Number of lookups the batched find/has methods run ahead of the one
+// being resolved.  Large enough to cover DRAM latency with a handful of
+// misses in flight, small enough that prefetched lines aren't evicted
+// before they're used.
+#define DEDUP_TABLE_PREFETCH_DISTANCE 16
+
+// In incremental grow mode, the number of buckets of the old array that
+// are moved to the new one on each insert.  Must be large enough that
+// the move finishes before the new array fills up, which for a load
+// factor of .5 means at least 2.
+#define DEDUP_TABLE_MIGRATE_BUCKETS 8
+
+// size of the header of a serialized table
+#define DEDUP_TABLE_HEADER_SIZE 64
+
+// magic number at the start of each delta segment in a serialized table
+#define DEDUP_TABLE_SEGMENT_MAGIC "dseg"
+
+// appendToFile() rewrites the whole file instead of adding a segment
+// once there would be more than this many segments, or the segments
+// would hold more than 1/DEDUP_TABLE_COMPACT_FRACTION as many blocks
+// as the base table.
+#define DEDUP_TABLE_MAX_SEGMENTS 32
+#define DEDUP_TABLE_COMPACT_FRACTION 4
+
+// returned by appendToFile() and compactFile() on error, since 0 means
+// there was nothing to write
+#define DEDUP_TABLE_WRITE_ERROR ((u64)-1)
+
+// Stored in blockNos[] by the batched lookups for hash values not found.
+#define DEDUP_TABLE_NO_MATCH UINT_MAX
+
+#if defined(__GNUC__)
+#define DEDUP_PREFETCH(addr) __builtin_prefetch(addr)
+#elif defined(_WIN32)
+#include <xmmintrin.h>
+#define DEDUP_PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define DEDUP_PREFETCH(addr)
+#endif
+
 // #define PROFILE_PROBING
 
 
@@ -63,9 +107,19 @@ class DedupTable {
 
   std::vector<DuplicateBlocks*> duplicateBlocks;
 
+  // strongHashes[blockNo] is the secondary hash of block <blockNo>, used
+  // to confirm a match on the primary hash.  Empty unless the table was
+  // created with strong hashes.
+  serializable_vector<u128> strongHashes;
+  bool strongHashing;
+
   // number of bytes per block
   unsigned blockSize;
 
+  // size and modification time (see getFileModTime()) of the file the
+  // table was built from, or 0 if unknown; see setSource()
+  u64 sourceSize, sourceModTime;
+
   // size of 'entries' array
   unsigned allocatedSize;
 
@@ -79,8 +133,64 @@ class DedupTable {
   // allocatedSize.  This is just a cache of (int)(maxLoadFactor * allocatedSize).
   unsigned maxCount;
 
+  // Optional filter of every hash value in the table, consulted before
+  // probing so most misses never touch 'entries'.  NULL if disabled.
+  BlockedBloomFilter *filter;
+
+  // bits per entry the filter was sized with, 0 if there is no filter
+  unsigned filterBitsPerEntry;
+
+  // (re)build the filter sized for maxCount entries from 'entries'
+  void rebuildFilter();
+
+  // If true, grow() allocates the new array but leaves the entries in
+  // the old one, and each insert moves DEDUP_TABLE_MIGRATE_BUCKETS of
+  // them over.  This spreads the cost of a rehash across many inserts
+  // instead of stalling on one.
+  bool incrementalGrow;
+
+  // While an incremental grow is in progress, the previous array and
+  // its size, otherwise NULL and 0.  oldEntries[0..migratePos) have been
+  // copied into 'entries'; the rest are still only in oldEntries.
+  // Entries are never removed from oldEntries, so its probe chains stay
+  // intact for lookups.
+  Entry *oldEntries;
+  unsigned oldAllocatedSize;
+  unsigned migratePos;
+
+  // While an incremental grow is in progress and there is a filter,
+  // the filter being built for the new array.  'filter' still covers
+  // every entry and is used for lookups until the move completes.
+  BlockedBloomFilter *nextFilter;
+
+  // move up to bucketCount buckets from oldEntries to entries
+  void migrateBuckets(unsigned bucketCount);
+
+  // The file this table was last read from or written to, and how many
+  // of its blocks are in that file.  appendToFile() only needs to write
+  // the blocks after these.
+  std::string persistedFile;
+  unsigned persistedBlockCount;
+
+  // read the delta segments that follow the base table in a version 1
+  // file, adding their blocks
+  bool readSegments(FILE *inf, unsigned segmentCount);
+
+  // writeToFile(), returning DEDUP_TABLE_WRITE_ERROR instead of 0 on
+  // error
+  u64 writeWholeFile(const char *filename, bool verbose);
+
+  // store an entry in the first empty slot of 'entries' for its hash
+  void placeEntry(const Entry &entry);
+
+  // add blockNo to an entry already holding hashValue
+  void addDuplicate(Entry *entry, hash_t hashValue, unsigned blockNo);
+
   // allocate memory for 'size' entries, complaining if the malloc fails
-  void allocateEntries(int size);
+  void allocateEntries(unsigned size);
+
+  // release an array from allocateEntries()
+  static void freeEntries(Entry *array, unsigned size);
 
   // Increase the capacity and move all the existing entries to the new table.
   void grow(unsigned minimumNewSize);
@@ -89,6 +199,9 @@ class DedupTable {
   // This method doesn't check if the table has exceeded maxLoadFactor.
   void addHashedEntry(hash_t hashValue, unsigned blockNo);
 
+  // index blockNo under hashValue, without touching blockHashes
+  void insertEntry(hash_t hashValue, unsigned blockNo);
+
   // move an entry over during a rehash
   void moveEntry(Entry *entry);
 
@@ -113,6 +226,9 @@ class DedupTable {
 #ifdef PROFILE_PROBING
     probeCalls++;
 #endif
+    // definite miss, skip the probe
+    if (filter && !filter->mayContain(hashValue)) return NULL;
+
     int sizeMask = allocatedSize-1;
     int entryNo = hashValue & sizeMask;
 
@@ -125,29 +241,107 @@ class DedupTable {
       entryNo = (entryNo+1) & sizeMask;
     }
 
+    // not moved to the new array yet?
+    if (oldEntries) return probeOldTable(hashValue);
+
     return NULL;
   }
 
+  // probeTable() for oldEntries during an incremental grow
+  Entry *probeOldTable(hash_t hashValue) const {
+    int sizeMask = oldAllocatedSize-1;
+    int entryNo = hashValue & sizeMask;
+
+    while (oldEntries[entryNo].hashValue != 0) {
+      if (oldEntries[entryNo].hashValue == hashValue)
+	return &oldEntries[entryNo];
+      entryNo = (entryNo+1) & sizeMask;
+    }
+
+    return NULL;
+  }
+
+  // Issue a prefetch for the slot where a probe for hashValue starts,
+  // or for its filter block if there is a filter.  The slot itself is
+  // only needed if the filter passes, which for new data is rare.
+  void prefetchSlot(hash_t hashValue) const {
+    if (filter)
+      DEDUP_PREFETCH(filter->blockAddress(hashValue));
+    else
+      DEDUP_PREFETCH(&entries[hashValue & (allocatedSize-1)]);
+  }
+
 
 public:
   static DedupTable *createEmpty(unsigned blockSize);
 
   // read a regular file and create a DedupTable index of it
-  static DedupTable *createFromFile(const char *filename, unsigned blockSize);
-  static DedupTable *createFromFile(FILE *inf, unsigned blockSize);
+  // If withStrongHashes is true, a secondary hash of each block is kept
+  // as well (see strongHash()).
+  static DedupTable *createFromFile(const char *filename, unsigned blockSize,
+				    bool withStrongHashes = false);
+  static DedupTable *createFromFile(FILE *inf, unsigned blockSize,
+				    bool withStrongHashes = false);
 
   // read a serialized DedupTable from a file
   static DedupTable *readFromFile(const char *filename, bool verbose=false);
 
+  // Combine serialized tables, including their delta segments, into one
+  // table that indexes their data as if it had been concatenated in the
+  // order given: block b of filenames[i] becomes block b plus the total
+  // block count of filenames[0..i).  The inputs are streamed, never
+  // loaded whole, and the index is built by threadCount threads (0 for
+  // one per core), each filling its own range of slots.  Strong hashes
+  // are kept if every input has them, and the result has a filter if
+  // any input did.  Returns NULL on error.
+  // (implemented in dedup-table-merge.cc)
+  static DedupTable *mergeFiles(const std::vector<std::string> &filenames,
+				unsigned threadCount = 0, bool verbose=false);
+
   void addBlock(const char *data);
 
+  // Add a block whose hash is already known.  strong must point to its
+  // strong hash if hasStrongHashes(), and is ignored otherwise.
+  void addHashedBlock(hash_t hashValue, const u128 *strong = NULL);
+
   // serialize a DedupTable to a file, return the number of bytes written
   u64 writeToFile(const char *filename, bool verbose=false);
 
+  // Write only the blocks added since the table was read from or last
+  // written to 'filename', as a delta segment appended to the file.
+  // Readers replay the segments after loading the base table.  Falls
+  // back to writeToFile() if this table didn't come from that file,
+  // and to compactFile() when the segments grow too many or too large
+  // (see DEDUP_TABLE_MAX_SEGMENTS).  Returns the number of bytes written,
+  // 0 if there was nothing new, or DEDUP_TABLE_WRITE_ERROR.
+  u64 appendToFile(const char *filename, bool verbose=false);
+
+  // Rewrite 'filename' as a single base table with no segments.  The
+  // new file is written next to it, synced, and renamed into place.
+  // Returns the number of bytes written or DEDUP_TABLE_WRITE_ERROR.
+  u64 compactFile(const char *filename, bool verbose=false);
+
   ~DedupTable();
 
   void printStats();
 
+  // Put a Bloom filter in front of the table so lookups of hash values
+  // that aren't in the table can usually skip the probe.  The filter
+  // is sized for the table's capacity and rebuilt when the table grows,
+  // and is saved and restored by writeToFile() and readFromFile().
+  void enableFilter(unsigned bitsPerEntry = BLOOM_FILTER_BITS_PER_ENTRY);
+  void disableFilter();
+  bool hasFilter() const {return filter != NULL;}
+
+  // Enable or disable incremental grow mode (see incrementalGrow).
+  // Lookups stay correct while a grow is in progress; they check the
+  // new array and then the old one.
+  void setIncrementalGrow(bool enable) {incrementalGrow = enable;}
+
+  // Complete any incremental grow that is in progress.
+  void finishGrow();
+  bool isGrowing() const {return oldEntries != NULL;}
+
   // Returns the hashed value for a given block.
   hash_t getBlockHash(unsigned blockNo) {
     return blockHashes[blockNo];
@@ -170,6 +364,22 @@ public:
 
   // secondary hash algorithm
   // static unsigned hash2(const void *data, unsigned len);
+  static u128 strongHash(const void *data, unsigned len) {
+    return cityHash128(data, len);
+  }
+
+  // Keep a strong hash of every block added from now on.  Must be
+  // called before any blocks are added.
+  void enableStrongHashes() {
+    assert(size() == 0);
+    strongHashing = true;
+  }
+  bool hasStrongHashes() const {return strongHashing;}
+
+  // Returns the strong hash of a block; only valid if hasStrongHashes().
+  const u128 &getBlockStrongHash(unsigned blockNo) const {
+    return strongHashes[blockNo];
+  }
 
   bool hasMatch(hash_t hashValue) const {
     return probeTable(hashValue) != NULL;
@@ -189,24 +399,47 @@ public:
 			    std::vector<unsigned> &blockNos,
 			    unsigned maxMatchCount = INT_MAX);
 
+  // Batched versions of hasMatch() and findHashedFirstMatch().  The
+  // slot for hashValues[i+DEDUP_TABLE_PREFETCH_DISTANCE] is prefetched
+  // while hashValues[i] is being resolved, so the cache misses of
+  // independent lookups overlap rather than being taken one at a time.
+  // found[i] / blockNos[i] receive the result for hashValues[i]; misses
+  // get DEDUP_TABLE_NO_MATCH in blockNos.  Both return the number of
+  // hash values that were found.
+  unsigned hasMatches(const hash_t *hashValues, unsigned count,
+		      bool *found) const;
+  unsigned findHashedFirstMatches(const hash_t *hashValues, unsigned count,
+				  unsigned *blockNos);
+
   // Returns true iff the given block number if found somewhere
   // in the list of blocks with this hash value.
   bool findHashedMatch(hash_t hashValue, unsigned blockNo);
 
   u64 outputFileSize() {
     return 64 + (u64)allocatedSize * sizeof(Entry)
-      + (u64)entryCount * sizeof(unsigned);
+      + (u64)entryCount * sizeof(unsigned)
+      + (filter ? filter->byteSize() : 0);
   }
 
   unsigned size() {return blockHashes.size();}
   unsigned getBlockSize() {return blockSize;}
+
+  // Record the file the table indexes, so a reader of the saved table
+  // can tell whether it's out of date.  Saved by writeToFile().
+  void setSource(u64 size, u64 modTime) {
+    sourceSize = size;
+    sourceModTime = modTime;
+  }
+  u64 getSourceSize() const {return sourceSize;}
+  u64 getSourceModTime() const {return sourceModTime;}
   unsigned getUniqueCount() {return entryCount;}
 
   // Caution: these two methods break encapsulation and are only made 
   // available for optimization.  Their values should be considered 
   // invalidated the next time an entry is added to the table.
+  // In incremental grow mode, call finishGrow() first.
   unsigned getAllocatedSize() const {return allocatedSize;}
-  const Entry *getEntryArray() const {return entries;}
+  const Entry *getEntryArray() const {assert(!oldEntries); return entries;}
 };
 
 
@@ -3,6 +3,9 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include <fcntl.h>
 #include <sys/stat.h>
 
@@ -13,10 +16,13 @@
 
 
 #ifndef _WIN32
+#include <dirent.h>
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#else
+#include <io.h>
 #endif
 
 #include "dedup-util.h"
@@ -126,6 +132,188 @@ u64 getFileSize(const char *filename) {
 }
 
 
+u64 getFileModTime(const char *filename) {
+#ifdef _WIN32
+  struct __stat64 stats;
+  if (_stat64(filename, &stats)) return 0;
+  return (u64) stats.st_mtime * 1000000000ULL;
+#else
+  struct stat stats;
+  if (stat(filename, &stats)) return 0;
+#if defined(__APPLE__)
+  return stats.st_mtimespec.tv_sec * 1000000000ULL
+    + stats.st_mtimespec.tv_nsec;
+#else
+  return stats.st_mtim.tv_sec * 1000000000ULL + stats.st_mtim.tv_nsec;
+#endif
+#endif
+}
+
+
+bool listRegularFiles(const char *path, std::vector<std::string> &files) {
+#ifdef _WIN32
+  if (!fileExists(path)) return false;
+  files.push_back(path);
+  return true;
+#else
+  struct stat stats;
+  if (lstat(path, &stats)) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", path, strerror(errno));
+    return false;
+  }
+
+  if (S_ISREG(stats.st_mode)) {
+    files.push_back(path);
+    return true;
+  }
+  if (!S_ISDIR(stats.st_mode)) return true;
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", path, strerror(errno));
+    return false;
+  }
+
+  std::string prefix(path);
+  if (prefix.empty() || prefix[prefix.size()-1] != '/') prefix += '/';
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+    // an unreadable subdirectory doesn't stop the walk
+    listRegularFiles((prefix + ent->d_name).c_str(), files);
+  }
+  closedir(dir);
+  return true;
+#endif
+}
+
+
+int seekFile(FILE *f, u64 offset) {
+#ifdef _WIN32
+  return _fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+  return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+
+bool syncFile(FILE *f) {
+  if (fflush(f)) return false;
+#ifdef _WIN32
+  return _commit(_fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+
+bool syncFile(const char *filename) {
+  FILE *f = fopen(filename, "r+b");
+  if (!f) return false;
+  bool ok = syncFile(f);
+  if (fclose(f)) ok = false;
+  return ok;
+}
+
+
+int openFileForRead(const char *filename, u64 readahead) {
+#ifdef _WIN32
+  int fd = _open(filename, _O_RDONLY | _O_BINARY);
+#else
+  int fd = open(filename, O_RDONLY);
+#endif
+  if (fd == -1) {
+    fprintf(stderr, "Cannot open \"%s\": %s\n", filename, strerror(errno));
+    return -1;
+  }
+#ifdef POSIX_FADV_WILLNEED
+  if (readahead)
+    posix_fadvise(fd, 0, (off_t)readahead, POSIX_FADV_WILLNEED);
+#endif
+  return fd;
+}
+
+
+int readSmallFile(int fd, u64 maxLen, std::vector<char> &buf, u64 *len) {
+  *len = 0;
+  struct stat stats;
+  if (fstat(fd, &stats)) return -1;
+  if ((u64)stats.st_size > maxLen) {
+    *len = stats.st_size;
+    return 0;
+  }
+
+  size_t size = (size_t)stats.st_size;
+  if (buf.size() < size) buf.resize(size);
+
+  // one read unless the file is changing under us
+  size_t done = 0;
+  while (done < size) {
+#ifdef _WIN32
+    int n = _read(fd, &buf[done], (unsigned)(size - done));
+#else
+    ssize_t n = pread(fd, &buf[done], size - done, (off_t)done);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (n == 0) break;
+    done += n;
+  }
+  *len = done;
+  return 1;
+}
+
+
+unsigned defaultThreadCount() {
+  unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+
+void parallelFor(unsigned count, unsigned threadCount,
+		 const std::function<void(unsigned)> &fn) {
+  if (threadCount == 0) threadCount = defaultThreadCount();
+  if (threadCount > count) threadCount = count;
+
+  if (threadCount <= 1) {
+    for (unsigned i=0; i < count; i++) fn(i);
+    return;
+  }
+
+  std::atomic<unsigned> next(0);
+  std::vector<std::thread> threads;
+  for (unsigned t=0; t < threadCount; t++) {
+    threads.push_back(std::thread([&]() {
+	  unsigned i;
+	  while ((i = next++) < count) fn(i);
+	}));
+  }
+  for (unsigned t=0; t < threadCount; t++) threads[t].join();
+}
+
+
+std::string jsonString(const std::string &s) {
+  std::string out = "\"";
+  for (size_t i=0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char buf[8];
+      sprintf(buf, "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+
 static void reverseString(char *head, int len) {
   char *tail = head+len-1;
   while (head < tail) {
@@ -185,6 +373,8 @@ MemoryMappedFile::MemoryMappedFile() {
 #endif
   length = 0;
   address = NULL;
+  readPolicy = 0;
+  prefetchedTo = releasedTo = 0;
 }
 
 MemoryMappedFile::~MemoryMappedFile() {
@@ -212,20 +402,63 @@ const void *MemoryMappedFile::mapFile(const char *filename) {
     return NULL;
   }
 
-  address = (char*) mmap(NULL, length, PROT_READ, MAP_SHARED,
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if ((readPolicy & MAPPED_FILE_POPULATE) && length <= MAPPED_FILE_POPULATE_MAX)
+    flags |= MAP_POPULATE;
+#endif
+
+  address = (char*) mmap(NULL, length, PROT_READ, flags,
 			 fileDescriptor, 0);
   if (address == MAP_FAILED) {
     fprintf(stderr, "Failed to mmap %s: %s\n", filename, strerror(errno));
     address = NULL;
     return NULL;
   }
+
+  prefetchedTo = releasedTo = 0;
+  if (readPolicy & MAPPED_FILE_SEQUENTIAL) {
+    madvise(address, length, MADV_SEQUENTIAL);
+    consumed(0);
+  }
   return address;
 }
 
 
+void MemoryMappedFile::consumed(u64 offset) {
+  if (!address) return;
+  if (offset > length) offset = length;
+  static const u64 pageMask = (u64) sysconf(_SC_PAGESIZE) - 1;
+
+  if ((readPolicy & MAPPED_FILE_SEQUENTIAL) && prefetchedTo < length
+      && offset + MAPPED_FILE_READAHEAD
+         >= prefetchedTo + MAPPED_FILE_ADVICE_STEP) {
+    u64 start = (offset > prefetchedTo ? offset : prefetchedTo) & ~pageMask;
+    u64 end = offset + MAPPED_FILE_READAHEAD;
+    if (end > length) end = length;
+    madvise((char*) address + start, end - start, MADV_WILLNEED);
+    prefetchedTo = end;
+  }
+
+  if (readPolicy & MAPPED_FILE_DROP_BEHIND) {
+    u64 end = offset == length ? length : offset & ~pageMask;
+    if (end >= releasedTo + MAPPED_FILE_ADVICE_STEP
+	|| (end == length && end > releasedTo)) {
+      madvise((char*) address + releasedTo, end - releasedTo, MADV_DONTNEED);
+      posix_fadvise(fileDescriptor, releasedTo, end - releasedTo,
+		    POSIX_FADV_DONTNEED);
+      releasedTo = end;
+    }
+  }
+}
+
+
 void MemoryMappedFile::close() {
   if (address) {
     munmap(address, length);
+    // including anything the kernel read ahead on its own
+    if (readPolicy & MAPPED_FILE_DROP_BEHIND)
+      posix_fadvise(fileDescriptor, 0, 0, POSIX_FADV_DONTNEED);
     ::close(fileDescriptor);
   }
   fileDescriptor = 0;
@@ -279,6 +512,10 @@ const void *MemoryMappedFile::mapFile(const char *filename) {
 }
 
 
+void MemoryMappedFile::consumed(u64 offset) {
+}
+
+
 void MemoryMappedFile::close() {
   if (address) {
     UnmapViewOfFile(address);
@@ -290,3 +527,95 @@ void MemoryMappedFile::close() {
 }
 
 #endif  // _WIN32
+
+
+// true if the blockSize bytes at p are all zero; ORing whole words
+// keeps this to a few vector instructions per block
+static bool isZeroBlock(const unsigned char *p, unsigned blockSize) {
+  const u64 *words = (const u64 *) p;
+  u64 bits = 0;
+  for (unsigned i=0; i < blockSize / 8; i++)
+    bits |= words[i];
+  return bits == 0;
+}
+
+
+// Add [start, end) to ranges, joining it to the last range if they
+// touch.  A range that can no longer grow is dropped if it's too short.
+static void addZeroRange(std::vector<std::pair<u64, u64> > &ranges,
+			 u64 start, u64 end, u64 minLen) {
+  if (!ranges.empty()) {
+    std::pair<u64, u64> &last = ranges.back();
+    if (last.second == start) {
+      last.second = end;
+      return;
+    }
+    if (last.second - last.first < minLen) ranges.pop_back();
+  }
+  ranges.push_back(std::make_pair(start, end));
+}
+
+
+// add the zero runs in data[start, end) to ranges
+static void scanZeroRuns(const unsigned char *data, u64 start, u64 end,
+			 unsigned blockSize, u64 minLen,
+			 std::vector<std::pair<u64, u64> > &ranges) {
+  // the mapping is page aligned, so aligned offsets are aligned words
+  u64 block = (start + blockSize - 1) / blockSize * blockSize;
+  while (block + blockSize <= end) {
+    if (!isZeroBlock(data + block, blockSize)) {
+      block += blockSize;
+      continue;
+    }
+
+    u64 runStart = block, runEnd = block + blockSize;
+    while (runEnd + blockSize <= end && isZeroBlock(data + runEnd, blockSize))
+      runEnd += blockSize;
+    while (runStart > start && !data[runStart-1]) runStart--;
+    while (runEnd < end && !data[runEnd]) runEnd++;
+    addZeroRange(ranges, runStart, runEnd, minLen);
+
+    block = (runEnd + blockSize - 1) / blockSize * blockSize;
+  }
+}
+
+
+void MemoryMappedFile::findZeroRanges(u64 minLen, unsigned blockSize,
+				      std::vector<std::pair<u64, u64> > &ranges) {
+  ranges.clear();
+  if (!address) return;
+  const unsigned char *data = (const unsigned char *) address;
+
+#if !defined(_WIN32) && defined(SEEK_HOLE)
+  u64 pos = 0;
+  while (pos < length) {
+    off_t dataStart = lseek(fileDescriptor, pos, SEEK_DATA);
+    if (dataStart < 0) {
+      // ENXIO means the rest is a hole; anything else means the file
+      // system can't tell us, so read it all
+      if (errno == ENXIO)
+	addZeroRange(ranges, pos, length, minLen);
+      else
+	scanZeroRuns(data, pos, length, blockSize, minLen, ranges);
+      break;
+    }
+    u64 dataEnd = length;
+    if ((u64)dataStart >= length) dataStart = length;
+    else {
+      off_t holeStart = lseek(fileDescriptor, dataStart, SEEK_HOLE);
+      if (holeStart > dataStart && (u64)holeStart < length)
+	dataEnd = holeStart;
+    }
+
+    if ((u64)dataStart > pos)
+      addZeroRange(ranges, pos, dataStart, minLen);
+    scanZeroRuns(data, dataStart, dataEnd, blockSize, minLen, ranges);
+    pos = dataEnd;
+  }
+#else
+  scanZeroRuns(data, 0, length, blockSize, minLen, ranges);
+#endif
+
+  if (!ranges.empty() && ranges.back().second - ranges.back().first < minLen)
+    ranges.pop_back();
+}
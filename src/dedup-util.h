@@ -10,6 +10,10 @@
 #include "u64.h"
 #include <cmath>
 #include <iostream>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
 
 double timeInSeconds();
 
@@ -18,16 +22,85 @@ bool fileExists(const char *name);
 u64 getFileSize(FILE *handle);
 u64 getFileSize(const char *name);
 
+// last modification time in nanoseconds since the epoch, or 0 on error
+u64 getFileModTime(const char *name);
+
+// If path is a regular file, add it to files.  If it's a directory, add
+// every regular file under it, not following symbolic links.  Returns
+// false if path can't be read.
+bool listRegularFiles(const char *path, std::vector<std::string> &files);
+
+// fseek() to an absolute offset that may not fit in a long
+int seekFile(FILE *f, u64 offset);
+
+// Write out f's buffer and have the OS put everything written so far
+// on disk, so it survives a power loss and not just a crash.  Returns
+// false on error.
+bool syncFile(FILE *f);
+
+// syncFile() for a file that has been closed.
+bool syncFile(const char *filename);
+
+// Open a file read-only.  Returns a descriptor, or -1 after printing an
+// error.  If readahead isn't 0, the kernel is asked to start reading
+// that many bytes from the start of the file in the background.
+int openFileForRead(const char *filename, u64 readahead = 0);
+
+// If the open file fd is no bigger than maxLen, read all of it into the
+// start of buf (grown to fit, never shrunk) and return 1.  Returns 0
+// if it's bigger, -1 on error.  *len is set to the file's size, or 0
+// on error.
+int readSmallFile(int fd, u64 maxLen, std::vector<char> &buf, u64 *len);
+
+// number of threads to use when the caller doesn't say
+unsigned defaultThreadCount();
+
+// Call fn(i) for every i in [0, count) using up to threadCount threads
+// (0 means defaultThreadCount()).  Items are handed out one at a time,
+// so they may complete in any order.
+void parallelFor(unsigned count, unsigned threadCount,
+		 const std::function<void(unsigned)> &fn);
+
+// s as a quoted JSON string
+std::string jsonString(const std::string &s);
+
 const char *commafy(char buf[14], unsigned x);
 #if !defined(__CYGWIN__) && !defined(_WIN32)
 const char *commafy(char buf[27], size_t x);
 #endif
 const char *commafy(char buf[27], u64 x);
 
+// MemoryMappedFile read policies, see setReadPolicy()
+
+// MADV_SEQUENTIAL, plus MADV_WILLNEED on the MAPPED_FILE_READAHEAD bytes
+// past the point given to consumed()
+#define MAPPED_FILE_SEQUENTIAL 0x1
+
+// release pages before the point given to consumed() from the mapping
+// (MADV_DONTNEED) and from the page cache (POSIX_FADV_DONTNEED), so
+// reading a big file doesn't evict other processes' data
+#define MAPPED_FILE_DROP_BEHIND 0x2
+
+// prefault files up to MAPPED_FILE_POPULATE_MAX bytes with MAP_POPULATE
+#define MAPPED_FILE_POPULATE 0x4
+
+// bytes requested ahead of the reader with MAPPED_FILE_SEQUENTIAL
+#define MAPPED_FILE_READAHEAD (32*1024*1024)
+
+// pages are prefetched and released in steps of at least this much
+#define MAPPED_FILE_ADVICE_STEP (8*1024*1024)
+
+#define MAPPED_FILE_POPULATE_MAX (64*1024*1024)
+
 class MemoryMappedFile {
   u64 length;
   void *address;
 
+  // MAPPED_FILE_... flags, and how far pages have been prefetched and
+  // released
+  unsigned readPolicy;
+  u64 prefetchedTo, releasedTo;
+
 #ifndef _WIN32
   int fileDescriptor;
 #else
@@ -56,6 +129,22 @@ class MemoryMappedFile {
   // get length of the mapping
   u64 getLength() {return length;}
 
+  // Set the MAPPED_FILE_... flags for the next mapFile().
+  void setReadPolicy(unsigned policy) {readPolicy = policy;}
+
+  // Tell the mapping the reader is done with everything before offset,
+  // and will read on from there.  Only does something under a read
+  // policy.
+  void consumed(u64 offset);
+
+  // Find the ranges of zero bytes at least minLen long, as [start, end)
+  // offsets in order.  Holes in sparse files are found with SEEK_HOLE
+  // and never read; the rest is scanned blockSize bytes at a time (a
+  // multiple of 8), and runs are then extended to the exact first and
+  // last zero byte.
+  void findZeroRanges(u64 minLen, unsigned blockSize,
+		      std::vector<std::pair<u64, u64> > &ranges);
+
 };
 
 #endif // __DEDUP_UTIL_H__
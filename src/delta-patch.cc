@@ -0,0 +1,282 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include "delta-patch.h"
+#include "dedup-util.h"
+
+using namespace std;
+
+
+void diffManifestsToInstructions(const Manifest &oldManifest,
+				 const Manifest &newManifest,
+				 vector<DeltaInstruction> &out) {
+  typedef unordered_map<u128, const ChunkRecord*, ChunkHashHasher> OldMap;
+  OldMap oldChunks;
+  oldChunks.reserve(oldManifest.chunks.size());
+  for (size_t i=0; i < oldManifest.chunks.size(); i++) {
+    const ChunkRecord &c = oldManifest.chunks[i];
+    // keep the first copy of a repeated chunk
+    oldChunks.insert(OldMap::value_type(c.hash, &c));
+  }
+
+  out.clear();
+  for (size_t i=0; i < newManifest.chunks.size(); i++) {
+    const ChunkRecord &c = newManifest.chunks[i];
+    OldMap::const_iterator it = oldChunks.find(c.hash);
+    if (it != oldChunks.end() && it->second->len == c.len) {
+      appendDeltaInstruction(out, DeltaInstruction
+			     (DeltaInstruction::COPY, c.start, c.len,
+			      it->second->start));
+    } else {
+      appendDeltaInstruction(out, DeltaInstruction
+			     (DeltaInstruction::LITERAL, c.start, c.len));
+    }
+  }
+}
+
+
+// write x as a LEB128 varint, return the number of bytes written
+static unsigned writeVarint(FILE *outf, u64 x) {
+  unsigned char buf[10];
+  unsigned len = 0;
+  do {
+    buf[len] = x & 0x7f;
+    x >>= 7;
+    if (x) buf[len] |= 0x80;
+    len++;
+  } while (x);
+  return (unsigned) fwrite(buf, 1, len, outf);
+}
+
+
+static bool readVarint(FILE *inf, u64 *x) {
+  *x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = getc(inf);
+    if (c == EOF) return false;
+    *x |= (u64)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+
+u64 writePatch(FILE *outf, const vector<DeltaInstruction> &insts,
+	       const unsigned char *newData, u64 newLength, u64 oldLength) {
+  char header[PATCH_HEADER_SIZE] = {0};
+  memcpy(header, PATCH_MAGIC, 4);
+  *(unsigned*)(header+4) = PATCH_VERSION;
+  *(u64*)(header+8) = oldLength;
+  *(u64*)(header+16) = newLength;
+
+  u64 bytesWritten = fwrite(header, 1, PATCH_HEADER_SIZE, outf);
+
+  u64 nextStart = 0;
+  for (size_t i=0; i < insts.size(); i++) {
+    const DeltaInstruction &inst = insts[i];
+
+    // instructions must cover the new file in order
+    if (inst.start != nextStart || inst.start + inst.len > newLength) {
+      fprintf(stderr, "Delta instructions don't match the new file.\n");
+      return 0;
+    }
+    nextStart += inst.len;
+
+    if (inst.type == DeltaInstruction::COPY) {
+      bytesWritten += putc(PATCH_OP_COPY, outf) != EOF;
+      bytesWritten += writeVarint(outf, inst.src);
+      bytesWritten += writeVarint(outf, inst.len);
+    } else {
+      bytesWritten += putc(PATCH_OP_INSERT, outf) != EOF;
+      bytesWritten += writeVarint(outf, inst.len);
+      bytesWritten += fwrite(newData + inst.start, 1, inst.len, outf);
+    }
+  }
+
+  if (nextStart != newLength) {
+    fprintf(stderr, "Delta instructions don't cover the new file.\n");
+    return 0;
+  }
+
+  bytesWritten += putc(PATCH_OP_END, outf) != EOF;
+  return bytesWritten;
+}
+
+
+bool applyPatch(const unsigned char *base, u64 baseLength,
+		FILE *patch, FILE *out) {
+  char header[PATCH_HEADER_SIZE];
+  if (fread(header, 1, PATCH_HEADER_SIZE, patch) != PATCH_HEADER_SIZE
+      || memcmp(header, PATCH_MAGIC, 4)
+      || *(unsigned*)(header+4) != PATCH_VERSION) {
+    fprintf(stderr, "Not a patch file.\n");
+    return false;
+  }
+
+  if (*(u64*)(header+8) != baseLength) {
+    fprintf(stderr, "Patch expects a %llu byte base file, got %llu.\n",
+	    *(u64*)(header+8), baseLength);
+    return false;
+  }
+  u64 targetLength = *(u64*)(header+16);
+
+  char *buf = new char[PATCH_APPLY_BUF_SIZE];
+  u64 written = 0;
+  bool ok = false;
+
+  while (true) {
+    int op = getc(patch);
+    u64 src, len;
+
+    if (op == PATCH_OP_END) {
+      ok = written == targetLength;
+      break;
+    } else if (op == PATCH_OP_COPY) {
+      if (!readVarint(patch, &src) || !readVarint(patch, &len)) break;
+      if (src > baseLength || len > baseLength - src) break;
+      if (fwrite(base + src, 1, len, out) != len) break;
+      written += len;
+    } else if (op == PATCH_OP_INSERT) {
+      if (!readVarint(patch, &len)) break;
+      u64 remaining = len;
+      while (remaining) {
+	size_t n = remaining < PATCH_APPLY_BUF_SIZE
+	  ? (size_t)remaining : PATCH_APPLY_BUF_SIZE;
+	if (fread(buf, 1, n, patch) != n) break;
+	if (fwrite(buf, 1, n, out) != n) break;
+	remaining -= n;
+      }
+      if (remaining) break;
+      written += len;
+    } else {
+      break;
+    }
+  }
+
+  delete[] buf;
+  if (!ok) fprintf(stderr, "Malformed or truncated patch.\n");
+  return ok;
+}
+
+
+// write insts as a patch file, return its size or -1 on error
+static long long writePatchFile(const char *patchPath,
+				const vector<DeltaInstruction> &insts,
+				MemoryMappedFile &newFile, u64 oldLength) {
+  FILE *outf = fopen(patchPath, "wb");
+  if (!outf) {
+    fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
+	    patchPath, strerror(errno));
+    return -1;
+  }
+  u64 size = writePatch(outf, insts,
+			(const unsigned char *)newFile.getAddress(),
+			newFile.getLength(), oldLength);
+  if (fclose(outf) || size == 0) return -1;
+  return (long long) size;
+}
+
+
+extern "C" {
+  /*
+    Write a patch that turns the old version of a file into the new one,
+    using the manifests ProcessFileToVar() returned for each.  Only the
+    new file is read; unchanged chunks become copies.  Both manifests
+    must have been made with the same hash setting.
+    Returns the size of the patch, or -1 on error.
+  */
+  long long CreatePatchFromManifests(const char *chrOldManifest,
+				     const char *chrNewManifest,
+				     const char *chrNewPath,
+				     const char *chrPatchPath) {
+    Manifest oldManifest, newManifest;
+    if (!oldManifest.parse(chrOldManifest)) return -1;
+    if (!newManifest.parse(chrNewManifest)) return -1;
+
+    // a file that exists but can't be mapped has a length and no data
+    MemoryMappedFile newFile;
+    if (!newFile.mapFile(chrNewPath) && newFile.getLength()) return -1;
+    if (newFile.getLength() != newManifest.getFileLength()) {
+      fprintf(stderr, "\"%s\" doesn't match its manifest.\n", chrNewPath);
+      return -1;
+    }
+
+    vector<DeltaInstruction> insts;
+    diffManifestsToInstructions(oldManifest, newManifest, insts);
+    return writePatchFile(chrPatchPath, insts, newFile,
+			  oldManifest.getFileLength());
+  }
+
+
+  /*
+    Write a patch using byte-level matching of the new file against a
+    DedupTable of the old one (see ProcessFileToDelta()), which also
+    finds data that moved by amounts that don't line up with chunks.
+    Returns the size of the patch, or -1 on error.
+  */
+  long long CreatePatchFromTable(const char *chrOldPath,
+				 const char *chrTablePath,
+				 const char *chrNewPath, unsigned blockSize,
+				 const char *chrPatchPath) {
+    DedupTable *table = loadOrBuildMatchTable(chrOldPath, chrTablePath,
+					      blockSize);
+    if (!table) return -1;
+
+    MemoryMappedFile newFile;
+    if (!newFile.mapFile(chrNewPath) && newFile.getLength()) {
+      delete table;
+      return -1;
+    }
+
+    u64 oldLength = getFileSize(chrOldPath);
+    BlockMatcher matcher(table, oldLength);
+    vector<DeltaInstruction> insts;
+    bool ok = matcher.match((const unsigned char *)newFile.getAddress(),
+			    newFile.getLength(), insts);
+    delete table;
+    if (!ok) return -1;
+
+    return writePatchFile(chrPatchPath, insts, newFile, oldLength);
+  }
+
+
+  /*
+    Rebuild a file from its old version and a patch.  The base file is
+    memory-mapped and the patch is streamed, so memory use doesn't
+    depend on file sizes.
+    Returns the size of the rebuilt file, or -1 on error, in which case
+    nothing is left at chrOutPath.
+  */
+  long long ApplyPatch(const char *chrBasePath, const char *chrPatchPath,
+		       const char *chrOutPath) {
+    MemoryMappedFile baseFile;
+    if (!baseFile.mapFile(chrBasePath) && baseFile.getLength()) return -1;
+
+    FILE *patch = fopen(chrPatchPath, "rb");
+    if (!patch) {
+      fprintf(stderr, "Cannot read \"%s\"\n", chrPatchPath);
+      return -1;
+    }
+    FILE *outf = fopen(chrOutPath, "wb");
+    if (!outf) {
+      fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
+	      chrOutPath, strerror(errno));
+      fclose(patch);
+      return -1;
+    }
+
+    bool ok = applyPatch((const unsigned char *)baseFile.getAddress(),
+			 baseFile.getLength(), patch, outf);
+    long long size = ftell(outf);
+    fclose(patch);
+    if (fclose(outf)) ok = false;
+
+    // not a file that looks rebuilt but isn't
+    if (!ok) {
+      remove(chrOutPath);
+      return -1;
+    }
+    return size;
+  }
+}
@@ -0,0 +1,56 @@
+#ifndef __DELTA_PATCH_H__
+#define __DELTA_PATCH_H__
+
+#include <cstdio>
+#include <vector>
+#include "u64.h"
+#include "block-matcher.h"
+#include "manifest.h"
+
+/*
+  Binary patch that rebuilds a new version of a file from an old one.
+
+  Layout:
+    header, 24 bytes:
+      "dpat", version (4 bytes), old file length (8), new file length (8)
+    instructions, each an opcode byte followed by LEB128 varints:
+      'C' <src> <len>          copy len bytes from offset src of the old file
+      'I' <len> <len bytes>    insert the bytes that follow
+      'E'                      end of patch
+
+  Instructions produce the new file front to back, so a patch can be
+  applied as a stream.
+*/
+
+#define PATCH_MAGIC "dpat"
+#define PATCH_VERSION 0
+#define PATCH_HEADER_SIZE 24
+
+#define PATCH_OP_COPY 'C'
+#define PATCH_OP_INSERT 'I'
+#define PATCH_OP_END 'E'
+
+// size of the buffer used to move inserted bytes from patch to output
+#define PATCH_APPLY_BUF_SIZE (1024*1024)
+
+
+// Turn two manifests of the same kind (both MD5 or both CityHash) into
+// instructions: chunks of the new manifest whose hash and length appear
+// in the old one become copies, the rest literals.
+void diffManifestsToInstructions(const Manifest &oldManifest,
+				 const Manifest &newManifest,
+				 std::vector<DeltaInstruction> &out);
+
+// Write a patch.  Literal bytes are taken from newData.  Returns the
+// number of bytes written, or 0 on error.
+u64 writePatch(FILE *outf, const std::vector<DeltaInstruction> &insts,
+	       const unsigned char *newData, u64 newLength, u64 oldLength);
+
+// Apply a patch read from 'patch' to base[0..baseLength), writing the
+// result to 'out'.  Returns false if the patch is malformed or doesn't
+// match the base.
+bool applyPatch(const unsigned char *base, u64 baseLength,
+		FILE *patch, FILE *out);
+
+
+#endif // __DELTA_PATCH_H__
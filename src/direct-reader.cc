@@ -0,0 +1,245 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "direct-reader.h"
+#include "large-alloc.h"
+
+using namespace std;
+
+
+static u64 roundUp(u64 n, u64 align) {
+  return (n + align - 1) / align * align;
+}
+
+
+DirectFileReader::DirectFileReader() {
+  fd = -1;
+  direct = false;
+  length = keepSize = blockSize = 0;
+  buffers[0] = buffers[1] = NULL;
+  filled[0] = filled[1] = 0;
+  ready[0] = ready[1] = false;
+  readError = stopping = started = readerDone = false;
+  readErrno = 0;
+  current = -1;
+  windowOffset = windowLen = 0;
+}
+
+
+DirectFileReader::~DirectFileReader() {
+  close();
+}
+
+
+bool DirectFileReader::open(const char *filename, u64 keepBytes) {
+  close();
+
+#ifdef O_DIRECT
+  fd = ::open(filename, O_RDONLY | O_DIRECT);
+  direct = fd != -1;
+  // EINVAL: the file system doesn't do O_DIRECT
+  if (fd == -1 && errno == EINVAL)
+#endif
+    fd = ::open(filename, O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Cannot open \"%s\": %s\n", filename, strerror(errno));
+    return false;
+  }
+
+  struct stat stats;
+  if (fstat(fd, &stats)) {
+    fprintf(stderr, "Error getting size of \"%s\": %s\n",
+	    filename, strerror(errno));
+    close();
+    return false;
+  }
+  length = stats.st_size;
+
+  keepSize = roundUp(keepBytes, DIRECT_READ_ALIGN);
+  blockSize = roundUp(keepSize * 2 > DIRECT_READ_BLOCK
+		      ? keepSize * 2 : DIRECT_READ_BLOCK, DIRECT_READ_ALIGN);
+
+  // largeAlloc() maps blocks this big, so they're page aligned
+  for (int i=0; i < 2; i++) {
+    buffers[i] = (char*) largeAlloc((size_t)(keepSize + blockSize));
+    if (!buffers[i]) {
+      fprintf(stderr, "Out of memory reading \"%s\"\n", filename);
+      close();
+      return false;
+    }
+  }
+
+  reader = thread(&DirectFileReader::readLoop, this);
+  return true;
+}
+
+
+bool DirectFileReader::readBlock(char *dest, u64 offset, u64 *bytesRead) {
+  u64 want = length - offset;
+  if (want > blockSize) want = blockSize;
+
+  // O_DIRECT lengths must be aligned too; the read stops at the end of
+  // the file anyway
+  u64 request = roundUp(want, DIRECT_READ_ALIGN);
+
+  u64 done = 0;
+  while (done < request) {
+#ifdef _WIN32
+    _lseeki64(fd, offset + done, SEEK_SET);
+    int n = _read(fd, dest + done, (unsigned)(request - done));
+#else
+    ssize_t n = pread(fd, dest + done, request - done, offset + done);
+#endif
+    if (n < 0) {
+      if (errno == EINTR) continue;
+#ifdef O_DIRECT
+      // some file systems only refuse O_DIRECT when it's used
+      if (errno == EINVAL && direct) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+	direct = false;
+	continue;
+      }
+#endif
+      readErrno = errno;
+      return false;
+    }
+    if (n == 0) break;
+    done += n;
+  }
+  if (done > want) done = want;
+
+#ifdef POSIX_FADV_DONTNEED
+  if (!direct)
+    posix_fadvise(fd, (off_t)offset, (off_t)done, POSIX_FADV_DONTNEED);
+#endif
+
+  *bytesRead = done;
+  return true;
+}
+
+
+void DirectFileReader::readLoop() {
+  readLoopBlocks();
+  {
+    lock_guard<mutex> guard(lock);
+    readerDone = true;
+  }
+  changed.notify_all();
+}
+
+
+void DirectFileReader::readLoopBlocks() {
+  for (u64 offset = 0; offset < length; offset += blockSize) {
+    int b = (int)((offset / blockSize) % 2);
+    {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [&]() {
+	  return stopping || (!ready[b] && current != b);
+	});
+      if (stopping) return;
+    }
+
+    u64 n = 0;
+    bool ok = readBlock(buffers[b] + keepSize, offset, &n);
+    {
+      lock_guard<mutex> guard(lock);
+      filled[b] = n;
+      ready[b] = true;
+      if (!ok) readError = true;
+    }
+    changed.notify_all();
+
+    // error, or the file shrank
+    if (!ok || n < blockSize) return;
+  }
+}
+
+
+bool DirectFileReader::next(u64 unconsumed, const char **data, u64 *len) {
+  if (fd == -1) return false;
+
+  int b = 0;
+  if (started) {
+    if (unconsumed > windowLen || unconsumed > keepSize) {
+      fprintf(stderr, "DirectFileReader: can't keep %llu bytes\n",
+	      (unsigned long long) unconsumed);
+      return false;
+    }
+    if (windowOffset + windowLen >= length) return false;
+    b = 1 - current;
+  }
+
+  {
+    unique_lock<mutex> guard(lock);
+    changed.wait(guard, [&]() {return ready[b] || readerDone;});
+    if (!ready[b]) {
+      if (readError)
+	fprintf(stderr, "DirectFileReader: read error: %s\n",
+		strerror(readErrno));
+      return false;
+    }
+  }
+
+  if (started) {
+    // the tail of the last window goes in front of the new block
+    const char *window = buffers[current] + keepSize - (windowLen - filled[current]);
+    memcpy(buffers[b] + keepSize - unconsumed,
+	   window + windowLen - unconsumed, (size_t)unconsumed);
+    windowOffset += windowLen - unconsumed;
+
+    // the reader can have the old buffer back
+    {
+      lock_guard<mutex> guard(lock);
+      ready[current] = false;
+      current = b;
+    }
+    changed.notify_all();
+  } else {
+    lock_guard<mutex> guard(lock);
+    current = b;
+    started = true;
+  }
+
+  windowLen = unconsumed + filled[b];
+  if (windowLen == 0) return false;
+  *data = buffers[b] + keepSize - unconsumed;
+  *len = windowLen;
+  return true;
+}
+
+
+void DirectFileReader::close() {
+  if (reader.joinable()) {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    changed.notify_all();
+    reader.join();
+  }
+
+  for (int i=0; i < 2; i++) {
+    if (buffers[i]) largeFree(buffers[i], (size_t)(keepSize + blockSize));
+    buffers[i] = NULL;
+  }
+  if (fd != -1) ::close(fd);
+
+  fd = -1;
+  direct = false;
+  length = 0;
+  filled[0] = filled[1] = 0;
+  ready[0] = ready[1] = false;
+  readError = stopping = started = readerDone = false;
+  readErrno = 0;
+  current = -1;
+  windowOffset = windowLen = 0;
+}
@@ -0,0 +1,92 @@
+#ifndef __DIRECT_READER_H__
+#define __DIRECT_READER_H__
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "u64.h"
+
+// alignment O_DIRECT needs for buffers, offsets and lengths
+#define DIRECT_READ_ALIGN 4096
+
+// smallest read the reader thread makes at once
+#define DIRECT_READ_BLOCK (16*1024*1024)
+
+
+/*
+  Reads a file from start to end with O_DIRECT, so the data goes
+  straight from the device into our buffers with no page cache copy,
+  no page faults, and nothing left behind to evict other data.
+
+  There are two buffers.  A reader thread fills one while the caller
+  works on the other.  Each buffer has room in front of its block for up
+  to keepBytes of data carried over from the previous one, so the caller
+  can leave a partial chunk at the end of a window and get it back,
+  contiguous with the bytes that follow, at the start of the next.
+
+  If the file system doesn't support O_DIRECT, the file is read through
+  the page cache instead, and dropped from it as it's read.
+*/
+class DirectFileReader {
+  int fd;
+  u64 length;
+
+  // false once we've fallen back to the page cache
+  bool direct;
+
+  // bytes reserved in front of each block for carried-over data, and
+  // the block size; both multiples of DIRECT_READ_ALIGN
+  u64 keepSize, blockSize;
+
+  char *buffers[2];
+
+  // bytes read into each buffer's block, and whether it's ready
+  u64 filled[2];
+  bool ready[2];
+  bool readError, stopping;
+
+  // set when the reader thread has read all it's going to
+  bool readerDone;
+  int readErrno;
+
+  // the buffer the caller has, and where its window starts in the file
+  int current;
+  u64 windowOffset;
+  u64 windowLen;
+  bool started;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::thread reader;
+
+  // the reader thread; readLoopBlocks() does the reading
+  void readLoop();
+  void readLoopBlocks();
+  bool readBlock(char *dest, u64 offset, u64 *bytesRead);
+
+ public:
+  DirectFileReader();
+  ~DirectFileReader();
+
+  // Open a file for reading, leaving at most keepBytes unconsumed
+  // between windows.  Returns false on error.
+  bool open(const char *filename, u64 keepBytes);
+
+  // Get the next window of the file.  The unconsumed bytes at the end of
+  // the last window, of which there may be up to keepBytes, come first.
+  // Returns false at the end of the file or on a read error.
+  bool next(u64 unconsumed, const char **data, u64 *len);
+
+  // file offset of the start of the current window
+  u64 getWindowOffset() const {return windowOffset;}
+
+  u64 getLength() const {return length;}
+
+  // true if a read failed
+  bool failed() const {return readError;}
+
+  void close();
+};
+
+
+#endif // __DIRECT_READER_H__
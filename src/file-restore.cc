@@ -0,0 +1,163 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "file-restore.h"
+#include "dedup-util.h"
+#include "HashAlgs.h"
+#include "md5.h"
+
+using namespace std;
+
+
+DirectorySegmentSource::DirectorySegmentSource(const char *directory_)
+  : directory(directory_) {
+  if (!directory.empty() && directory[directory.size()-1] != '/')
+    directory += '/';
+}
+
+
+bool DirectorySegmentSource::read(const ChunkRecord &chunk,
+				  vector<char> &buf) {
+  char hexBuf[33];
+  string path = directory + chunk.hash.toHex(hexBuf);
+  int fd = openFileForRead(path.c_str());
+  if (fd == -1) return false;
+
+  u64 len;
+  int result = readSmallFile(fd, chunk.len, buf, &len);
+  close(fd);
+  if (result != 1 || len != chunk.len) {
+    fprintf(stderr, "Segment \"%s\" isn't %llu bytes long\n", path.c_str(),
+	    (unsigned long long) chunk.len);
+    return false;
+  }
+  buf.resize((size_t)len);
+  return true;
+}
+
+
+bool PackSegmentSource::read(const ChunkRecord &chunk, vector<char> &buf) {
+  char hexBuf[33];
+  PackStore::Location loc;
+  if (!store->find(chunk.hash, &loc)) {
+    fprintf(stderr, "Segment %s isn't in the pack store\n",
+	    chunk.hash.toHex(hexBuf));
+    return false;
+  }
+  if (loc.len != chunk.len) {
+    fprintf(stderr, "Segment %s isn't %llu bytes long\n",
+	    chunk.hash.toHex(hexBuf), (unsigned long long) chunk.len);
+    return false;
+  }
+  buf.resize(loc.len);
+  return loc.len == 0 || store->read(loc, &buf[0]);
+}
+
+
+bool segmentMatches(const ChunkRecord &chunk, const char *data, u64 len,
+		    unsigned options) {
+  char hexBuf[33];
+  if (len != chunk.len) return false;
+  if (options & RESTORE_VERIFY_MD5) {
+    if (MD5((const byte*)data, (size_t)len).toStr() != chunk.hash.toHex(hexBuf))
+      return false;
+  }
+  if (options & RESTORE_VERIFY_CITY) {
+    if (!(cityHash128(data, (unsigned)len) == chunk.hash))
+      return false;
+  }
+  return true;
+}
+
+
+bool restoreFile(const Manifest &manifest, SegmentSource &source,
+		 const char *outPath, unsigned threadCount, unsigned options) {
+  u64 length = manifest.getFileLength();
+
+#ifdef _WIN32
+  int fd = _open(outPath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0666);
+#else
+  int fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+#endif
+  if (fd == -1) {
+    fprintf(stderr, "Cannot create \"%s\": %s\n", outPath, strerror(errno));
+    return false;
+  }
+
+  bool ok = true;
+#ifndef _WIN32
+  if (options & RESTORE_PREALLOCATE) {
+    int err = length ? posix_fallocate(fd, 0, (off_t)length) : 0;
+    // EINVAL or EOPNOTSUPP: the file system can't, which is fine
+    if (err && err != EINVAL && err != EOPNOTSUPP) {
+      fprintf(stderr, "Cannot allocate %llu bytes for \"%s\": %s\n",
+	      (unsigned long long) length, outPath, strerror(err));
+      ok = false;
+    }
+  }
+  if (ok && ftruncate(fd, (off_t)length)) {
+    fprintf(stderr, "Cannot resize \"%s\": %s\n", outPath, strerror(errno));
+    ok = false;
+  }
+#endif
+
+  atomic<bool> failed(!ok);
+  const vector<ChunkRecord> &chunks = manifest.chunks;
+
+  parallelFor((unsigned)chunks.size(), threadCount, [&](unsigned i) {
+      if (failed) return;
+      const ChunkRecord &chunk = chunks[i];
+      char hexBuf[33];
+
+      vector<char> buf;
+      if (!source.read(chunk, buf)) {
+	failed = true;
+	return;
+      }
+      if (!segmentMatches(chunk, buf.empty() ? "" : &buf[0], buf.size(), options)) {
+	fprintf(stderr, "Segment %s at offset %llu doesn't match its hash\n",
+		chunk.hash.toHex(hexBuf), (unsigned long long) chunk.start);
+	failed = true;
+	return;
+      }
+
+      u64 done = 0;
+      while (done < chunk.len) {
+#ifdef _WIN32
+	static mutex seekLock;
+	lock_guard<mutex> guard(seekLock);
+	_lseeki64(fd, chunk.start + done, SEEK_SET);
+	int n = _write(fd, &buf[done], (unsigned)(chunk.len - done));
+#else
+	ssize_t n = pwrite(fd, &buf[done], chunk.len - done,
+			   (off_t)(chunk.start + done));
+#endif
+	if (n < 0 && errno == EINTR) continue;
+	if (n <= 0) {
+	  fprintf(stderr, "Error writing \"%s\": %s\n", outPath,
+		  strerror(errno));
+	  failed = true;
+	  return;
+	}
+	done += n;
+      }
+    });
+
+  if (close(fd) && !failed) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", outPath, strerror(errno));
+    failed = true;
+  }
+  if (failed) remove(outPath);
+  return !failed;
+}
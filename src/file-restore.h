@@ -0,0 +1,79 @@
+#ifndef __FILE_RESTORE_H__
+#define __FILE_RESTORE_H__
+
+#include <string>
+#include <vector>
+#include "u64.h"
+#include "manifest.h"
+#include "pack-store.h"
+
+// restoreFile() options
+
+// check each segment's MD5 against the manifest, for manifests made
+// with bolhash, whose hashes are MD5s
+#define RESTORE_VERIFY_MD5 0x1
+
+// check each segment's CityHash128, for manifests made without bolhash
+#define RESTORE_VERIFY_CITY 0x2
+
+// reserve the whole file's blocks before writing, so it isn't
+// fragmented and a full disk is found before any data is read
+#define RESTORE_PREALLOCATE 0x4
+
+
+// where restoreFile() reads segments from
+class SegmentSource {
+ public:
+  virtual ~SegmentSource() {}
+
+  // Read the segment for a chunk into buf, resized to fit.  Returns
+  // false if it's missing or can't be read.  Called from several
+  // threads at once.
+  virtual bool read(const ChunkRecord &chunk, std::vector<char> &buf) = 0;
+};
+
+
+// segments stored one per file, named by the hash as 32 hex digits, as
+// GenSLOFiles() writes them
+class DirectorySegmentSource : public SegmentSource {
+  std::string directory;
+
+ public:
+  DirectorySegmentSource(const char *directory_);
+  bool read(const ChunkRecord &chunk, std::vector<char> &buf);
+};
+
+
+// segments in a PackStore
+class PackSegmentSource : public SegmentSource {
+  PackStore *store;
+
+ public:
+  PackSegmentSource(PackStore *store_) : store(store_) {}
+  bool read(const ChunkRecord &chunk, std::vector<char> &buf);
+};
+
+
+// Check data against the length and, with the RESTORE_VERIFY_...
+// flags in options, the hash the manifest has for its chunk.
+bool segmentMatches(const ChunkRecord &chunk, const char *data, u64 len,
+		    unsigned options);
+
+
+/*
+  Rebuild the file a manifest describes at outPath from its segments.
+
+  The file is created at its full length, then up to threadCount
+  threads (0 for one per core) each take the next chunk, read its
+  segment, optionally check it (RESTORE_VERIFY_...), and pwrite() it
+  at its offset, so reads overlap and writes need no ordering.  A
+  segment used several times is read for each use.
+
+  Returns false, after removing the partial file, if a segment is
+  missing, the wrong length or fails its check, or on an I/O error.
+*/
+bool restoreFile(const Manifest &manifest, SegmentSource &source,
+		 const char *outPath, unsigned threadCount, unsigned options);
+
+
+#endif // __FILE_RESTORE_H__
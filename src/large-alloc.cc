@@ -0,0 +1,225 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "large-alloc.h"
+
+#if !defined(_WIN32) && !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+#define LARGE_ALLOC_USE_MMAP
+#endif
+
+static unsigned largeAllocFlags = 0;
+
+
+void setLargeAllocFlags(unsigned flags) {
+  largeAllocFlags = flags;
+}
+
+
+unsigned getLargeAllocFlags() {
+  return largeAllocFlags;
+}
+
+
+#ifdef LARGE_ALLOC_USE_MMAP
+
+// mapping length for a request; mappings are always a whole number of
+// huge pages so they can be freed the same way however they were made
+static size_t mappedSize(size_t bytes) {
+  return (bytes + LARGE_ALLOC_HUGE_PAGE_SIZE - 1)
+    & ~(size_t)(LARGE_ALLOC_HUGE_PAGE_SIZE - 1);
+}
+
+
+#ifdef __linux__
+#define LARGE_ALLOC_MPOL_INTERLEAVE 3
+
+// Returns a bitmask of the online NUMA nodes, from
+// /sys/devices/system/node/online, e.g. "0-3" or "0,2".
+static unsigned long readOnlineNodeMask() {
+  unsigned long mask = 0;
+  FILE *f = fopen("/sys/devices/system/node/online", "r");
+  if (!f) return mask;
+
+  unsigned lo, hi;
+  int c;
+  while (fscanf(f, "%u", &lo) == 1) {
+    hi = lo;
+    c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%u", &hi) != 1) break;
+      c = fgetc(f);
+    }
+    for (unsigned n=lo; n <= hi && n < sizeof(mask)*8; n++)
+      mask |= 1UL << n;
+    if (c != ',') break;
+  }
+  fclose(f);
+  return mask;
+}
+
+// readOnlineNodeMask(), read once; the static is initialized safely
+// even if several threads get here first at once
+static unsigned long getOnlineNodeMask() {
+  static unsigned long mask = readOnlineNodeMask();
+  return mask;
+}
+
+// spread the pages of [p..p+len) over all online nodes; best effort
+static void interleavePages(void *p, size_t len) {
+  unsigned long mask = getOnlineNodeMask();
+
+  // nothing to do with zero or one node
+  if ((mask & (mask-1)) == 0) return;
+
+  syscall(SYS_mbind, p, len, LARGE_ALLOC_MPOL_INTERLEAVE, &mask,
+	  sizeof(mask)*8, 0);
+}
+#else
+static void interleavePages(void *p, size_t len) {}
+#endif
+
+
+// advise and place a new or resized mapping
+static void setMappingPolicy(void *p, size_t len, bool isHugetlb) {
+#ifdef MADV_HUGEPAGE
+  if (!isHugetlb) madvise(p, len, MADV_HUGEPAGE);
+#endif
+  if (largeAllocFlags & LARGE_ALLOC_INTERLEAVE) interleavePages(p, len);
+}
+
+
+// Map len bytes starting on a huge page boundary, so they can be backed
+// by transparent huge pages, by over-allocating by one huge page and
+// trimming.  Returns NULL on failure.
+static char *mapAligned(size_t len, int prot) {
+  size_t rawLen = len + LARGE_ALLOC_HUGE_PAGE_SIZE;
+  char *raw = (char*) mmap(NULL, rawLen, prot, MAP_PRIVATE | MAP_ANONYMOUS,
+			   -1, 0);
+  if (raw == MAP_FAILED) return NULL;
+
+  size_t head = (LARGE_ALLOC_HUGE_PAGE_SIZE
+		 - ((size_t)raw & (LARGE_ALLOC_HUGE_PAGE_SIZE-1)))
+    & (LARGE_ALLOC_HUGE_PAGE_SIZE-1);
+  char *p = raw + head;
+  if (head) munmap(raw, head);
+  munmap(p + len, rawLen - head - len);
+  return p;
+}
+
+
+static void *mapAnonymous(size_t mapLen) {
+#ifdef MAP_HUGETLB
+  if (largeAllocFlags & LARGE_ALLOC_HUGETLB) {
+    void *p = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+      setMappingPolicy(p, mapLen, true);
+      return p;
+    }
+    // no huge pages reserved; use regular pages
+  }
+#endif
+
+  char *p = mapAligned(mapLen, PROT_READ | PROT_WRITE);
+  if (p) setMappingPolicy(p, mapLen, false);
+  return p;
+}
+
+
+#ifdef __linux__
+// Resize a mapping with mremap, which moves page table entries rather
+// than the data.  It's grown in place if the addresses after it are
+// free; otherwise it's moved into an aligned reservation, since
+// MREMAP_MAYMOVE alone would only keep it page aligned and it would
+// lose its transparent huge pages.  Returns NULL on failure.
+static void *remapAligned(void *p, size_t oldLen, size_t newLen) {
+  void *q = mremap(p, oldLen, newLen, 0);
+  if (q != MAP_FAILED) return q;
+
+  char *target = mapAligned(newLen, PROT_NONE);
+  if (!target) return NULL;
+  q = mremap(p, oldLen, newLen, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+  if (q == MAP_FAILED) {
+    munmap(target, newLen);
+    return NULL;
+  }
+  return q;
+}
+#endif
+
+#endif // LARGE_ALLOC_USE_MMAP
+
+
+void *largeAlloc(size_t bytes) {
+#ifdef LARGE_ALLOC_USE_MMAP
+  if (bytes >= LARGE_ALLOC_MIN_SIZE)
+    return mapAnonymous(mappedSize(bytes));
+#endif
+  return calloc(bytes ? bytes : 1, 1);
+}
+
+
+void *largeRealloc(void *p, size_t oldBytes, size_t newBytes) {
+  if (!p) return largeAlloc(newBytes);
+
+#ifdef LARGE_ALLOC_USE_MMAP
+  bool oldMapped = oldBytes >= LARGE_ALLOC_MIN_SIZE;
+  bool newMapped = newBytes >= LARGE_ALLOC_MIN_SIZE;
+
+  if (oldMapped && newMapped) {
+    size_t oldLen = mappedSize(oldBytes), newLen = mappedSize(newBytes);
+    if (oldLen == newLen) return p;
+
+#ifdef __linux__
+    // Pages added at the end are fresh zero pages.
+    void *q = remapAligned(p, oldLen, newLen);
+    if (q) {
+      if (newLen > oldLen)
+	setMappingPolicy(q, newLen,
+			 (largeAllocFlags & LARGE_ALLOC_HUGETLB) != 0);
+      return q;
+    }
+#endif
+  }
+
+  if (oldMapped || newMapped) {
+    // switching between heap and mmap, or no mremap; copy
+    void *q = largeAlloc(newBytes);
+    if (!q) return NULL;
+    memcpy(q, p, oldBytes < newBytes ? oldBytes : newBytes);
+    largeFree(p, oldBytes);
+    return q;
+  }
+#endif
+
+  void *q = realloc(p, newBytes ? newBytes : 1);
+  if (!q) return NULL;
+  if (newBytes > oldBytes) memset((char*)q + oldBytes, 0, newBytes - oldBytes);
+  return q;
+}
+
+
+void largeFree(void *p, size_t bytes) {
+  if (!p) return;
+#ifdef LARGE_ALLOC_USE_MMAP
+  if (bytes >= LARGE_ALLOC_MIN_SIZE) {
+    munmap(p, mappedSize(bytes));
+    return;
+  }
+#endif
+  free(p);
+}
@@ -0,0 +1,55 @@
+#ifndef __LARGE_ALLOC_H__
+#define __LARGE_ALLOC_H__
+
+#include <cstddef>
+
+/*
+  Allocation of big, flat arrays such as the DedupTable entries and
+  serializable_vector data.
+
+  Requests of at least LARGE_ALLOC_MIN_SIZE bytes are served with
+  anonymous mmap rather than the heap, which gives:
+   - zero-filled memory without a memset pass; pages are zeroed by the
+     kernel on first touch, so untouched parts of a table cost nothing
+   - transparent huge pages (MADV_HUGEPAGE) on 2MB-aligned mappings,
+     or explicit huge pages with LARGE_ALLOC_HUGETLB, to cut TLB misses
+   - growth with mremap, which moves page table entries instead of
+     copying, so growing an array doesn't need old+new memory at once
+   - optional NUMA interleaving with LARGE_ALLOC_INTERLEAVE, so threads
+     on every node see the same average latency for a shared index
+
+  Smaller requests, and all requests on platforms without mmap, use
+  calloc/realloc/free.  Memory is always zero-filled, including the
+  part added by largeRealloc().  Since the caller passes the size to
+  largeRealloc() and largeFree(), it must remember it.
+*/
+
+// requests at least this big are mmapped
+#define LARGE_ALLOC_MIN_SIZE (2*1024*1024)
+
+// huge page size assumed for alignment and MAP_HUGETLB
+#define LARGE_ALLOC_HUGE_PAGE_SIZE (2*1024*1024)
+
+// try MAP_HUGETLB first (needs reserved pages, see vm.nr_hugepages);
+// falls back to regular pages if none are available
+#define LARGE_ALLOC_HUGETLB 0x1
+
+// interleave pages across all online NUMA nodes
+#define LARGE_ALLOC_INTERLEAVE 0x2
+
+// Set the LARGE_ALLOC_... flags for subsequent allocations.
+void setLargeAllocFlags(unsigned flags);
+unsigned getLargeAllocFlags();
+
+// Returns zero-filled memory, or NULL on failure.
+void *largeAlloc(size_t bytes);
+
+// Resize a block from largeAlloc(), preserving its contents.  Bytes past
+// oldBytes are zero.  Returns NULL on failure, leaving p intact.
+void *largeRealloc(void *p, size_t oldBytes, size_t newBytes);
+
+// Release a block from largeAlloc() or largeRealloc().
+void largeFree(void *p, size_t bytes);
+
+
+#endif // __LARGE_ALLOC_H__
@@ -0,0 +1,290 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include "manifest-cache.h"
+#include "dedup-util.h"
+#include "HashAlgs.h"
+
+using namespace std;
+
+#define MANIFEST_CACHE_MAGIC "mcch"
+#define MANIFEST_CACHE_VERSION 0
+
+// an entry in the file, followed by manifestLen bytes of manifest and
+// chunkCount Chunks
+struct DiskEntry {
+  u64 device, inode, size, mtimeNs, ctimeNs, sample;
+  int power, mod, divide, refactor;
+  unsigned flags, hasSample;
+  u64 manifestLen, chunkCount;
+};
+
+
+bool FileIdentity::fromFile(int fd) {
+  struct stat stats;
+  if (fstat(fd, &stats)) return false;
+  device = stats.st_dev;
+  inode = stats.st_ino;
+  size = stats.st_size;
+#if defined(__APPLE__)
+  mtimeNs = stats.st_mtimespec.tv_sec * 1000000000ULL
+    + stats.st_mtimespec.tv_nsec;
+  ctimeNs = stats.st_ctimespec.tv_sec * 1000000000ULL
+    + stats.st_ctimespec.tv_nsec;
+#elif defined(_WIN32)
+  mtimeNs = stats.st_mtime * 1000000000ULL;
+  ctimeNs = stats.st_ctime * 1000000000ULL;
+#else
+  mtimeNs = stats.st_mtim.tv_sec * 1000000000ULL + stats.st_mtim.tv_nsec;
+  ctimeNs = stats.st_ctim.tv_sec * 1000000000ULL + stats.st_ctim.tv_nsec;
+#endif
+  return true;
+}
+
+
+// the time of day in nanoseconds
+static u64 nowNs() {
+#ifdef _WIN32
+  return time(NULL) * 1000000000ULL;
+#else
+  struct timespec t;
+  if (clock_gettime(CLOCK_REALTIME, &t)) return 0;
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+
+ManifestCache *ManifestCache::open(const char *path, bool checkContent) {
+  ManifestCache *cache = new ManifestCache(path, checkContent);
+
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    if (errno == ENOENT) return cache;
+    fprintf(stderr, "Cannot open \"%s\": %s\n", path, strerror(errno));
+    delete cache;
+    return NULL;
+  }
+
+  bool ok = cache->read(f);
+  fclose(f);
+  if (!ok) {
+    fprintf(stderr, "\"%s\" is not a valid manifest cache\n", path);
+    delete cache;
+    return NULL;
+  }
+  return cache;
+}
+
+
+bool ManifestCache::read(FILE *f) {
+  char magic[4];
+  unsigned version;
+  u64 count;
+  if (fread(magic, 1, 4, f) != 4 || memcmp(magic, MANIFEST_CACHE_MAGIC, 4)
+      || fread(&version, sizeof version, 1, f) != 1
+      || version != MANIFEST_CACHE_VERSION
+      || fread(&count, sizeof count, 1, f) != 1)
+    return false;
+
+  // bytes not read yet, so a damaged length can't ask for more memory
+  // than the file could fill
+  u64 left = getFileSize(f) - (4 + sizeof version + sizeof count);
+
+  for (u64 i=0; i < count; i++) {
+    DiskEntry disk;
+    if (fread(&disk, sizeof disk, 1, f) != 1) return false;
+    left -= sizeof disk;
+    if (disk.manifestLen > left
+	|| disk.chunkCount > (left - disk.manifestLen) / sizeof(Chunk))
+      return false;
+    left -= disk.manifestLen + disk.chunkCount * sizeof(Chunk);
+
+    Entry entry;
+    entry.id.device = disk.device;
+    entry.id.inode = disk.inode;
+    entry.id.size = disk.size;
+    entry.id.mtimeNs = disk.mtimeNs;
+    entry.id.ctimeNs = disk.ctimeNs;
+    entry.params.power = disk.power;
+    entry.params.mod = disk.mod;
+    entry.params.divide = disk.divide;
+    entry.params.refactor = disk.refactor;
+    entry.params.flags = disk.flags;
+    entry.hasSample = disk.hasSample != 0;
+    entry.sample = disk.sample;
+    entry.used = false;
+
+    entry.manifest.resize((size_t)disk.manifestLen);
+    entry.chunks.resize((size_t)disk.chunkCount);
+    if ((disk.manifestLen
+	 && fread(&entry.manifest[0], 1, (size_t)disk.manifestLen, f)
+	    != disk.manifestLen)
+	|| (disk.chunkCount
+	    && fread(&entry.chunks[0], sizeof(Chunk), (size_t)disk.chunkCount,
+		     f) != disk.chunkCount))
+      return false;
+
+    entries[key(entry.id)] = std::move(entry);
+  }
+  return true;
+}
+
+
+bool ManifestCache::sampleFile(int fd, u64 size, u64 *sample) {
+  char buf[MANIFEST_CACHE_SAMPLE_SIZE * MANIFEST_CACHE_SAMPLES];
+  u64 filled = 0;
+
+  // the first and last blocks and the rest evenly between, or the whole
+  // file if it's small
+  for (int i=0; i < MANIFEST_CACHE_SAMPLES && filled < size; i++) {
+    u64 want = MANIFEST_CACHE_SAMPLE_SIZE;
+    u64 offset = size <= sizeof buf ? filled
+      : (size - want) / (MANIFEST_CACHE_SAMPLES - 1) * i;
+    if (want > size - offset) want = size - offset;
+
+    u64 done = 0;
+    while (done < want) {
+#ifdef _WIN32
+      _lseeki64(fd, offset + done, SEEK_SET);
+      int n = _read(fd, buf + filled + done, (unsigned)(want - done));
+#else
+      ssize_t n = pread(fd, buf + filled + done, want - done, offset + done);
+#endif
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      done += n;
+    }
+    filled += want;
+  }
+
+  *sample = cityHash64(buf, (unsigned)filled);
+  return true;
+}
+
+
+const ManifestCache::Entry *ManifestCache::lookup
+(const FileIdentity &id, const ManifestParams &params, int fd) {
+  auto found = entries.find(key(id));
+  if (found == entries.end()) {
+    misses++;
+    return NULL;
+  }
+
+  Entry &entry = found->second;
+  entry.used = true;
+  if (!(entry.id == id) || !(entry.params == params)) {
+    misses++;
+    return NULL;
+  }
+
+  if (checkContent) {
+    u64 sample;
+    if (!entry.hasSample || !sampleFile(fd, id.size, &sample)
+	|| sample != entry.sample) {
+      misses++;
+      return NULL;
+    }
+  }
+
+  hits++;
+  return &entry;
+}
+
+
+void ManifestCache::store(const FileIdentity &id, const ManifestParams &params,
+			  int fd, const string &manifest,
+			  const vector<Chunk> &chunks) {
+  u128 k = key(id);
+  u64 now = nowNs();
+  if (id.mtimeNs + MANIFEST_CACHE_RACY_NS > now
+      || id.ctimeNs + MANIFEST_CACHE_RACY_NS > now) {
+    // the old entry is out of date either way
+    entries.erase(k);
+    return;
+  }
+
+  Entry entry;
+  entry.id = id;
+  entry.params = params;
+  entry.hasSample = checkContent && sampleFile(fd, id.size, &entry.sample);
+  if (!entry.hasSample) entry.sample = 0;
+  entry.manifest = manifest;
+  entry.chunks = chunks;
+  entry.used = true;
+  entries[k] = std::move(entry);
+}
+
+
+bool ManifestCache::save(bool dropUnused) {
+  string tempName = path + ".tmp";
+  FILE *f = fopen(tempName.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "Cannot write \"%s\": %s\n", tempName.c_str(),
+	    strerror(errno));
+    return false;
+  }
+
+  u64 count = 0;
+  for (auto it = entries.begin(); it != entries.end(); ++it)
+    if (it->second.used || !dropUnused) count++;
+
+  unsigned version = MANIFEST_CACHE_VERSION;
+  bool ok = fwrite(MANIFEST_CACHE_MAGIC, 1, 4, f) == 4
+    && fwrite(&version, sizeof version, 1, f) == 1
+    && fwrite(&count, sizeof count, 1, f) == 1;
+
+  for (auto it = entries.begin(); ok && it != entries.end(); ++it) {
+    const Entry &entry = it->second;
+    if (!entry.used && dropUnused) continue;
+
+    DiskEntry disk;
+    memset(&disk, 0, sizeof disk);
+    disk.device = entry.id.device;
+    disk.inode = entry.id.inode;
+    disk.size = entry.id.size;
+    disk.mtimeNs = entry.id.mtimeNs;
+    disk.ctimeNs = entry.id.ctimeNs;
+    disk.sample = entry.sample;
+    disk.power = entry.params.power;
+    disk.mod = entry.params.mod;
+    disk.divide = entry.params.divide;
+    disk.refactor = entry.params.refactor;
+    disk.flags = entry.params.flags;
+    disk.hasSample = entry.hasSample;
+    disk.manifestLen = entry.manifest.size();
+    disk.chunkCount = entry.chunks.size();
+
+    ok = fwrite(&disk, sizeof disk, 1, f) == 1
+      && fwrite(entry.manifest.data(), 1, entry.manifest.size(), f)
+         == entry.manifest.size()
+      && fwrite(entry.chunks.data(), sizeof(Chunk), entry.chunks.size(), f)
+         == entry.chunks.size();
+  }
+
+  // on disk before it replaces the old cache
+  if (ok && !syncFile(f)) ok = false;
+  if (fclose(f)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", tempName.c_str(),
+	    strerror(errno));
+    remove(tempName.c_str());
+    return false;
+  }
+
+  if (rename(tempName.c_str(), path.c_str())) {
+    fprintf(stderr, "Failed to rename \"%s\" to \"%s\": %s\n",
+	    tempName.c_str(), path.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
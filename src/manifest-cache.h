@@ -0,0 +1,146 @@
+#ifndef __MANIFEST_CACHE_H__
+#define __MANIFEST_CACHE_H__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "u64.h"
+#include "u128.h"
+#include "manifest.h"
+
+// with a content check, bytes read from each of MANIFEST_CACHE_SAMPLES
+// places spread evenly over the file
+#define MANIFEST_CACHE_SAMPLE_SIZE 4096
+#define MANIFEST_CACHE_SAMPLES 8
+
+// A file modified within this many nanoseconds of being read isn't
+// cached, since another write in the same timestamp tick could leave
+// its mtime unchanged.
+#define MANIFEST_CACHE_RACY_NS 2000000000ULL
+
+
+// identity of one version of a file; if any of it changes, the file
+// has to be read again
+struct FileIdentity {
+  u64 device, inode, size;
+  u64 mtimeNs, ctimeNs;
+
+  // fstat() an open file.  Returns false on error.
+  bool fromFile(int fd);
+
+  bool operator == (const FileIdentity &that) const {
+    return device == that.device && inode == that.inode
+      && size == that.size && mtimeNs == that.mtimeNs
+      && ctimeNs == that.ctimeNs;
+  }
+};
+
+
+// settings a cached manifest was made with; it's only reused with the
+// same ones
+struct ManifestParams {
+  int power, mod, divide, refactor;
+  // output format and chunking options, as the caller defines them
+  unsigned flags;
+
+  bool operator == (const ManifestParams &that) const {
+    return power == that.power && mod == that.mod && divide == that.divide
+      && refactor == that.refactor && flags == that.flags;
+  }
+};
+
+
+/*
+  Persistent cache of the manifests of unchanged files.
+
+  Entries are keyed by device and inode, and are only returned if the
+  file's size, mtime and ctime (to the nanosecond) and the chunking
+  parameters all match what they were when the manifest was made.
+  ctime catches files whose mtime was set back.  With a content check,
+  a hash of a few blocks of the file must match too, which costs
+  MANIFEST_CACHE_SAMPLES small reads per file instead of reading all
+  of it.
+
+  Besides the manifest text, each entry keeps the chunks that were
+  indexed for the file, so they can be indexed again without reading
+  it.
+
+  The whole cache is held in memory, and save() rewrites the file.
+*/
+class ManifestCache {
+ public:
+  // a chunk that was indexed for a file
+  struct Chunk {
+    u128 hash;
+    u64 offset;
+    unsigned len;
+    unsigned unused;
+  };
+
+  struct Entry {
+    FileIdentity id;
+    ManifestParams params;
+    bool hasSample;
+    u64 sample;
+    std::string manifest;
+    std::vector<Chunk> chunks;
+
+    // looked up or stored since the cache was opened
+    bool used;
+  };
+
+ private:
+  std::string path;
+  bool checkContent;
+
+  // keyed by inode (hi) and device (lo)
+  std::unordered_map<u128, Entry, ChunkHashHasher> entries;
+
+  u64 hits, misses;
+
+  ManifestCache(const char *path_, bool checkContent_)
+    : path(path_), checkContent(checkContent_), hits(0), misses(0) {}
+
+  static u128 key(const FileIdentity &id) {
+    u128 k;
+    k.hi = id.inode;
+    k.lo = id.device;
+    return k;
+  }
+
+  bool read(FILE *f);
+
+ public:
+  // Load a cache file, or start an empty cache if it doesn't exist.
+  // With checkContent, entries are also checked with sampleFile().
+  // Returns NULL on error.
+  static ManifestCache *open(const char *path, bool checkContent);
+
+  // hash of MANIFEST_CACHE_SAMPLES blocks of an open file of the given
+  // size.  Returns false on a read error.
+  static bool sampleFile(int fd, u64 size, u64 *sample);
+
+  // Find the manifest for a file, given its identity and, with the
+  // content check, its open descriptor.  Returns NULL if there's none
+  // or it's out of date.
+  const Entry *lookup(const FileIdentity &id, const ManifestParams &params,
+		      int fd);
+
+  // Remember the manifest for a file, replacing any old one.  fd is
+  // read for the content check.  Files modified too recently (see
+  // MANIFEST_CACHE_RACY_NS) are not cached.
+  void store(const FileIdentity &id, const ManifestParams &params, int fd,
+	     const std::string &manifest, const std::vector<Chunk> &chunks);
+
+  // Write the cache back to its file, through a temporary file so an
+  // interrupted save leaves the old cache.  With dropUnused, entries
+  // for files that weren't seen since open() are left out.
+  bool save(bool dropUnused);
+
+  u64 size() const {return entries.size();}
+  u64 getHits() const {return hits;}
+  u64 getMisses() const {return misses;}
+};
+
+
+#endif // __MANIFEST_CACHE_H__
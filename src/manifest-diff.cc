@@ -0,0 +1,62 @@
+#include <unordered_map>
+#include <unordered_set>
+
+#include "manifest-diff.h"
+
+using namespace std;
+
+
+// whether each of a manifest's digests was known
+typedef unordered_map<u128, bool, ChunkHashHasher> SeenMap;
+
+
+static void joinChunks(const Manifest &manifest,
+		       const function<bool(const u128 &)> &known,
+		       ManifestDiff &diff, SeenMap &seen) {
+  diff = ManifestDiff();
+  seen.reserve(manifest.chunks.size());
+
+  for (size_t i=0; i < manifest.chunks.size(); i++) {
+    const ChunkRecord &chunk = manifest.chunks[i];
+    SeenMap::iterator it = seen.find(chunk.hash);
+    if (it == seen.end()) {
+      it = seen.insert(make_pair(chunk.hash, known(chunk.hash))).first;
+      if (!it->second) {
+	diff.added.push_back(chunk);
+	diff.addedBytes += chunk.len;
+      }
+    }
+
+    if (it->second)
+      diff.sharedBytes += chunk.len;
+    else
+      diff.newBytes += chunk.len;
+  }
+}
+
+
+void diffManifestWithStore(const Manifest &manifest,
+			   const function<bool(const u128 &)> &known,
+			   ManifestDiff &diff) {
+  SeenMap seen;
+  joinChunks(manifest, known, diff, seen);
+}
+
+
+void diffManifests(const Manifest &oldManifest, const Manifest &newManifest,
+		   ManifestDiff &diff) {
+  unordered_set<u128, ChunkHashHasher> oldDigests;
+  oldDigests.reserve(oldManifest.chunks.size());
+  for (size_t i=0; i < oldManifest.chunks.size(); i++)
+    oldDigests.insert(oldManifest.chunks[i].hash);
+
+  // the new manifest's digests, to probe with the old ones
+  SeenMap newDigests;
+  joinChunks(newManifest, [&](const u128 &digest) {
+      return oldDigests.count(digest) != 0;
+    }, diff, newDigests);
+
+  for (size_t i=0; i < oldManifest.chunks.size(); i++)
+    if (!newDigests.count(oldManifest.chunks[i].hash))
+      diff.removedBytes += oldManifest.chunks[i].len;
+}
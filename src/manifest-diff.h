@@ -0,0 +1,53 @@
+#ifndef __MANIFEST_DIFF_H__
+#define __MANIFEST_DIFF_H__
+
+#include <functional>
+#include <vector>
+#include "u64.h"
+#include "u128.h"
+#include "manifest.h"
+
+
+// How a manifest's chunks compare with another's, or with a set of
+// chunks already stored.  Chunks are matched by digest, wherever they
+// are in the file.
+struct ManifestDiff {
+  // bytes of the new file in chunks that were already there, and in
+  // ones that weren't; together they're the new file's length
+  u64 sharedBytes, newBytes;
+
+  // bytes of the old file in chunks the new one doesn't have
+  u64 removedBytes;
+
+  // the new chunks, each digest once, in the order they're first seen
+  // in the new file: what has to be uploaded
+  std::vector<ChunkRecord> added;
+  u64 addedBytes;
+
+  ManifestDiff() : sharedBytes(0), newBytes(0), removedBytes(0),
+		   addedBytes(0) {}
+};
+
+
+/*
+  Compare two versions of a file's manifest with a hash join: the
+  digests of each side go into a hash table, and the other side's are
+  looked up in it, so it takes time in proportion to the number of
+  chunks.  The manifests must have been made with the same kind of
+  digest.
+*/
+void diffManifests(const Manifest &oldManifest, const Manifest &newManifest,
+		   ManifestDiff &diff);
+
+
+/*
+  Compare a manifest with the chunks known(digest) says are stored,
+  such as a chunk index.  Nothing is removed.  known is called once for
+  each distinct digest.
+*/
+void diffManifestWithStore(const Manifest &manifest,
+			   const std::function<bool(const u128 &)> &known,
+			   ManifestDiff &diff);
+
+
+#endif // __MANIFEST_DIFF_H__
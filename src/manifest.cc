@@ -0,0 +1,227 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include "manifest.h"
+
+// the vendored rapidjson memcpy()s its values, which newer GCCs warn
+// about; it's not ours to fix
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wclass-memaccess"
+#endif
+#include "rapidjson/document.h"
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 8
+#pragma GCC diagnostic pop
+#endif
+
+using namespace std;
+
+
+bool Manifest::parse(const char *text) {
+  clear();
+
+  // skip leading whitespace to see which format this is
+  const char *p = text;
+  while (isspace(*p)) p++;
+
+  if (*p == '[') return parseJson(p);
+  return parseText(p);
+}
+
+
+static bool parseHash(const char *hex, u128 &hash) {
+  hash.lo = hash.hi = 0;
+  return hash.fromHex(hex);
+}
+
+
+bool Manifest::parseJson(const char *text) {
+  rapidjson::Document doc;
+  doc.Parse(text);
+  if (doc.HasParseError() || !doc.IsArray()) {
+    fprintf(stderr, "Manifest is not a JSON array.\n");
+    return false;
+  }
+
+  u64 nextStart = 0;
+  for (rapidjson::SizeType i=0; i < doc.Size(); i++) {
+    const rapidjson::Value &v = doc[i];
+    if (!v.IsObject()) goto fail;
+
+    ChunkRecord rec;
+
+    if (v.HasMember("size_bytes")) {
+      // SLO segment: {"path":..,"size_bytes":..,"etag":..}
+      if (!v["size_bytes"].IsUint64() || !v.HasMember("etag")
+	  || !v["etag"].IsString())
+	goto fail;
+      rec.start = nextStart;
+      rec.len = v["size_bytes"].GetUint64();
+      if (!parseHash(v["etag"].GetString(), rec.hash)) goto fail;
+      chunks.push_back(rec);
+      nextStart += rec.len;
+      continue;
+    }
+
+    if (!v.HasMember("type") || !v["type"].IsString()
+	|| !v.HasMember("start") || !v["start"].IsUint64()
+	|| !v.HasMember("len") || !v["len"].IsUint64()
+	|| !v.HasMember("hash") || !v["hash"].IsString())
+      goto fail;
+
+    rec.start = v["start"].GetUint64();
+    rec.len = v["len"].GetUint64();
+    if (v.HasMember("pow") && v["pow"].IsInt()) rec.pow = v["pow"].GetInt();
+    if (!parseHash(v["hash"].GetString(), rec.hash)) goto fail;
+
+    if (!strcmp(v["type"].GetString(), "file")) {
+      hasFileRecord = true;
+      file = rec;
+    } else {
+      chunks.push_back(rec);
+    }
+  }
+  return true;
+
+ fail:
+  fprintf(stderr, "Unrecognized record in JSON manifest.\n");
+  return false;
+}
+
+
+// Split the next whitespace-separated field off a line, NUL-terminating
+// it in place.  Returns NULL if there isn't one.
+static char *nextField(char *&p) {
+  while (isspace(*p)) p++;
+  if (!*p) return NULL;
+  char *field = p;
+  while (*p && !isspace(*p)) p++;
+  if (*p) *p++ = 0;
+  return field;
+}
+
+
+// Parse a decimal field that has to be all digits.
+static bool parseNumber(const char *field, unsigned long long *value) {
+  char *end;
+  if (!field || !isdigit(*field)) return false;
+  *value = strtoull(field, &end, 10);
+  return *end == 0;
+}
+
+
+// Parse a decimal field that may have a sign.
+static bool parseInt(const char *field, int *value) {
+  char *end;
+  if (!field || !*field) return false;
+  *value = (int)strtol(field, &end, 10);
+  return *end == 0;
+}
+
+
+// Manifests can have millions of lines, so each one is split in a
+// reused buffer rather than through a stream and sscanf().
+bool Manifest::parseText(const char *text) {
+  string line;
+  int lineNo = 0;
+
+  size_t lines = 1;
+  for (const char *p = strchr(text, '\n'); p; p = strchr(p + 1, '\n'))
+    lines++;
+  chunks.reserve(lines);
+
+  for (const char *p = text; *p; ) {
+    const char *lineStart = p, *eol = strchr(p, '\n');
+    if (!eol) eol = p + strlen(p);
+    line.assign(lineStart, eol);
+    p = *eol ? eol + 1 : eol;
+    lineNo++;
+
+    char *q = &line[0];
+    char *type = nextField(q);
+    if (!type) continue;
+
+    ChunkRecord rec;
+    unsigned long long start, len;
+    char *startField = nextField(q), *lenField = nextField(q);
+    char *powField = nextField(q), *hex = nextField(q);
+    if (strlen(type) > 15 || !parseNumber(startField, &start)
+	|| !parseNumber(lenField, &len) || !parseInt(powField, &rec.pow)
+	|| !hex || !parseHash(hex, rec.hash)) {
+      fprintf(stderr, "Manifest line %d not recognized: %s\n",
+	      lineNo, string(lineStart, eol).c_str());
+      return false;
+    }
+    rec.start = start;
+    rec.len = len;
+
+    if (!strcmp(type, "file")) {
+      hasFileRecord = true;
+      file = rec;
+    } else {
+      chunks.push_back(rec);
+    }
+  }
+  return true;
+}
+
+
+bool Manifest::readFromFile(const char *filename) {
+  FILE *inf = fopen(filename, "rb");
+  if (!inf) {
+    fprintf(stderr, "Cannot read \"%s\"\n", filename);
+    return false;
+  }
+
+  string text;
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof buf, inf)) > 0)
+    text.append(buf, n);
+  fclose(inf);
+
+  return parse(text.c_str());
+}
+
+
+u64 Manifest::getFileLength() const {
+  if (hasFileRecord) return file.len;
+  if (chunks.empty()) return 0;
+  return chunks.back().start + chunks.back().len;
+}
+
+
+string Manifest::toString(bool boljson) const {
+  stringstream ssbuffer;
+  char buf[80];
+
+  if (boljson) ssbuffer << "[";
+
+  if (hasFileRecord) {
+    if (boljson) {
+      ssbuffer << "{\"type\":\"file\",\"start\":" << file.start << ",\"len\":" << file.len << ",\"pow\":" << file.pow << ",\"hash\":\"" << file.hash.toHex(buf) << "\"},";
+    } else {
+      ssbuffer << "file\t" << file.start << "\t" << file.len << "\t" << file.pow << "\t" << file.hash.toHex(buf) << "\n";
+    }
+  }
+
+  for (size_t i=0; i < chunks.size(); i++) {
+    const ChunkRecord &c = chunks[i];
+    if (boljson) {
+      ssbuffer << "{\"type\":\"chunk\",\"start\":" << c.start << ",\"len\":" << c.len << ",\"pow\":" << c.pow << ",\"hash\":\"" << c.hash.toHex(buf) << "\"},";
+    } else {
+      ssbuffer << "chunk\t" << c.start << "\t" << c.len << "\t" << c.pow << "\t" << c.hash.toHex(buf) << "\n";
+    }
+  }
+
+  string result = ssbuffer.str();
+
+  // replace the trailing comma with the closing bracket
+  if (boljson) {
+    if (result.size() > 1) result.resize(result.size()-1);
+    result += "]";
+  }
+  return result;
+}
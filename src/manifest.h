@@ -0,0 +1,83 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <string>
+#include <vector>
+#include "u64.h"
+#include "u128.h"
+
+
+// One "file" or "chunk" line of a manifest.
+struct ChunkRecord {
+  // byte offset and length in the file
+  u64 start;
+  u64 len;
+
+  // anchor power; only meaningful for the file record
+  int pow;
+
+  // MD5 or CityHash128 of the bytes, depending on how the manifest
+  // was made.  Stored as parsed from the hex, and printed back the same
+  // way by toHex().
+  u128 hash;
+
+  ChunkRecord() : start(0), len(0), pow(0) {hash.lo = hash.hi = 0;}
+};
+
+
+// hasher so chunk hashes can key an unordered_map; the values are
+// already uniformly distributed
+struct ChunkHashHasher {
+  size_t operator()(const u128 &h) const {
+    return (size_t)(h.lo ^ (h.hi * 0x9e3779b97f4a7c15ULL));
+  }
+};
+
+
+/*
+  Parsed form of the text returned by ProcessFileToVar().  Any of its
+  output formats can be read:
+
+    file	0	1656723	10	3cf7c2eb0afccb8b0b24bfecc05f6119
+    chunk	0	74047	0	dd79445d2db542a2c2e3e1e367a7e16d
+    ...
+
+    [{"type":"file","start":0,"len":1656723,"pow":10,"hash":"3cf7..."},
+     {"type":"chunk","start":0,"len":74047,"pow":0,"hash":"dd79..."},..]
+
+    [{"path":"/chunks/dd79...","size_bytes":74047,"etag":"dd79..."},..]
+
+  SLO manifests have no offsets or file record; chunk offsets are
+  computed by adding up the sizes.
+*/
+class Manifest {
+ public:
+  bool hasFileRecord;
+  ChunkRecord file;
+  std::vector<ChunkRecord> chunks;
+
+  Manifest() : hasFileRecord(false) {}
+
+  void clear() {hasFileRecord = false; file = ChunkRecord(); chunks.clear();}
+
+  // Parse manifest text.  On error, prints a message and returns false.
+  bool parse(const char *text);
+
+  // Read and parse a manifest file.
+  bool readFromFile(const char *filename);
+
+  // Returns the length of the file the manifest describes: the file
+  // record's length if there is one, else the end of the last chunk.
+  u64 getFileLength() const;
+
+  // Format the manifest the same way ProcessFileToVar() would, with
+  // hashes printed as 32 hex digits.
+  std::string toString(bool boljson) const;
+
+ private:
+  bool parseJson(const char *text);
+  bool parseText(const char *text);
+};
+
+
+#endif // __MANIFEST_H__
@@ -54,6 +54,42 @@ MD5::MD5(const byte* input, size_t len) {
   //init((const byte*)message.c_str(), message.length());
   init(input, len);
 }
+
+/**
+ * @Construct an empty MD5 object.
+ *
+ */
+MD5::MD5() {
+  finished = false;
+  /* Reset number of bits. */
+  count[0] = count[1] = 0;
+  /* Initialization constants. */
+  state[0] = 0x67452301;
+  state[1] = 0xefcdab89;
+  state[2] = 0x98badcfe;
+  state[3] = 0x10325476;
+}
+
+/**
+ * @Append to the message.  getDigest() may be called at any point and
+ * gives the digest of everything so far.
+ *
+ * @param {input} the input message.
+ *
+ * @param {len} the number btye of message.
+ *
+ */
+void MD5::update(const byte* input, size_t len) {
+  /* init() counts bits in 32 bit pieces, so keep each call under 512MB. */
+  const size_t maxPart = (size_t)1 << 28;
+  while (len > maxPart) {
+    init(input, maxPart);
+    input += maxPart;
+    len -= maxPart;
+  }
+  init(input, len);
+}
+
 /**
  * @Generate md5 digest.
  *
@@ -62,16 +98,16 @@ MD5::MD5(const byte* input, size_t len) {
  */
 const byte* MD5::getDigest() {
   if (!finished) {
-    finished = true;
-
     byte bits[8];
     bit32 oldState[4];
     bit32 oldCount[2];
+    byte oldBuffer[64];
     bit32 index, padLen;
 
-    /* Save current state and count. */
+    /* Save current state, count and buffer. */
     memcpy(oldState, state, 16);
     memcpy(oldCount, count, 8);
+    memcpy(oldBuffer, buffer, 64);
 
     /* Save number of bits */
     encode(count, bits, 8);
@@ -87,9 +123,13 @@ const byte* MD5::getDigest() {
     /* Store state in digest */
     encode(state, digest, 16);
 
-    /* Restore current state and count. */
+    /* Restore current state, count and buffer, so more can be added. */
     memcpy(state, oldState, 16);
     memcpy(count, oldCount, 8);
+    memcpy(buffer, oldBuffer, 64);
+
+    /* After init(), which clears it. */
+    finished = true;
   }
   return digest;
 }
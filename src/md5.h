@@ -93,6 +93,12 @@ public:
 
   MD5(const byte* input, size_t len);
 
+  /* Construct an empty MD5 object, to be fed with update(). */
+  MD5();
+
+  /* Append input to the message. */
+  void update(const byte* input, size_t len);
+
   /* Generate md5 digest. */
   const byte* getDigest();
 
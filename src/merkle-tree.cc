@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cstring>
+
+#include "merkle-tree.h"
+#include "HashAlgs.h"
+
+using namespace std;
+
+// first byte of what's hashed for a leaf or a node
+#define MERKLE_LEAF_TAG 0
+#define MERKLE_NODE_TAG 1
+
+
+u128 MerkleTree::leafHash(const u128 &digest, u64 len) {
+  char buf[1 + 3*sizeof(u64)];
+  buf[0] = MERKLE_LEAF_TAG;
+  memcpy(buf + 1, &digest.lo, sizeof(u64));
+  memcpy(buf + 1 + sizeof(u64), &digest.hi, sizeof(u64));
+  memcpy(buf + 1 + 2*sizeof(u64), &len, sizeof(u64));
+  return cityHash128(buf, sizeof buf);
+}
+
+
+u128 MerkleTree::nodeHash(const u128 &left, const u128 &right) {
+  char buf[1 + 4*sizeof(u64)];
+  buf[0] = MERKLE_NODE_TAG;
+  memcpy(buf + 1, &left.lo, sizeof(u64));
+  memcpy(buf + 1 + sizeof(u64), &left.hi, sizeof(u64));
+  memcpy(buf + 1 + 2*sizeof(u64), &right.lo, sizeof(u64));
+  memcpy(buf + 1 + 3*sizeof(u64), &right.hi, sizeof(u64));
+  return cityHash128(buf, sizeof buf);
+}
+
+
+void MerkleTree::build(const vector<ChunkRecord> &chunks) {
+  vector<u128> leaves(chunks.size());
+  for (size_t i=0; i < chunks.size(); i++)
+    leaves[i] = leafHash(chunks[i].hash, chunks[i].len);
+  build(leaves);
+}
+
+
+void MerkleTree::build(const vector<u128> &leaves) {
+  levels.clear();
+  if (leaves.empty()) return;
+  levels.push_back(leaves);
+
+  while (levels.back().size() > 1) {
+    const vector<u128> &below = levels.back();
+    vector<u128> level((below.size() + 1) / 2);
+    for (size_t i=0; i < level.size(); i++)
+      level[i] = 2*i + 1 < below.size()
+	? nodeHash(below[2*i], below[2*i + 1]) : below[2*i];
+    levels.push_back(level);
+  }
+}
+
+
+u128 MerkleTree::root() const {
+  if (levels.empty()) {
+    u128 empty;
+    empty.lo = empty.hi = 0;
+    return leafHash(empty, 0);
+  }
+  return levels.back()[0];
+}
+
+
+bool MerkleTree::getNode(unsigned level, unsigned i, u128 *node) const {
+  if (level >= levels.size() || i >= levels[level].size()) return false;
+  *node = levels[level][i];
+  return true;
+}
+
+
+// add [first, last) to ranges, joining it to the last one if they meet
+static void addRange(vector<pair<unsigned, unsigned> > &ranges,
+		     unsigned first, unsigned last) {
+  if (first >= last) return;
+  if (!ranges.empty() && ranges.back().second == first)
+    ranges.back().second = last;
+  else
+    ranges.push_back(make_pair(first, last));
+}
+
+
+void MerkleTree::diffNode(const MerkleTree &other, unsigned level,
+			  unsigned i,
+			  vector<pair<unsigned, unsigned> > &ranges) const {
+  u64 count = leafCount(), otherCount = other.leafCount();
+  u64 first = (u64)i << level;
+  u64 last = min(first + ((u64)1 << level), count);
+  u64 otherLast = min(first + ((u64)1 << level), otherCount);
+
+  // past the end of one tree, everything here differs
+  if (first >= count || first >= otherCount) {
+    if (first < max(count, otherCount))
+      addRange(ranges, (unsigned)first, (unsigned)max(last, otherLast));
+    return;
+  }
+
+  u128 node, otherNode;
+  if (last == otherLast && getNode(level, i, &node)
+      && other.getNode(level, i, &otherNode) && node == otherNode)
+    return;
+
+  if (level == 0) {
+    addRange(ranges, i, i + 1);
+    return;
+  }
+  diffNode(other, level - 1, 2*i, ranges);
+  diffNode(other, level - 1, 2*i + 1, ranges);
+}
+
+
+void MerkleTree::diff(const MerkleTree &other,
+		      vector<pair<unsigned, unsigned> > &ranges) const {
+  ranges.clear();
+  size_t height = max(levels.size(), other.levels.size());
+  if (height) diffNode(other, (unsigned)height - 1, 0, ranges);
+}
+
+
+void MerkleTree::proveRange(unsigned first, unsigned count,
+			    vector<u128> &proof) const {
+  proof.clear();
+  u64 lo = first, hi = min((u64)first + count, (u64)leafCount());
+  if (lo >= hi) return;
+
+  // the same steps as verifyRange(), taking the nodes it's missing
+  for (size_t level=0; levels[level].size() > 1; level++) {
+    u64 n = levels[level].size();
+    if (lo & 1) proof.push_back(levels[level][--lo]);
+    if ((hi & 1) && hi < n) proof.push_back(levels[level][hi++]);
+    lo /= 2;
+    hi = (hi + 1) / 2;
+  }
+}
+
+
+bool MerkleTree::verifyRange(const u128 &root, unsigned leafCount,
+			     unsigned first, const vector<u128> &leaves,
+			     const vector<u128> &proof) {
+  u64 lo = first, hi = (u64)first + leaves.size(), n = leafCount;
+  if (leaves.empty() || hi > n) return false;
+
+  // the nodes [lo, hi) of each level in turn
+  vector<u128> nodes(leaves);
+  size_t used = 0;
+  while (n > 1) {
+    if (lo & 1) {
+      if (used == proof.size()) return false;
+      nodes.insert(nodes.begin(), proof[used++]);
+      lo--;
+    }
+    if ((hi & 1) && hi < n) {
+      if (used == proof.size()) return false;
+      nodes.push_back(proof[used++]);
+      hi++;
+    }
+
+    vector<u128> above((nodes.size() + 1) / 2);
+    for (size_t i=0; i < above.size(); i++)
+      above[i] = 2*i + 1 < nodes.size()
+	? nodeHash(nodes[2*i], nodes[2*i + 1]) : nodes[2*i];
+    nodes.swap(above);
+    lo /= 2;
+    hi = (hi + 1) / 2;
+    n = (n + 1) / 2;
+  }
+  return used == proof.size() && nodes[0] == root;
+}
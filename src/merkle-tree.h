@@ -0,0 +1,76 @@
+#ifndef __MERKLE_TREE_H__
+#define __MERKLE_TREE_H__
+
+#include <utility>
+#include <vector>
+#include "u64.h"
+#include "u128.h"
+#include "manifest.h"
+
+
+/*
+  A binary hash tree over the chunks of a manifest, in order.
+
+  Each leaf is the CityHash128 of a chunk's digest and length, and each
+  node above is the CityHash128 of its two children; a node without a
+  sibling is carried up a level unchanged.  Leaves and nodes are hashed
+  with different tags, so one can't stand in for the other.  The root
+  identifies the file, and is computed from the chunk digests alone, so
+  the file's bytes don't need a pass of their own.
+
+  Node i of level k covers leaves [i << k, (i+1) << k), or up to the
+  last leaf, whatever the number of leaves, so the same node in two
+  trees covers the same chunks.  That's what lets diff() skip equal
+  subtrees.  It compares chunks by position: an insertion that moves
+  later chunks changes everything after it.
+*/
+class MerkleTree {
+  // levels[0] are the leaves, and the last level is the root
+  std::vector<std::vector<u128> > levels;
+
+  bool getNode(unsigned level, unsigned i, u128 *node) const;
+
+  void diffNode(const MerkleTree &other, unsigned level, unsigned i,
+		std::vector<std::pair<unsigned, unsigned> > &ranges) const;
+
+ public:
+  // the leaf for a chunk
+  static u128 leafHash(const u128 &digest, u64 len);
+
+  // the node above two others
+  static u128 nodeHash(const u128 &left, const u128 &right);
+
+  // Build the tree over chunks, replacing what was there.
+  void build(const std::vector<ChunkRecord> &chunks);
+
+  // Build the tree over leaves from leafHash().
+  void build(const std::vector<u128> &leaves);
+
+  unsigned leafCount() const {
+    return levels.empty() ? 0 : (unsigned)levels[0].size();
+  }
+
+  // The root.  A tree of no chunks has the root of one empty leaf.
+  u128 root() const;
+
+  // The ranges of leaves [first, last) that differ between this tree
+  // and other, including any leaves only one of them has, in order.
+  // Only the nodes above a difference are compared, so it takes time
+  // in proportion to the number of differences and the tree's height.
+  void diff(const MerkleTree &other,
+	    std::vector<std::pair<unsigned, unsigned> > &ranges) const;
+
+  // The nodes besides leaves [first, first + count) needed to compute
+  // the root from them, for verifyRange().
+  void proveRange(unsigned first, unsigned count,
+		  std::vector<u128> &proof) const;
+
+  // Check that leaves, starting at leaf first of a tree of leafCount,
+  // give root along with proof from proveRange().
+  static bool verifyRange(const u128 &root, unsigned leafCount,
+			  unsigned first, const std::vector<u128> &leaves,
+			  const std::vector<u128> &proof);
+};
+
+
+#endif // __MERKLE_TREE_H__
@@ -0,0 +1,424 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <direct.h>
+#include <io.h>
+#endif
+
+#include "pack-store.h"
+#include "dedup-util.h"
+#include "md5.h"
+
+using namespace std;
+
+#define PACK_MAGIC "pack"
+#define PACK_INDEX_MAGIC "pidx"
+#define PACK_STORE_VERSION 0
+
+// the pack and index headers: magic, version, and 8 reserved bytes
+#define PACK_HEADER_SIZE 16
+
+// in a pack before each segment's data
+struct SegmentHeader {
+  u128 digest;
+  unsigned len;
+  unsigned reserved;
+};
+
+
+static void makeHeader(char header[PACK_HEADER_SIZE], const char *magic) {
+  memset(header, 0, PACK_HEADER_SIZE);
+  memcpy(header, magic, 4);
+  *(unsigned*)(header+4) = PACK_STORE_VERSION;
+}
+
+
+static bool checkHeader(FILE *f, const char *magic) {
+  char header[PACK_HEADER_SIZE];
+  return fread(header, 1, PACK_HEADER_SIZE, f) == PACK_HEADER_SIZE
+    && !memcmp(header, magic, 4)
+    && *(unsigned*)(header+4) == PACK_STORE_VERSION;
+}
+
+
+PackStore::PackStore(const char *directory_, bool writable_,
+		     u64 maxPackSize_)
+  : directory(directory_), writable(writable_),
+    maxPackSize(maxPackSize_ ? maxPackSize_ : PACK_STORE_DEFAULT_PACK_SIZE),
+    packFile(NULL), packNo(0), packSize(0), indexFile(NULL) {
+  if (directory.empty() || directory[directory.size()-1] != '/')
+    directory += '/';
+}
+
+
+PackStore::~PackStore() {
+  flush();
+  if (packFile) fclose(packFile);
+  if (indexFile) fclose(indexFile);
+  for (size_t i=0; i < readFds.size(); i++)
+    if (readFds[i] != -1) ::close(readFds[i]);
+}
+
+
+string PackStore::packPath(unsigned n) const {
+  char name[32];
+  sprintf(name, "pack-%06u.pack", n);
+  return directory + name;
+}
+
+
+PackStore *PackStore::open(const char *directory, bool writable,
+			   u64 maxPackSize) {
+  if (writable) {
+#ifdef _WIN32
+    int err = _mkdir(directory);
+#else
+    int err = mkdir(directory, 0777);
+#endif
+    if (err && errno != EEXIST) {
+      fprintf(stderr, "Cannot create \"%s\": %s\n", directory,
+	      strerror(errno));
+      return NULL;
+    }
+  }
+
+  PackStore *store = new PackStore(directory, writable, maxPackSize);
+  if (!store->loadIndex()) {
+    delete store;
+    return NULL;
+  }
+  return store;
+}
+
+
+bool PackStore::loadIndex() {
+  string indexPath = directory + "index";
+
+  // the end of the indexed segments in each pack
+  vector<u64> indexedEnd;
+
+  FILE *f = fopen(indexPath.c_str(), "rb");
+  // an index that didn't get its header written is empty
+  bool newIndex = !f || getFileSize(f) == 0;
+  if (f && newIndex) {
+    fclose(f);
+  } else if (f) {
+    if (!checkHeader(f, PACK_INDEX_MAGIC)) {
+      fprintf(stderr, "\"%s\" is not a pack index\n", indexPath.c_str());
+      fclose(f);
+      return false;
+    }
+    IndexRecord rec;
+    u64 recordCount = 0;
+    u64 indexSize = getFileSize(f);
+    while (fread(&rec, sizeof rec, 1, f) == 1) {
+      recordCount++;
+      Location loc;
+      loc.pack = rec.pack;
+      loc.len = rec.len;
+      loc.offset = rec.offset;
+      segments[rec.digest] = loc;
+      if (indexedEnd.size() <= rec.pack) indexedEnd.resize(rec.pack + 1, 0);
+      if (indexedEnd[rec.pack] < rec.offset + rec.len)
+	indexedEnd[rec.pack] = rec.offset + rec.len;
+    }
+    fclose(f);
+
+    // a record cut short by a crash is dropped, so the next one is
+    // appended in the right place; its segment is recovered from the
+    // pack
+    u64 wholeSize = PACK_HEADER_SIZE + recordCount * sizeof(IndexRecord);
+#ifndef _WIN32
+    if (writable && indexSize > wholeSize
+	&& truncate(indexPath.c_str(), (off_t)wholeSize)) {
+      fprintf(stderr, "Cannot truncate \"%s\": %s\n", indexPath.c_str(),
+	      strerror(errno));
+      return false;
+    }
+#endif
+  } else if (errno != ENOENT) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", indexPath.c_str(),
+	    strerror(errno));
+    return false;
+  }
+
+  // Segments past the end of the index can only be in the last indexed
+  // pack or packs after it.
+  unsigned n = indexedEnd.empty() ? 0 : (unsigned)indexedEnd.size() - 1;
+  u64 end = 0;
+  bool anyPack = false;
+  while (fileExists(packPath(n).c_str())) {
+    u64 from = n < indexedEnd.size() && indexedEnd[n] ? indexedEnd[n]
+      : PACK_HEADER_SIZE;
+    if (!recoverPack(n, from, &end)) return false;
+    anyPack = true;
+    n++;
+  }
+  if (anyPack) n--;
+
+  if (!writable) return true;
+
+  // the index is appended to from here on
+  indexFile = fopen(indexPath.c_str(), newIndex ? "wb" : "ab");
+  if (!indexFile) {
+    fprintf(stderr, "Cannot write \"%s\": %s\n", indexPath.c_str(),
+	    strerror(errno));
+    return false;
+  }
+  if (newIndex) {
+    char header[PACK_HEADER_SIZE];
+    makeHeader(header, PACK_INDEX_MAGIC);
+    fwrite(header, 1, PACK_HEADER_SIZE, indexFile);
+  }
+
+  return openPackForAppend(n, anyPack ? end : 0) && flush();
+}
+
+
+bool PackStore::recoverPack(unsigned n, u64 from, u64 *end) {
+  string path = packPath(n);
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+  u64 fileSize = getFileSize(f);
+
+  // a pack that didn't get its header written holds nothing
+  if (fileSize < PACK_HEADER_SIZE) {
+    fclose(f);
+    *end = 0;
+    return true;
+  }
+  if (!checkHeader(f, PACK_MAGIC)) {
+    fprintf(stderr, "\"%s\" is not a pack\n", path.c_str());
+    fclose(f);
+    return false;
+  }
+
+  // 'from' is the end of a segment's data, or the header.  The index
+  // doesn't vouch for anything past it, so each segment has to match
+  // its digest; the first that doesn't, and everything after it, is
+  // what a crash left half written.
+  u64 pos = from;
+  vector<char> buf;
+  char hexBuf[33];
+  while (pos + sizeof(SegmentHeader) <= fileSize) {
+    SegmentHeader header;
+    if (seekFile(f, pos) || fread(&header, sizeof header, 1, f) != 1) break;
+    u64 dataStart = pos + sizeof header;
+    if (dataStart + header.len > fileSize) break;
+
+    buf.resize(header.len);
+    if (header.len && fread(&buf[0], 1, header.len, f) != header.len) break;
+    if (MD5((const byte*)(buf.empty() ? "" : &buf[0]), buf.size()).toStr()
+	!= header.digest.toHex(hexBuf))
+      break;
+
+    if (segments.find(header.digest) == segments.end()) {
+      Location loc;
+      loc.pack = n;
+      loc.len = header.len;
+      loc.offset = dataStart;
+      segments[header.digest] = loc;
+      if (writable) {
+	IndexRecord rec;
+	rec.digest = header.digest;
+	rec.offset = dataStart;
+	rec.pack = n;
+	rec.len = header.len;
+	pending.push_back(rec);
+      }
+    }
+    pos = dataStart + header.len;
+  }
+  fclose(f);
+
+#ifndef _WIN32
+  // so segments added later don't follow the damage
+  if (writable && fileSize > pos && truncate(path.c_str(), (off_t)pos)) {
+    fprintf(stderr, "Cannot truncate \"%s\": %s\n", path.c_str(),
+	    strerror(errno));
+    return false;
+  }
+#endif
+
+  *end = pos;
+  return true;
+}
+
+
+bool PackStore::openPackForAppend(unsigned n, u64 size) {
+  if (packFile) fclose(packFile);
+  packNo = n;
+  string path = packPath(n);
+
+  packFile = fopen(path.c_str(), size ? "r+b" : "w+b");
+  if (!packFile) {
+    fprintf(stderr, "Cannot write \"%s\": %s\n", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  if (size == 0) {
+    char header[PACK_HEADER_SIZE];
+    makeHeader(header, PACK_MAGIC);
+    fwrite(header, 1, PACK_HEADER_SIZE, packFile);
+    size = PACK_HEADER_SIZE;
+  }
+#ifndef _WIN32
+  // drop a segment that was only partly written
+  else if (getFileSize(packFile) > size
+	   && ftruncate(fileno(packFile), (off_t)size)) {
+    fprintf(stderr, "Cannot truncate \"%s\": %s\n", path.c_str(),
+	    strerror(errno));
+    return false;
+  }
+#endif
+  packSize = size;
+  return seekFile(packFile, size) == 0;
+}
+
+
+bool PackStore::add(const u128 &digest, const void *data, unsigned len) {
+  if (segments.find(digest) != segments.end()) return true;
+  if (!writable) return false;
+
+  if (packSize > PACK_HEADER_SIZE
+      && packSize + sizeof(SegmentHeader) + len > maxPackSize) {
+    if (!flush() || !openPackForAppend(packNo + 1, 0)) return false;
+  }
+
+  SegmentHeader header;
+  header.digest = digest;
+  header.len = len;
+  header.reserved = 0;
+  // flushed before it's counted, so a write error can only be in this
+  // segment and packSize is still where the last whole one ends
+  if (fwrite(&header, sizeof header, 1, packFile) != 1
+      || fwrite(data, 1, len, packFile) != len || fflush(packFile)) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", packPath(packNo).c_str(),
+	    strerror(errno));
+
+    // the next segment goes where this one started, or if the part
+    // that was written can't be taken back, nothing more is added
+    // rather than indexing segments at the wrong offsets
+    if (seekFile(packFile, packSize)
+#ifndef _WIN32
+	|| ftruncate(fileno(packFile), (off_t)packSize)
+#endif
+	)
+      writable = false;
+    return false;
+  }
+
+  Location loc;
+  loc.pack = packNo;
+  loc.len = len;
+  loc.offset = packSize + sizeof header;
+  segments[digest] = loc;
+  packSize = loc.offset + len;
+
+  IndexRecord rec;
+  rec.digest = digest;
+  rec.offset = loc.offset;
+  rec.pack = packNo;
+  rec.len = len;
+  pending.push_back(rec);
+
+  if (pending.size() >= PACK_STORE_INDEX_BATCH) return flush();
+  return true;
+}
+
+
+bool PackStore::flush() {
+  if (!writable) return true;
+
+  // the segments go out before the records that point to them, and
+  // reach the disk first, so a power loss can't leave records pointing
+  // at data that was never written
+  if (packFile && fflush(packFile)) return false;
+  if (pending.empty()) return true;
+  if (packFile && !syncFile(packFile)) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", packPath(packNo).c_str(),
+	    strerror(errno));
+    return false;
+  }
+
+  if (fwrite(&pending[0], sizeof(IndexRecord), pending.size(), indexFile)
+      != pending.size() || fflush(indexFile)) {
+    fprintf(stderr, "Error writing \"%sindex\": %s\n", directory.c_str(),
+	    strerror(errno));
+    return false;
+  }
+  pending.clear();
+  return true;
+}
+
+
+bool PackStore::find(const u128 &digest, Location *loc) const {
+  auto it = segments.find(digest);
+  if (it == segments.end()) return false;
+  *loc = it->second;
+  return true;
+}
+
+
+int PackStore::readFd(unsigned pack) {
+  lock_guard<mutex> guard(readFdLock);
+  if (readFds.size() <= pack) readFds.resize(pack + 1, -1);
+  if (readFds[pack] == -1) {
+    string path = packPath(pack);
+#ifdef _WIN32
+    readFds[pack] = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    readFds[pack] = ::open(path.c_str(), O_RDONLY);
+#endif
+    if (readFds[pack] == -1)
+      fprintf(stderr, "Cannot read \"%s\": %s\n", path.c_str(),
+	      strerror(errno));
+  }
+  return readFds[pack];
+}
+
+
+bool PackStore::read(const Location &loc, void *buf) {
+  // what's been added may still be in the stdio buffer
+  if (writable && loc.pack == packNo && fflush(packFile)) return false;
+
+  int fd = readFd(loc.pack);
+  if (fd == -1) return false;
+
+  char *dest = (char*) buf;
+  u64 done = 0;
+  while (done < loc.len) {
+#ifdef _WIN32
+    _lseeki64(fd, loc.offset + done, SEEK_SET);
+    int n = _read(fd, dest + done, (unsigned)(loc.len - done));
+#else
+    ssize_t n = pread(fd, dest + done, loc.len - done, loc.offset + done);
+#endif
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      fprintf(stderr, "Error reading \"%s\": %s\n",
+	      packPath(loc.pack).c_str(), n ? strerror(errno) : "end of file");
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+
+bool PackStore::read(const u128 &digest, vector<char> &buf) {
+  Location loc;
+  if (!find(digest, &loc)) return false;
+  buf.resize(loc.len);
+  return loc.len == 0 || read(loc, &buf[0]);
+}
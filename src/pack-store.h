@@ -0,0 +1,122 @@
+#ifndef __PACK_STORE_H__
+#define __PACK_STORE_H__
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "u64.h"
+#include "u128.h"
+#include "manifest.h"
+
+// a pack is closed and a new one started once it would grow past this
+#define PACK_STORE_DEFAULT_PACK_SIZE (1024ULL*1024*1024)
+
+// index records buffered before flush() is called automatically
+#define PACK_STORE_INDEX_BATCH 4096
+
+
+/*
+  Segments stored by digest in a few large, append-only pack files
+  rather than one file each.
+
+  A directory holds pack-000000.pack, pack-000001.pack, ... and an
+  index.  Each pack is a 16 byte header followed by segments, each a
+  24 byte header (digest and length) and the data.  The index is a
+  header and then one 32 byte record per segment: digest, pack number,
+  offset and length.  It's loaded into memory by open().
+
+  Digests are the MD5s of the segments.  Adding a segment whose digest
+  is already stored does nothing, so a segment is only stored once.
+  Records are appended to the index in batches, after the segments they
+  describe are on disk.  If the process dies in between, open() finds
+  the segments in the packs that the index doesn't have from their
+  headers, checking each against its digest, and cuts the pack off at
+  the first that was only partly written.
+
+  Only find() and read() may be called from several threads at once,
+  and only while nothing is being added.
+*/
+class PackStore {
+ public:
+  // where a segment is
+  struct Location {
+    unsigned pack;
+    unsigned len;
+    u64 offset;
+  };
+
+ private:
+  // on disk in the index
+  struct IndexRecord {
+    u128 digest;
+    u64 offset;
+    unsigned pack;
+    unsigned len;
+  };
+
+  std::string directory;
+  bool writable;
+  u64 maxPackSize;
+
+  std::unordered_map<u128, Location, ChunkHashHasher> segments;
+
+  // the pack being appended to, and its size
+  FILE *packFile;
+  unsigned packNo;
+  u64 packSize;
+
+  FILE *indexFile;
+  std::vector<IndexRecord> pending;
+
+  // descriptors for reading, by pack number; -1 if not open yet
+  std::vector<int> readFds;
+  std::mutex readFdLock;
+
+  PackStore(const char *directory_, bool writable_, u64 maxPackSize_);
+
+  std::string packPath(unsigned n) const;
+
+  bool loadIndex();
+
+  // add segments in pack n past offset 'from' that the index doesn't
+  // have, truncating the pack after the last one that matches its
+  // digest; returns the end of that one
+  bool recoverPack(unsigned n, u64 from, u64 *end);
+
+  bool openPackForAppend(unsigned n, u64 size);
+
+  int readFd(unsigned pack);
+
+ public:
+  ~PackStore();
+
+  // Open the pack store in a directory, creating it if writable and
+  // it doesn't exist.  Packs are started at maxPackSize bytes, or
+  // PACK_STORE_DEFAULT_PACK_SIZE if 0.  Returns NULL on error.
+  static PackStore *open(const char *directory, bool writable,
+			 u64 maxPackSize = 0);
+
+  // Store a segment under its digest, unless one is already stored.
+  // Returns false on a write error.
+  bool add(const u128 &digest, const void *data, unsigned len);
+
+  // Find a segment.  Returns false if it isn't stored.
+  bool find(const u128 &digest, Location *loc) const;
+
+  // Read a segment into buf, resized to fit.  Returns false if it isn't
+  // stored or can't be read.
+  bool read(const u128 &digest, std::vector<char> &buf);
+
+  // Read a segment into buf, which must hold loc.len bytes.
+  bool read(const Location &loc, void *buf);
+
+  // Write out pending index records.  Returns false on error.
+  bool flush();
+
+  u64 size() const {return segments.size();}
+};
+
+
+#endif // __PACK_STORE_H__
@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <unordered_map>
+
+#include "scrub.h"
+#include "dedup-util.h"
+
+using namespace std;
+
+
+bool scrubFile(const Manifest &manifest, const char *path,
+	       unsigned threadCount, unsigned options, ScrubResult &result) {
+  if (!fileExists(path)) {
+    fprintf(stderr, "Cannot read \"%s\"\n", path);
+    return false;
+  }
+
+  // an empty file maps to NULL
+  MemoryMappedFile mappedFile;
+  const char *data = (const char *)mappedFile.mapFile(path);
+  u64 len = mappedFile.getLength();
+  if (!data && len) return false;
+
+  const vector<ChunkRecord> &chunks = manifest.chunks;
+  vector<char> bad(chunks.size(), 0);
+  atomic<bool> stop(false);
+  atomic<u64> chunksChecked(0), bytesChecked(0);
+
+  parallelFor((unsigned)chunks.size(), threadCount, [&](unsigned i) {
+      if (stop) return;
+      const ChunkRecord &chunk = chunks[i];
+
+      // a chunk past the end of the file is bad without reading it
+      bool ok = chunk.start <= len && chunk.len <= len - chunk.start
+	&& segmentMatches(chunk, data ? data + chunk.start : "", chunk.len,
+			  options);
+      chunksChecked++;
+      if (ok) {
+	bytesChecked += chunk.len;
+      } else {
+	bad[i] = 1;
+	if (options & SCRUB_STOP_ON_FAILURE) stop = true;
+      }
+    });
+
+  result.chunksChecked += chunksChecked;
+  result.bytesChecked += bytesChecked;
+  for (size_t i=0; i < chunks.size(); i++)
+    if (bad[i]) result.bad.push_back(chunks[i]);
+
+  u64 expected = manifest.getFileLength();
+  if (len > expected && !(stop && (options & SCRUB_STOP_ON_FAILURE))) {
+    ChunkRecord extra;
+    extra.start = expected;
+    extra.len = len - expected;
+    result.bad.push_back(extra);
+  }
+  return true;
+}
+
+
+void scrubSegments(const Manifest &manifest, SegmentSource &source,
+		   unsigned threadCount, unsigned options,
+		   ScrubResult &result) {
+  const vector<ChunkRecord> &chunks = manifest.chunks;
+
+  // the first chunk for each segment
+  vector<unsigned> unique;
+  unordered_map<u128, unsigned, ChunkHashHasher> first;
+  for (unsigned i=0; i < chunks.size(); i++)
+    if (first.insert(make_pair(chunks[i].hash, i)).second)
+      unique.push_back(i);
+
+  vector<char> segmentBad(unique.size(), 0);
+  atomic<bool> stop(false);
+  atomic<u64> chunksChecked(0), bytesChecked(0);
+
+  parallelFor((unsigned)unique.size(), threadCount, [&](unsigned u) {
+      if (stop) return;
+      const ChunkRecord &chunk = chunks[unique[u]];
+      vector<char> buf;
+      bool ok = source.read(chunk, buf)
+	&& segmentMatches(chunk, buf.empty() ? "" : &buf[0], buf.size(),
+			  options);
+      chunksChecked++;
+      if (ok) {
+	bytesChecked += chunk.len;
+      } else {
+	segmentBad[u] = 1;
+	if (options & SCRUB_STOP_ON_FAILURE) stop = true;
+      }
+    });
+
+  result.chunksChecked += chunksChecked;
+  result.bytesChecked += bytesChecked;
+
+  // every chunk that uses a bad segment
+  unordered_map<u128, bool, ChunkHashHasher> badHashes;
+  for (size_t u=0; u < unique.size(); u++)
+    if (segmentBad[u]) badHashes[chunks[unique[u]].hash] = true;
+  if (badHashes.empty()) return;
+  for (size_t i=0; i < chunks.size(); i++)
+    if (badHashes.count(chunks[i].hash)) result.bad.push_back(chunks[i]);
+}
@@ -0,0 +1,52 @@
+#ifndef __SCRUB_H__
+#define __SCRUB_H__
+
+#include <vector>
+#include "u64.h"
+#include "manifest.h"
+#include "file-restore.h"
+
+// scrub options; the hash checks are the restore ones, and with
+// neither only lengths and readability are checked
+#define SCRUB_MD5 RESTORE_VERIFY_MD5
+#define SCRUB_CITY RESTORE_VERIFY_CITY
+
+// stop at the first bad chunk found; chunks other threads are already
+// checking are still reported
+#define SCRUB_STOP_ON_FAILURE 0x8
+
+
+struct ScrubResult {
+  u64 chunksChecked, bytesChecked;
+
+  // chunks that didn't match or couldn't be read, in manifest order.
+  // If the file is longer than the manifest says, the extra bytes are
+  // reported as a chunk with a zero hash.
+  std::vector<ChunkRecord> bad;
+
+  ScrubResult() : chunksChecked(0), bytesChecked(0) {}
+};
+
+
+/*
+  Check that the file at path still matches its manifest.  The file is
+  mapped and up to threadCount threads (0 for one per core) each hash
+  the next chunk at its offset, so it's read at the rate of the disk
+  and the threads together.  Returns false if the file can't be read
+  at all.
+*/
+bool scrubFile(const Manifest &manifest, const char *path,
+	       unsigned threadCount, unsigned options, ScrubResult &result);
+
+
+/*
+  Check that the segments a manifest refers to are all in source and
+  still match their hashes.  A segment used by several chunks is read
+  once, and every chunk using a bad one is reported.
+*/
+void scrubSegments(const Manifest &manifest, SegmentSource &source,
+		   unsigned threadCount, unsigned options,
+		   ScrubResult &result);
+
+
+#endif // __SCRUB_H__
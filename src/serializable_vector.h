@@ -2,8 +2,11 @@
 #define __SERIALIZABLE_VECTOR_H__
 
 #include <cassert>
+#include "large-alloc.h"
 
 
+// T must be a plain-old-data type; entries are moved with memcpy (or
+// mremap) and start out zeroed.
 template<class T>
 class serializable_vector {
   T *data;
@@ -15,11 +18,11 @@ class serializable_vector {
       assert(capacity < 0x80000000);
       newCapacity = capacity*2;
     }
-    T *newData = new T[newCapacity];
+    // large arrays are remapped in place rather than copied
+    T *newData = (T*) largeRealloc(data, sizeof(T) * capacity,
+				   sizeof(T) * newCapacity);
     assert(newData);
 
-    memcpy(newData, data, sizeof(T) * capacity);
-    delete[] data;
     data = newData;
     capacity = newCapacity;
   }
@@ -29,7 +32,8 @@ class serializable_vector {
  public:
   serializable_vector(size_t initialCapacity = 10) {
     capacity = initialCapacity;
-    data = new T[capacity];
+    data = (T*) largeAlloc(sizeof(T) * capacity);
+    assert(data);
     count = 0;
   }
 
@@ -44,7 +48,7 @@ class serializable_vector {
     
 
   ~serializable_vector() {
-    delete[] data;
+    largeFree(data, sizeof(T) * capacity);
   }
 
   size_t size() {return count;}
@@ -65,6 +69,12 @@ class serializable_vector {
   void reserve(size_t minimumCapacity) {
     if (minimumCapacity > capacity) grow(minimumCapacity);
   }
+
+  // new entries are zero unless they were used before a shrink
+  void resize(size_t newCount) {
+    reserve(newCount);
+    count = newCount;
+  }
   
   // returns the number of bytes written
   off_t writeEntries(FILE *outf) {
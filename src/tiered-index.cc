@@ -0,0 +1,445 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "tiered-index.h"
+#include "dedup-util.h"
+
+using namespace std;
+
+#define TIERED_INDEX_MAGIC "tidx"
+#define TIERED_INDEX_VERSION 0
+#define TIERED_INDEX_FILTER_MAGIC "tidf"
+#define TIERED_INDEX_FILTER_HEADER_SIZE 24
+
+
+TieredIndex::TieredIndex(const char *path, size_t cacheEntries)
+  : indexPath(path), logPath(string(path) + ".log"),
+    filterPath(string(path) + ".filter") {
+  indexFile = logFile = NULL;
+  bucketCount = pageCount = recordCount = filterCapacity = 0;
+  filter = NULL;
+  filterSaved = false;
+  savedFilterRecords = 0;
+  cacheCapacity = cacheEntries ? cacheEntries : 1;
+  clockHand = 0;
+  cache.reserve(cacheCapacity);
+  cacheMap.reserve(cacheCapacity);
+  lookupCount = cacheHits = filterRejects = pageReads = containerReads = 0;
+}
+
+
+TieredIndex::~TieredIndex() {
+  // the filter only matches the log once everything is flushed; there's
+  // no need to write it again if nothing was added.  The header is
+  // rewritten too, since open() may have grown filterCapacity.
+  if (indexFile && logFile && flush()
+      && !(filterSaved && savedFilterRecords == recordCount)
+      && saveFilter()) {
+    filterSaved = true;
+    writeHeader();
+  }
+  if (indexFile) fclose(indexFile);
+  if (logFile) fclose(logFile);
+  delete filter;
+}
+
+
+TieredIndex *TieredIndex::create(const char *path, u64 expectedRecords,
+				 size_t cacheEntries) {
+  TieredIndex *index = new TieredIndex(path, cacheEntries);
+
+  // round the page count up to a power of 2
+  u64 minBuckets = (u64)(expectedRecords /
+			 (TIERED_INDEX_PAGE_RECORDS * TIERED_INDEX_PAGE_FILL))
+    + 1;
+  index->bucketCount = 1;
+  while (index->bucketCount < minBuckets) index->bucketCount *= 2;
+  index->pageCount = 1 + index->bucketCount;
+  index->filterCapacity = expectedRecords ? expectedRecords : 1;
+  index->filter = new BlockedBloomFilter(index->filterCapacity);
+
+  // one left by an index this replaces
+  remove(index->filterPath.c_str());
+
+  index->indexFile = fopen(path, "w+b");
+  index->logFile = fopen(index->logPath.c_str(), "w+b");
+  if (!index->indexFile || !index->logFile) {
+    fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
+	    path, strerror(errno));
+    delete index;
+    return NULL;
+  }
+
+  // empty pages; writing the last one sizes the file, and the rest
+  // read back as zeros
+  Page page;
+  memset(&page, 0, sizeof page);
+  if (!index->writePage(index->pageCount - 1, &page)
+      || !index->writeHeader()) {
+    delete index;
+    return NULL;
+  }
+
+  return index;
+}
+
+
+TieredIndex *TieredIndex::open(const char *path, size_t cacheEntries) {
+  TieredIndex *index = new TieredIndex(path, cacheEntries);
+
+  index->indexFile = fopen(path, "r+b");
+  index->logFile = fopen(index->logPath.c_str(), "r+b");
+  if (!index->indexFile || !index->logFile) {
+    fprintf(stderr, "Cannot read \"%s\"\n", path);
+    delete index;
+    return NULL;
+  }
+
+  char header[TIERED_INDEX_PAGE_SIZE];
+  if (fread(header, 1, TIERED_INDEX_PAGE_SIZE, index->indexFile)
+      != TIERED_INDEX_PAGE_SIZE
+      || memcmp(header, TIERED_INDEX_MAGIC, 4)
+      || *(unsigned*)(header+4) != TIERED_INDEX_VERSION
+      || *(unsigned*)(header+40) != TIERED_INDEX_CONTAINER_RECORDS) {
+    fprintf(stderr, "Format error reading \"%s\".\n", path);
+    // don't flush anything into a file we don't understand
+    fclose(index->indexFile);
+    index->indexFile = NULL;
+    delete index;
+    return NULL;
+  }
+
+  index->bucketCount = *(u64*)(header+8);
+  index->pageCount = *(u64*)(header+16);
+  index->recordCount = *(u64*)(header+24);
+  index->filterCapacity = *(u64*)(header+32);
+  index->filterSaved = *(unsigned*)(header+44) != 0;
+
+  // overflow pages added by a flush() that didn't get to update the
+  // header are still linked in; don't hand them out again
+  u64 filePages = getFileSize(index->indexFile) / TIERED_INDEX_PAGE_SIZE;
+  if (filePages > index->pageCount) index->pageCount = filePages;
+
+  u64 logRecords = getFileSize(index->logFile) / sizeof(Record);
+  if (logRecords < index->recordCount) {
+    fprintf(stderr, "\"%s\" is truncated.\n", index->logPath.c_str());
+    fclose(index->indexFile);
+    index->indexFile = NULL;
+    delete index;
+    return NULL;
+  }
+
+  // start from the saved filter if it's still big enough, otherwise
+  // rebuild it from the whole log; either way, pick up any records a
+  // flush() didn't finish with
+  if (logRecords > index->filterCapacity) {
+    index->filterCapacity = logRecords;
+  } else if (index->filterSaved) {
+    index->filter = index->loadFilter();
+  }
+  if (!index->filter) {
+    index->filter = new BlockedBloomFilter(index->filterCapacity);
+    index->savedFilterRecords = 0;
+  }
+  if (!index->scanLog(index->savedFilterRecords)) {
+    fprintf(stderr, "Error reading \"%s\"\n", index->logPath.c_str());
+    // don't save a filter that's missing records
+    fclose(index->indexFile);
+    index->indexFile = NULL;
+    delete index;
+    return NULL;
+  }
+
+  return index;
+}
+
+
+bool TieredIndex::writeHeader() {
+  char header[TIERED_INDEX_PAGE_SIZE] = {0};
+  memcpy(header, TIERED_INDEX_MAGIC, 4);
+  *(unsigned*)(header+4) = TIERED_INDEX_VERSION;
+  *(u64*)(header+8) = bucketCount;
+  *(u64*)(header+16) = pageCount;
+  *(u64*)(header+24) = recordCount;
+  *(u64*)(header+32) = filterCapacity;
+  *(unsigned*)(header+40) = TIERED_INDEX_CONTAINER_RECORDS;
+  *(unsigned*)(header+44) = filterSaved;
+
+  return !seekFile(indexFile, 0)
+    && fwrite(header, 1, TIERED_INDEX_PAGE_SIZE, indexFile)
+       == TIERED_INDEX_PAGE_SIZE
+    && !fflush(indexFile);
+}
+
+
+bool TieredIndex::readPage(u64 pageNo, Page *page) {
+  pageReads++;
+  return !seekFile(indexFile, pageNo * TIERED_INDEX_PAGE_SIZE)
+    && fread(page, TIERED_INDEX_PAGE_SIZE, 1, indexFile) == 1;
+}
+
+
+bool TieredIndex::writePage(u64 pageNo, const Page *page) {
+  return !seekFile(indexFile, pageNo * TIERED_INDEX_PAGE_SIZE)
+    && fwrite(page, TIERED_INDEX_PAGE_SIZE, 1, indexFile) == 1;
+}
+
+
+bool TieredIndex::scanLog(u64 first) {
+  static const unsigned BATCH = 4096;
+  vector<Record> buf(BATCH);
+
+  if (seekFile(logFile, first * sizeof(Record))) return false;
+
+  u64 recordNo = first;
+  size_t n;
+  while ((n = fread(&buf[0], sizeof(Record), BATCH, logFile)) > 0) {
+    for (size_t i=0; i < n; i++, recordNo++) {
+      filter->add(buf[i].hash.lo);
+
+      // in the log but maybe not in the pages
+      if (recordNo >= recordCount && !pendingMap.count(buf[i].hash)) {
+	pendingMap[buf[i].hash] = pending.size();
+	pending.push_back(buf[i]);
+      }
+    }
+  }
+  return !ferror(logFile);
+}
+
+
+BlockedBloomFilter *TieredIndex::loadFilter() {
+  FILE *f = fopen(filterPath.c_str(), "rb");
+  if (!f) return NULL;
+
+  // written after a flush(), so it can't cover more than the pages do
+  char header[TIERED_INDEX_FILTER_HEADER_SIZE];
+  BlockedBloomFilter *loaded = NULL;
+  if (fread(header, 1, sizeof header, f) == sizeof header
+      && !memcmp(header, TIERED_INDEX_FILTER_MAGIC, 4)
+      && *(u64*)(header+8) <= recordCount
+      && *(u64*)(header+16) == filterCapacity)
+    loaded = BlockedBloomFilter::readFromFile(f);
+  fclose(f);
+
+  if (loaded) savedFilterRecords = *(u64*)(header+8);
+  return loaded;
+}
+
+
+bool TieredIndex::saveFilter() {
+  string tempName = filterPath + ".tmp";
+  FILE *f = fopen(tempName.c_str(), "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to open \"%s\" for writing: %s\n",
+	    tempName.c_str(), strerror(errno));
+    return false;
+  }
+
+  char header[TIERED_INDEX_FILTER_HEADER_SIZE] = {0};
+  memcpy(header, TIERED_INDEX_FILTER_MAGIC, 4);
+  *(u64*)(header+8) = recordCount;
+  *(u64*)(header+16) = filterCapacity;
+
+  bool ok = fwrite(header, 1, sizeof header, f) == sizeof header
+    && filter->writeToFile(f)
+       == sizeof(unsigned) + sizeof(u64) + filter->byteSize();
+  if (fclose(f)) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Error writing \"%s\": %s\n", tempName.c_str(),
+	    strerror(errno));
+    remove(tempName.c_str());
+    return false;
+  }
+
+  if (rename(tempName.c_str(), filterPath.c_str())) {
+    fprintf(stderr, "Failed to rename \"%s\" to \"%s\": %s\n",
+	    tempName.c_str(), filterPath.c_str(), strerror(errno));
+    return false;
+  }
+  savedFilterRecords = recordCount;
+  return true;
+}
+
+
+void TieredIndex::cacheInsert(const Record &rec, bool referenced) {
+  unordered_map<u128, size_t, ChunkHashHasher>::iterator it =
+    cacheMap.find(rec.hash);
+  if (it != cacheMap.end()) {
+    if (referenced) cache[it->second].referenced = true;
+    return;
+  }
+
+  size_t slotNo;
+  if (cache.size() < cacheCapacity) {
+    slotNo = cache.size();
+    cache.push_back(CacheSlot());
+  } else {
+    // second chance: clear reference bits until an unreferenced slot
+    // comes around
+    while (cache[clockHand].referenced) {
+      cache[clockHand].referenced = false;
+      clockHand = (clockHand + 1) % cacheCapacity;
+    }
+    slotNo = clockHand;
+    clockHand = (clockHand + 1) % cacheCapacity;
+    cacheMap.erase(cache[slotNo].rec.hash);
+  }
+
+  cache[slotNo].rec = rec;
+  cache[slotNo].referenced = referenced;
+  cacheMap[rec.hash] = slotNo;
+}
+
+
+bool TieredIndex::findOnDisk(const u128 &hash, Record *rec) {
+  Page page;
+  u64 pageNo = bucketPage(hash);
+  while (pageNo) {
+    if (!readPage(pageNo, &page)) return false;
+    for (unsigned i=0; i < page.count; i++) {
+      if (page.records[i].hash == hash) {
+	*rec = page.records[i];
+	return true;
+      }
+    }
+    pageNo = page.overflow;
+  }
+  return false;
+}
+
+
+void TieredIndex::prefetchContainer(unsigned container) {
+  u64 first = (u64)container * TIERED_INDEX_CONTAINER_RECORDS;
+  if (first >= recordCount) return;
+  u64 count = recordCount - first;
+  if (count > TIERED_INDEX_CONTAINER_RECORDS)
+    count = TIERED_INDEX_CONTAINER_RECORDS;
+
+  Record buf[TIERED_INDEX_CONTAINER_RECORDS];
+  if (seekFile(logFile, first * sizeof(Record))) return;
+  size_t n = fread(buf, sizeof(Record), (size_t)count, logFile);
+  containerReads++;
+
+  // not marked as referenced, so neighbors that are never asked for
+  // are the first to go
+  for (size_t i=0; i < n; i++)
+    cacheInsert(buf[i], false);
+}
+
+
+bool TieredIndex::lookup(const u128 &hash, ChunkLocation *loc) {
+  lookupCount++;
+
+  const Record *found = NULL;
+  Record diskRec;
+
+  unordered_map<u128, size_t, ChunkHashHasher>::iterator it =
+    cacheMap.find(hash);
+  if (it != cacheMap.end()) {
+    cacheHits++;
+    cache[it->second].referenced = true;
+    found = &cache[it->second].rec;
+  } else if ((it = pendingMap.find(hash)) != pendingMap.end()) {
+    found = &pending[it->second];
+  } else if (!filter->mayContain(hash.lo)) {
+    filterRejects++;
+  } else if (findOnDisk(hash, &diskRec)) {
+    prefetchContainer(diskRec.container);
+    cacheInsert(diskRec, true);
+    found = &diskRec;
+  }
+
+  if (!found) return false;
+  loc->offset = found->offset;
+  loc->len = found->len;
+  return true;
+}
+
+
+bool TieredIndex::insert(const u128 &hash, const ChunkLocation &loc) {
+  ChunkLocation existing;
+  if (lookup(hash, &existing)) return false;
+
+  Record rec;
+  rec.hash = hash;
+  rec.offset = loc.offset;
+  rec.len = loc.len;
+  rec.container = (unsigned)(size() / TIERED_INDEX_CONTAINER_RECORDS);
+
+  pendingMap[hash] = pending.size();
+  pending.push_back(rec);
+  filter->add(hash.lo);
+
+  if (pending.size() >= TIERED_INDEX_WRITE_BATCH) flush();
+  return true;
+}
+
+
+// order pending records by the page they go in
+struct RecordPageLess {
+  u64 mask;
+  RecordPageLess(u64 m) : mask(m) {}
+  bool operator()(const TieredIndex::Record &a,
+		  const TieredIndex::Record &b) const {
+    return (a.hash.hi & mask) < (b.hash.hi & mask);
+  }
+};
+
+
+bool TieredIndex::flush() {
+  if (pending.empty()) return true;
+
+  // the log first, on disk; once the records are there, open() can
+  // redo the rest
+  if (seekFile(logFile, recordCount * sizeof(Record))
+      || fwrite(&pending[0], sizeof(Record), pending.size(), logFile)
+         != pending.size()
+      || !syncFile(logFile)) {
+    fprintf(stderr, "Error writing \"%s\": %s\n",
+	    logPath.c_str(), strerror(errno));
+    return false;
+  }
+
+  // then each bucket's page chain, visiting each bucket once
+  vector<Record> sorted(pending);
+  stable_sort(sorted.begin(), sorted.end(), RecordPageLess(bucketCount-1));
+
+  Page page;
+  size_t i = 0;
+  while (i < sorted.size()) {
+    u64 bucket = bucketPage(sorted[i].hash), pageNo = bucket;
+
+    // new records go at the end of the chain
+    if (!readPage(pageNo, &page)) goto fail;
+    while (page.overflow) {
+      pageNo = page.overflow;
+      if (!readPage(pageNo, &page)) goto fail;
+    }
+
+    for (; i < sorted.size() && bucketPage(sorted[i].hash) == bucket; i++) {
+      if (page.count == TIERED_INDEX_PAGE_RECORDS) {
+	u64 newPageNo = pageCount++;
+	page.overflow = newPageNo;
+	if (!writePage(pageNo, &page)) goto fail;
+	memset(&page, 0, sizeof page);
+	pageNo = newPageNo;
+      }
+      page.records[page.count++] = sorted[i];
+    }
+    if (!writePage(pageNo, &page)) goto fail;
+  }
+
+  // the pages on disk before a header that counts them
+  if (!syncFile(indexFile)) goto fail;
+
+  recordCount += pending.size();
+  pending.clear();
+  pendingMap.clear();
+  return writeHeader();
+
+ fail:
+  fprintf(stderr, "Error writing \"%s\": %s\n",
+	  indexPath.c_str(), strerror(errno));
+  return false;
+}
@@ -0,0 +1,190 @@
+#ifndef __TIERED_INDEX_H__
+#define __TIERED_INDEX_H__
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "u64.h"
+#include "u128.h"
+#include "bloom-filter.h"
+#include "manifest.h"
+
+// size of one page of the on-disk hash index
+#define TIERED_INDEX_PAGE_SIZE 4096
+
+// records per page; what's left of the page after a 32 byte page header
+#define TIERED_INDEX_PAGE_RECORDS 127
+
+// Consecutive records in the log form a container.  A lookup that has
+// to go to disk loads its whole container into the cache, on the bet
+// that chunks stored together will be looked up together again.
+#define TIERED_INDEX_CONTAINER_RECORDS 512
+
+// fraction of page slots used when sizing the index for an expected
+// number of records; the rest absorbs uneven page loads
+#define TIERED_INDEX_PAGE_FILL 0.75
+
+// number of inserts buffered in memory before they are written out
+#define TIERED_INDEX_WRITE_BATCH 65536
+
+
+// where a chunk is stored
+struct ChunkLocation {
+  u64 offset;
+  unsigned len;
+
+  ChunkLocation() : offset(0), len(0) {}
+  ChunkLocation(u64 o, unsigned l) : offset(o), len(l) {}
+};
+
+
+/*
+  Fingerprint index that keeps only a bounded working set in memory.
+
+  Tiers, checked in order on a lookup:
+   1. a CLOCK cache of recently used and prefetched records
+   2. inserts not yet written to disk
+   3. a Bloom filter of every fingerprint, so lookups of new chunks,
+      the common case when indexing, rarely touch the disk
+   4. an on-disk hash table of 4K pages, one read per lookup unless the
+      page has overflowed
+
+  Every record is also appended to a log in insertion order, and
+  TIERED_INDEX_CONTAINER_RECORDS consecutive records form a container.
+  When a lookup has to read a page, the container holding the match is
+  read from the log into the cache as well, so a backup that repeats an
+  earlier one finds the rest of its chunks in memory.
+
+  Memory use is the cache plus the filter (BLOOM_FILTER_BITS_PER_ENTRY
+  bits per record) plus up to TIERED_INDEX_WRITE_BATCH pending inserts.
+
+  Files: 'path' holds a header page, then the hash pages, then overflow
+  pages.  'path'.log holds the records.  The log is synced to disk
+  before the pages are written, and the pages before the header, and
+  records in the log past the count in the header are replayed on open,
+  so an interrupted flush() or a power loss loses nothing that reached
+  the log.  'path'.filter holds the filter as it was when the index was
+  last closed, along with the number of log records it covers, and the
+  header says whether it has been written.  open() loads it and adds
+  only the log records after those; without it, or if it can't be read,
+  open() rebuilds the filter from the whole log.
+*/
+class TieredIndex {
+ public:
+  // on disk and in the cache
+  struct Record {
+    u128 hash;
+    u64 offset;
+    unsigned len;
+    unsigned container;
+  };
+
+ private:
+  struct Page {
+    unsigned count;
+    unsigned unused;
+    // page number of the next page in this bucket's chain, or 0
+    u64 overflow;
+    u64 reserved[2];
+    Record records[TIERED_INDEX_PAGE_RECORDS];
+  };
+
+  struct CacheSlot {
+    Record rec;
+    // CLOCK reference bit
+    bool referenced;
+  };
+
+  std::string indexPath, logPath, filterPath;
+  FILE *indexFile, *logFile;
+
+  // number of hash pages (a power of 2) and of all pages, including
+  // the header page and overflow pages
+  u64 bucketCount, pageCount;
+
+  // number of records in the log and the pages
+  u64 recordCount;
+
+  // number of records the filter was sized for
+  u64 filterCapacity;
+
+  BlockedBloomFilter *filter;
+
+  // whether 'path'.filter has been written for this index, and the
+  // number of log records in it
+  bool filterSaved;
+  u64 savedFilterRecords;
+
+  std::vector<CacheSlot> cache;
+  size_t cacheCapacity, clockHand;
+  std::unordered_map<u128, size_t, ChunkHashHasher> cacheMap;
+
+  // inserts not yet written; indexes into pending by hash
+  std::vector<Record> pending;
+  std::unordered_map<u128, size_t, ChunkHashHasher> pendingMap;
+
+  u64 lookupCount, cacheHits, filterRejects, pageReads, containerReads;
+
+  TieredIndex(const char *path, size_t cacheEntries);
+
+  u64 bucketPage(const u128 &hash) const {
+    return 1 + (hash.hi & (bucketCount - 1));
+  }
+
+  bool readPage(u64 pageNo, Page *page);
+  bool writePage(u64 pageNo, const Page *page);
+  bool writeHeader();
+
+  // add a record to the cache, evicting with CLOCK if it's full
+  void cacheInsert(const Record &rec, bool referenced);
+
+  // look for hash in the on-disk pages
+  bool findOnDisk(const u128 &hash, Record *rec);
+
+  // read a container from the log into the cache
+  void prefetchContainer(unsigned container);
+
+  // add the records in the log from record number 'first' on to the
+  // filter, and those past recordCount to pending
+  bool scanLog(u64 first);
+
+  // read 'path'.filter if it matches this index, or return NULL
+  BlockedBloomFilter *loadFilter();
+
+  // write the filter to 'path'.filter
+  bool saveFilter();
+
+ public:
+  // Create a new index sized for about expectedRecords fingerprints,
+  // replacing any at 'path', that caches up to cacheEntries records.
+  // Returns NULL on error.
+  static TieredIndex *create(const char *path, u64 expectedRecords,
+			     size_t cacheEntries);
+
+  // Open an existing index.  Returns NULL on error.
+  static TieredIndex *open(const char *path, size_t cacheEntries);
+
+  // flushes pending inserts and saves the filter
+  ~TieredIndex();
+
+  // If hash is in the index, set *loc and return true.
+  bool lookup(const u128 &hash, ChunkLocation *loc);
+
+  // Add hash unless it's already there.  Returns true if it was added.
+  bool insert(const u128 &hash, const ChunkLocation &loc);
+
+  // write pending inserts to the log and the pages
+  bool flush();
+
+  u64 size() const {return recordCount + pending.size();}
+
+  u64 getLookupCount() const {return lookupCount;}
+  u64 getCacheHits() const {return cacheHits;}
+  u64 getFilterRejects() const {return filterRejects;}
+  u64 getPageReads() const {return pageReads;}
+  u64 getContainerReads() const {return containerReads;}
+};
+
+
+#endif // __TIERED_INDEX_H__
@@ -0,0 +1,301 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+#include "tree-scanner.h"
+#include "dedup-util.h"
+
+using namespace std;
+
+// bytes of directory entries read with each getdents64()
+#define SCAN_DIRENT_BUFFER (64*1024)
+
+
+namespace {
+
+struct InodeKey {
+  u64 device, inode;
+
+  bool operator == (const InodeKey &that) const {
+    return device == that.device && inode == that.inode;
+  }
+};
+
+struct InodeKeyHasher {
+  size_t operator () (const InodeKey &key) const {
+    return (size_t)(key.inode * 0x9E3779B97F4A7C15ULL ^ key.device);
+  }
+};
+
+// what scanTree() needs to know about a file
+struct FileStat {
+  bool isFile, isDirectory;
+  u64 device, inode, size, links;
+};
+
+struct ScanState {
+  int order;
+  vector<ScannedFile> &files;
+
+  // where each inode with more than one link is in files
+  unordered_map<InodeKey, size_t, InodeKeyHasher> linked;
+
+  ScanState(int order_, vector<ScannedFile> &files_)
+    : order(order_), files(files_) {}
+};
+
+}
+
+
+#ifndef _WIN32
+
+// Stat name in the directory dirFd, not following symbolic links.
+static bool statAt(int dirFd, const char *name, FileStat *st) {
+#if defined(__linux__) && defined(STATX_INO)
+  struct statx stx;
+  if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+	    STATX_TYPE | STATX_INO | STATX_SIZE | STATX_NLINK, &stx))
+    return false;
+  st->isFile = S_ISREG(stx.stx_mode);
+  st->isDirectory = S_ISDIR(stx.stx_mode);
+  st->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->inode = stx.stx_ino;
+  st->size = stx.stx_size;
+  st->links = stx.stx_nlink;
+#else
+  struct stat stats;
+  if (fstatat(dirFd, name, &stats, AT_SYMLINK_NOFOLLOW)) return false;
+  st->isFile = S_ISREG(stats.st_mode);
+  st->isDirectory = S_ISDIR(stats.st_mode);
+  st->device = stats.st_dev;
+  st->inode = stats.st_ino;
+  st->size = stats.st_size;
+  st->links = stats.st_nlink;
+#endif
+  return true;
+}
+
+
+// physical offset of the first extent of name in dirFd, or 0 if unknown
+static u64 firstExtent(int dirFd, const char *name) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+  int fd = openat(dirFd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) return 0;
+
+  // a struct fiemap with room for one extent
+  u64 request[(sizeof(struct fiemap) + sizeof(struct fiemap_extent))
+	      / sizeof(u64)];
+  memset(request, 0, sizeof request);
+  struct fiemap *map = (struct fiemap*) request;
+  map->fm_length = ~0ULL;
+  map->fm_extent_count = 1;
+
+  u64 physical = 0;
+  if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0
+      && !(map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN
+					  | FIEMAP_EXTENT_DATA_INLINE)))
+    physical = map->fm_extents[0].fe_physical;
+  ::close(fd);
+  return physical;
+#else
+  return 0;
+#endif
+}
+
+
+static void addFile(ScanState &state, int dirFd, const char *name,
+		    const string &path, const FileStat &st) {
+  if (st.links > 1) {
+    InodeKey key = {st.device, st.inode};
+    auto found = state.linked.find(key);
+    if (found != state.linked.end()) {
+      state.files[found->second].links.push_back(path);
+      return;
+    }
+    state.linked[key] = state.files.size();
+  }
+
+  ScannedFile file;
+  file.path = path;
+  file.device = st.device;
+  file.inode = st.inode;
+  file.size = st.size;
+  file.physical = state.order == SCAN_ORDER_EXTENT && st.size
+    ? firstExtent(dirFd, name) : 0;
+  state.files.push_back(file);
+}
+
+
+// Read the names in a directory, other than . and ..; each name is
+// paired with its d_type.
+static bool readDirectory(int dirFd,
+			  vector<pair<string, unsigned char> > &names) {
+#if defined(__linux__) && defined(SYS_getdents64)
+  // struct linux_dirent64, which glibc doesn't declare
+  struct Dirent64 {
+    u64 d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+  };
+
+  vector<char> buf(SCAN_DIRENT_BUFFER);
+  while (true) {
+    long n = syscall(SYS_getdents64, dirFd, buf.data(), buf.size());
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    if (n == 0) return true;
+    for (long pos = 0; pos < n; ) {
+      const Dirent64 *ent = (const Dirent64*) &buf[pos];
+      pos += ent->d_reclen;
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+      names.push_back(make_pair(string(ent->d_name), ent->d_type));
+    }
+  }
+#else
+  // fdopendir() takes over the descriptor, so give it a copy
+  int fd = dup(dirFd);
+  DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+  if (!dir) {
+    if (fd != -1) ::close(fd);
+    return false;
+  }
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+#ifdef DT_UNKNOWN
+    names.push_back(make_pair(string(ent->d_name), ent->d_type));
+#else
+    names.push_back(make_pair(string(ent->d_name), 0));
+#endif
+  }
+  closedir(dir);
+  return true;
+#endif
+}
+
+
+// Add the files under the open directory dirFd, whose path is prefix
+// (ending in '/'), then close dirFd.
+static void scanDirectory(ScanState &state, int dirFd, const string &prefix) {
+  vector<pair<string, unsigned char> > names;
+  if (!readDirectory(dirFd, names)) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", prefix.c_str(),
+	    strerror(errno));
+    ::close(dirFd);
+    return;
+  }
+
+  // files first, so their directory's descriptor is the only one open
+  // while they're stat'ed
+  vector<string> subdirectories;
+  for (size_t i=0; i < names.size(); i++) {
+    const char *name = names[i].first.c_str();
+    unsigned char type = names[i].second;
+#ifdef DT_UNKNOWN
+    if (type == DT_DIR) {
+      subdirectories.push_back(names[i].first);
+      continue;
+    }
+    if (type != DT_REG && type != DT_UNKNOWN) continue;
+#endif
+
+    FileStat st;
+    if (!statAt(dirFd, name, &st)) {
+      fprintf(stderr, "Cannot read \"%s%s\": %s\n", prefix.c_str(), name,
+	      strerror(errno));
+      continue;
+    }
+    if (st.isDirectory)
+      subdirectories.push_back(names[i].first);
+    else if (st.isFile)
+      addFile(state, dirFd, name, prefix + name, st);
+  }
+
+  for (size_t i=0; i < subdirectories.size(); i++) {
+    string path = prefix + subdirectories[i];
+    int fd = openat(dirFd, subdirectories[i].c_str(),
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+      // an unreadable subdirectory doesn't stop the walk
+      fprintf(stderr, "Cannot read \"%s\": %s\n", path.c_str(),
+	      strerror(errno));
+      continue;
+    }
+    scanDirectory(state, fd, path + '/');
+  }
+  ::close(dirFd);
+}
+
+#endif // !_WIN32
+
+
+static bool physicalOrder(const ScannedFile &a, const ScannedFile &b) {
+  if (a.device != b.device) return a.device < b.device;
+  if (a.physical != b.physical) return a.physical < b.physical;
+  return a.inode < b.inode;
+}
+
+
+bool scanTree(const char *root, int order, vector<ScannedFile> &files) {
+#ifdef _WIN32
+  vector<string> paths;
+  if (!listRegularFiles(root, paths)) return false;
+  for (size_t i=0; i < paths.size(); i++) {
+    ScannedFile file;
+    file.path = paths[i];
+    file.device = file.inode = file.physical = 0;
+    file.size = getFileSize(paths[i].c_str());
+    files.push_back(file);
+  }
+  return true;
+#else
+  ScanState state(order, files);
+  size_t first = files.size();
+
+  FileStat st;
+  if (!statAt(AT_FDCWD, root, &st)) {
+    fprintf(stderr, "Cannot read \"%s\": %s\n", root, strerror(errno));
+    return false;
+  }
+
+  if (st.isFile) {
+    addFile(state, AT_FDCWD, root, root, st);
+  } else if (st.isDirectory) {
+    int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "Cannot read \"%s\": %s\n", root, strerror(errno));
+      return false;
+    }
+    string prefix(root);
+    if (prefix.empty() || prefix[prefix.size()-1] != '/') prefix += '/';
+    scanDirectory(state, fd, prefix);
+  }
+
+  // with SCAN_ORDER_INODE every physical offset is 0
+  if (order != SCAN_ORDER_WALK)
+    stable_sort(files.begin() + first, files.end(), physicalOrder);
+  return true;
+#endif
+}
@@ -0,0 +1,50 @@
+#ifndef __TREE_SCANNER_H__
+#define __TREE_SCANNER_H__
+
+#include <string>
+#include <vector>
+#include "u64.h"
+
+// orders for scanTree()
+
+// the order the directories list them
+#define SCAN_ORDER_WALK 0
+
+// by device, then inode number; on most file systems inodes are
+// allocated near their data, so this roughly follows the disk
+#define SCAN_ORDER_INODE 1
+
+// by device, then the physical offset of the first extent (FIEMAP), so
+// a spinning disk reads the files in one sweep; files without a known
+// extent, such as empty or inline ones, go first in inode order
+#define SCAN_ORDER_EXTENT 2
+
+
+// one regular file found by scanTree()
+struct ScannedFile {
+  std::string path;
+  u64 device, inode, size;
+
+  // physical offset of the first extent, only with SCAN_ORDER_EXTENT
+  u64 physical;
+
+  // other paths to the same inode, which needn't be read again
+  std::vector<std::string> links;
+};
+
+
+/*
+  List every regular file under root, not following symbolic links, and
+  sort them by order (SCAN_ORDER_...).  If root is a regular file, it's
+  the only one listed.  Files that are hard links to an inode already
+  found are added to its links instead of being listed again.
+
+  On Linux directories are read with getdents64() and files are stat'ed
+  with statx(), relative to an open directory descriptor, so no path is
+  looked up twice.  An unreadable subdirectory is reported and skipped.
+  Returns false if root can't be read.
+*/
+bool scanTree(const char *root, int order, std::vector<ScannedFile> &files);
+
+
+#endif // __TREE_SCANNER_H__